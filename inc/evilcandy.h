@@ -9,6 +9,7 @@
 #include <lib/buffer.h>
 #include <lib/list.h>
 #include "instructions.h" /* TODO: remove */
+#include <setjmp.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -67,6 +68,7 @@ enum type_magic_t {
 enum {
         FE_FOR = 0x01,
         FE_TOP = 0x02,
+        FE_MAPPED = 0x04,
 };
 
 struct var_t;
@@ -78,8 +80,37 @@ struct frame_t;
 struct executable_t;
 struct token_t;
 
+/**
+ * struct gc_ops_t - How the cycle collector sees inside a container
+ * @traverse:   Call @visit for each variable the container holds a
+ *              reference to, with @arg as its second argument
+ * @clear:      Drop all of those references, leaving the container
+ *              empty but still valid
+ *
+ * See gc.c
+ */
+struct gc_ops_t {
+        void (*traverse)(void *handle,
+                         void (*visit)(struct var_t *, void *), void *arg);
+        void (*clear)(void *handle);
+};
+
+/**
+ * struct gc_head_t - First member of each handle that can be part of
+ *                    a reference cycle
+ * @list:       Link in the list of all such handles
+ * @ops:        How to look inside the handle
+ * @gc_refs:    Scratch space for gc_collect()
+ */
+struct gc_head_t {
+        struct list_t list;
+        const struct gc_ops_t *ops;
+        int gc_refs;
+};
+
 /**
  * struct object_handle_t - Descriptor for an object handle
+ * @gc:         Cycle collector's header, must be first
  * @children:   List of children members
  * @priv:       Internal private data, used by some built-in object types
  * @priv_cleanup: Way to clean up @priv if destroying this object handle.
@@ -87,15 +118,21 @@ struct token_t;
  *              simply freed.
  * @lock:       Prevent SETATTR, GETATTR during an iterable cycle, such as
  *              foreach.
+ * @version:    Changes whenever a child is added or removed.  No two
+ *              objects ever share a version number, so a (handle,
+ *              version) pair can be used to tell if a previous lookup
+ *              is still good.
  *
  * PRIVATE STRUCT, placed here so I can inline some things
  */
 struct object_handle_t {
+        struct gc_head_t gc;
         void *priv;
         void (*priv_cleanup)(struct object_handle_t *, void *);
         int nchildren;
         struct hashtable_t dict;
         unsigned int lock;
+        unsigned long long version;
 };
 
 /**
@@ -158,15 +195,18 @@ struct block_t {
         unsigned char type;
 };
 
-/* FIXME: Needs to be more private than this */
+/*
+ * FIXME: Needs to be more private than this
+ *
+ * @stack and @blocks must stay at the end, vmframe_alloc() does not
+ * clear them.
+ */
 struct vmframe_t {
         struct var_t *owner, *func;
         struct var_t **stackptr;
-        struct var_t *stack[FRAME_STACK_MAX];
         struct executable_t *ex;
         int ap;
         int n_blocks;
-        struct block_t blocks[FRAME_NEST_MAX];
         instruction_t *ppii;
         struct var_t **clo;
         struct vmframe_t *prev;
@@ -174,46 +214,39 @@ struct vmframe_t {
 #ifndef NDEBUG
         bool freed;
 #endif
+        struct var_t *stack[FRAME_STACK_MAX];
+        struct block_t blocks[FRAME_NEST_MAX];
 };
 
 /**
  * struct global_t - This program's global data, declared as q_
  * @gbl:        __gbl__, as the user sees it
- * @ns:         Linked list of all loaded files' opcodes in RAM.
  * @pc:         "program counter", often called PC in comments
- * @recursion:  For the RECURSION_INCR and RECURSION_DECR macros,
- *              to keep check on excess recursion with our eval()
- *              and expression() functions.
  * @frame:      Current stack, FP, SP, LR, etc.
  * @opt:        Command-line options
- * @executables: Active executable functions
  */
 struct global_t {
         struct var_t *gbl; /* "__gbl__" as user sees it */
-        int recursion;
         struct frame_t *frame;
         struct {
                 bool disassemble;
                 bool disassemble_only;
+                bool lazy;
+                bool cache;
+                bool jit;
+                bool trace;
+                bool emit_c;
+                bool memstats;
+                bool prof_alloc;
                 char *disassemble_outfile;
                 char *infile;
+                char *compile_dir;
         } opt;
-        struct list_t executables;
 };
 
-#define RECURSION_INCR() do { \
-        if (q_.recursion >= RECURSION_MAX) \
-                fail("Recursion overflow"); \
-        q_.recursion++; \
-} while (0)
-
-#define RECURSION_DECR() do { \
-        bug_on(q_.recursion <= 0); \
-        q_.recursion--; \
-} while (0)
-
-/* main.c */
+/* init.c */
 extern struct global_t q_;
+extern void init_lib(void);
 
 /* helpers to classify a variable */
 static inline bool isconst(struct var_t *v)
@@ -224,9 +257,18 @@ static inline bool isprivate(struct var_t *v)
 static inline bool isnumvar(struct var_t *v)
         { return v->magic == TYPE_INT || v->magic == TYPE_FLOAT; }
 
+/* allocprof.c */
+extern void allocprof_record(size_t size);
+extern void allocprof_init(void);
+extern void allocprof_report(void);
+
 /* assembler.c */
-extern struct executable_t *assemble(const char *source_file_name,
-                                     struct token_t *token_arr);
+struct lexer_t;
+extern struct executable_t *assemble(struct lexer_t *lex,
+                                     const char *source_file_name,
+                                     bool lazy);
+extern void assemble_lazy(struct executable_t *x);
+extern int assemble_verify(struct executable_t *x);
 
 /* builtin/builtin.c */
 extern void moduleinit_builtin(void);
@@ -247,6 +289,10 @@ extern void moduleinit_builtin(void);
                 once_ = true;           \
         }                               \
 } while (0)
+/* setjmp() return value when err_catch() catches something */
+enum { ERR_THROWN = -1 };
+extern jmp_buf *err_catch(jmp_buf *env);
+extern void err_throw(void);
 extern void syntax(const char *msg, ...);
 extern void fail(const char *msg, ...);
 extern void warning(const char *msg, ...);
@@ -262,6 +308,44 @@ extern void compile_lambda(struct var_t *v);
 /* disassemble.c */
 extern void disassemble_start(FILE *fp, const char *sourcefile_name);
 extern void disassemble(FILE *fp, struct executable_t *ex);
+extern int disassemble_script(const char *outfile, const char *sourcefile_name,
+                              struct executable_t *top);
+
+/* emit_c.c */
+extern int emit_c(const char *infile);
+
+/* gc.c */
+/**
+ * struct gc_stats_t - Cycle collector counters, see gc_stats()
+ * @n_collections: Number of times gc_collect() has run
+ * @n_freed:    Number of containers it has freed, in all
+ * @n_tracked:  Number of containers there are now
+ * @usec:       Total time spent collecting, in microseconds
+ */
+struct gc_stats_t {
+        unsigned long n_collections;
+        unsigned long n_freed;
+        unsigned long n_tracked;
+        unsigned long long usec;
+};
+extern void gc_track(struct gc_head_t *gc, const struct gc_ops_t *ops);
+extern void gc_untrack(struct gc_head_t *gc);
+extern unsigned long gc_collect(void);
+extern void gc_stats(struct gc_stats_t *stats);
+extern unsigned long gc_new_since;
+extern unsigned long gc_threshold;
+
+/*
+ * Collect cycles if enough containers have been made since last time.
+ * Only call this where every variable in use has a reference counted
+ * for it, like at the start of an instruction.
+ */
+static inline void
+gc_maybe_collect(void)
+{
+        if (gc_new_since >= gc_threshold)
+                gc_collect();
+}
 
 /* ewrappers.c */
 extern char *estrdup(const char *s);
@@ -283,12 +367,23 @@ extern int keyword_seek(const char *s);
 extern void moduleinit_keyword(void);
 
 /* lex.c */
-extern struct token_t *prescan(FILE *fp, const char *filename);
+extern struct lexer_t *lex_open(FILE *fp, const char *filename);
+extern struct lexer_t *lex_open_str(char *text, const char *filename,
+                                    int lineno);
+extern const char *lex_pos(struct lexer_t *lex);
+extern void lex_close(struct lexer_t *lex);
+extern int tokenize(struct lexer_t *lex, struct token_t *oc);
 extern void moduleinit_lex(void);
 
 /* literal.c */
 extern char *literal(const char *s);
 extern char *literal_put(const char *s);
+extern char *literal_put_ref(const char *s);
+extern void literal_incr_ref(const char *s);
+extern void literal_decr_ref(const char *s);
+extern void literal_set_threaded(bool threaded);
+struct memstat_t;
+extern void literal_stats(struct memstat_t *stats);
 extern void moduleinit_literal(void);
 
 /* load_file.c */
@@ -298,13 +393,252 @@ extern void load_file(const char *filename);
 extern void getloc_push(unsigned int (*getloc)(const char **, void *),
                         void *data);
 extern void getloc_pop(void);
+extern unsigned int getloc_depth(void);
+extern void getloc_unwind(unsigned int depth);
 extern unsigned int get_location(const char **file_name);
 
 /* mempool.c */
 struct mempool_t; /* opaque data type to user */
+/**
+ * struct mem_stats_t - Counters for a pool or size class
+ * @size:       Size of each chunk
+ * @n_alloc:    Number of allocations ever
+ * @n_free:     Number of frees ever
+ * @in_use:     Number of chunks allocated right now
+ * @peak:       Highest @in_use has been
+ * @n_slabs:    Number of slabs the chunks are in, not counting the
+ *              ones given back to the OS
+ * @n_spare:    Number of free chunks in those slabs
+ * @n_recent:   Number of freed chunks kept aside for the next
+ *              mem_alloc() of this size, mem_stats() only
+ */
+struct mem_stats_t {
+        size_t size;
+        unsigned long n_alloc;
+        unsigned long n_free;
+        unsigned long in_use;
+        unsigned long peak;
+        unsigned long n_slabs;
+        unsigned long n_spare;
+        unsigned long n_recent;
+};
+/* biggest size mem_alloc() doesn't just pass on to malloc() */
+#define MEM_MAX_CLASS 1024
+/* number of size classes, and of mem_stats() entries */
+#define MEM_N_STATS 20
+/* trim policies, see mem_set_trim() */
+enum {
+        MEM_TRIM_EXPLICIT = 0,
+        MEM_TRIM_IDLE,
+        MEM_TRIM_THRESHOLD,
+};
+/* bytes of empty slabs a pool may keep before MEM_TRIM_THRESHOLD trims */
+#define MEM_TRIM_DEFAULT (1024 * 1024)
+/* most chunks a size class keeps on its recent list */
+#define MEM_RECENT_MAX 256
+/**
+ * struct mem_class_t - A size class, per thread, see mempool.c
+ * @recent:     Recently freed chunks, each holding a pointer to the
+ *              next, for mem_alloc() to hand out first
+ * @n_recent:   Number of chunks in @recent
+ * @n_alloc:    Number of mem_alloc() calls for this class
+ * @n_free:     Number of mem_free() calls for this class
+ * @pool:       Where chunks come from when @recent is empty, and go
+ *              when it's full
+ */
+struct mem_class_t {
+        void *recent;
+        int n_recent;
+        unsigned long n_alloc;
+        unsigned long n_free;
+        struct mempool_t *pool;
+};
+extern __thread struct mem_class_t mem_classes[MEM_N_STATS];
 extern struct mempool_t *mempool_new(size_t datalen);
 extern void *mempool_alloc(struct mempool_t *pool);
 extern void mempool_free(struct mempool_t *pool, void *data);
+extern void mempool_stats(struct mempool_t *pool, struct mem_stats_t *stats);
+extern size_t mempool_trim(struct mempool_t *pool);
+extern void *mem_alloc__(size_t size);
+extern void mem_free__(void *p, size_t size);
+extern void *mem_realloc(void *p, size_t oldsize, size_t newsize);
+extern size_t mem_class_size(size_t size);
+extern int mem_stats(struct mem_stats_t *stats);
+extern size_t mem_trim(void);
+extern void mem_idle(void);
+extern void mem_set_trim(int policy, size_t threshold);
+
+/*
+ * Size class of @size, which is <= MEM_MAX_CLASS.  Sizes are 16 bytes
+ * apart up to 128, then four classes per power of two: 160, 192, 224,
+ * 256, 320, ... 1024.  That wastes at most a fifth of anything bigger
+ * than 128 bytes.
+ */
+static inline int
+mem_class(size_t size)
+{
+        int shift;
+
+        if (size <= 128)
+                return size ? (size - 1) >> 4 : 0;
+        shift = 8 * sizeof(unsigned long) - 1
+                - __builtin_clzl((unsigned long)(size - 1));
+        return 8 + (shift - 7) * 4
+               + (((size - 1) - (1ul << shift)) >> (shift - 2));
+}
+
+/**
+ * mem_alloc - Allocate memory for a small runtime object
+ * @size:       Size of the object
+ *
+ * The memory is not zeroed.  Errors are fatal, so this always returns
+ * something.
+ *
+ * Return: Pointer to the memory, which must be freed with mem_free()
+ * and the same @size, or anything that rounds to the same class.
+ */
+static inline void *
+mem_alloc(size_t size)
+{
+        struct mem_class_t *c;
+        void *p;
+
+        if (size > MEM_MAX_CLASS)
+                return mem_alloc__(size);
+        c = &mem_classes[mem_class(size)];
+        if ((p = c->recent) == NULL)
+                return mem_alloc__(size);
+        c->recent = *(void **)p;
+        c->n_recent--;
+        c->n_alloc++;
+        return p;
+}
+
+/**
+ * mem_free - Free memory from mem_alloc()
+ * @p:          Pointer returned by mem_alloc() or mem_realloc()
+ * @size:       Size that was asked for
+ */
+static inline void
+mem_free(void *p, size_t size)
+{
+        struct mem_class_t *c;
+
+        if (size > MEM_MAX_CLASS) {
+                mem_free__(p, size);
+                return;
+        }
+        c = &mem_classes[mem_class(size)];
+        if (c->n_recent >= MEM_RECENT_MAX) {
+                mem_free__(p, size);
+                return;
+        }
+        *(void **)p = c->recent;
+        c->recent = p;
+        c->n_recent++;
+        c->n_free++;
+}
+
+/* memstat.c */
+/**
+ * struct memstat_t - Counters for one kind of thing the program makes
+ * @n_alloc:    Number ever made
+ * @n_free:     Number ever freed
+ * @peak:       Most there have been at once
+ * @bytes:      Bytes they're using right now
+ * @peak_bytes: Most bytes they've used at once
+ * @n_cached:   Number freed but kept on a free list to be reused, for
+ *              the kinds that have one
+ *
+ * These are per thread, like mem_alloc()'s size classes, so a worker
+ * thread's counters aren't in the main thread's report.
+ */
+struct memstat_t {
+        unsigned long n_alloc;
+        unsigned long n_free;
+        unsigned long peak;
+        size_t bytes;
+        size_t peak_bytes;
+        unsigned long n_cached;
+};
+enum {
+        MS_VAR = 0,
+        MS_DICT,
+        MS_LIST,
+        MS_FUNCTION,
+        MS_STRING,
+        MS_BUCKET,
+        MS_BUFFER,
+        MS_FRAME,
+        MS_EXECUTABLE,
+        MS_LITERAL,
+        MS_N,
+};
+extern __thread struct memstat_t memstats[MS_N];
+extern void memstat_get(struct memstat_t *stats);
+extern const char *memstat_name(int kind);
+extern void memstat_rss(size_t *rss, size_t *peak);
+extern void memstat_report(int fd);
+extern void memstat_report_at_exit(void);
+extern void moduleinit_memstat(void);
+
+/**
+ * memstat_add_bytes - Add @size to @ms's bytes, keeping its peak
+ *
+ * For everything that makes @ms->bytes bigger, so @ms->peak_bytes
+ * can't miss any of it.
+ */
+static inline void
+memstat_add_bytes(struct memstat_t *ms, size_t size)
+{
+        ms->bytes += size;
+        if (ms->bytes > ms->peak_bytes)
+                ms->peak_bytes = ms->bytes;
+}
+
+/**
+ * memstat_alloc - Count a new @kind, see struct memstat_t
+ * @size:       Bytes it uses
+ */
+static inline void
+memstat_alloc(int kind, size_t size)
+{
+        struct memstat_t *ms = &memstats[kind];
+
+        ms->n_alloc++;
+        memstat_add_bytes(ms, size);
+        if (ms->n_alloc - ms->n_free > ms->peak)
+                ms->peak = ms->n_alloc - ms->n_free;
+}
+
+/**
+ * memstat_resize - Count a @kind that grew or shrank in place
+ * @oldsize:    Bytes it used, as given to memstat_alloc()
+ * @newsize:    Bytes it uses now, to give memstat_free() later
+ */
+static inline void
+memstat_resize(int kind, size_t oldsize, size_t newsize)
+{
+        struct memstat_t *ms = &memstats[kind];
+
+        if (newsize >= oldsize)
+                memstat_add_bytes(ms, newsize - oldsize);
+        else
+                ms->bytes -= oldsize - newsize;
+}
+
+/**
+ * memstat_free - Count a freed @kind
+ * @size:       Bytes it was using, same as for memstat_alloc()
+ */
+static inline void
+memstat_free(int kind, size_t size)
+{
+        struct memstat_t *ms = &memstats[kind];
+
+        ms->n_free++;
+        ms->bytes -= size;
+}
 
 /* op.c */
 extern struct var_t *qop_mul(struct var_t *a, struct var_t *b);
@@ -330,6 +664,24 @@ extern bool qop_cmpz(struct var_t *v);
 extern FILE *find_import(const char *cur_path, const char *file_name,
                          char *pathfill, size_t size);
 
+/* precompile.c */
+extern int precompile_dir(const char *dir);
+
+/* serialize.c */
+struct stat;
+extern struct var_t *evcc_rodata(struct executable_t *ex, int idx);
+extern struct executable_t *evcc_load(const char *src_path,
+                                      const char *file_name,
+                                      const struct stat *st);
+extern void evcc_save(const char *src_path, const struct stat *st,
+                      struct executable_t *top);
+extern bool evcc_image(struct buffer_t *b, const char *src_path,
+                       const struct stat *st, struct executable_t *top);
+extern struct executable_t *evcc_load_image(const void *image, size_t size,
+                                            const char *file_name);
+struct evcc_mapping_t;
+extern void evcc_mapping_put(struct evcc_mapping_t *map);
+
 /* var.c */
 extern struct var_t *var_new(void);
 /* note: v only evaluated once in VAR_*_REF() */
@@ -412,12 +764,21 @@ extern void string_init_from_file(struct var_t *ret, FILE *fp,
                                   int delim, bool stuff_delim);
 
 /* vm.c */
+/**
+ * struct vm_location_t - Where in a script something is happening,
+ *                        see vm_get_stack()
+ */
+struct vm_location_t {
+        const char *file_name;
+        unsigned int line;
+};
 extern void vm_execute(struct executable_t *top_level);
 extern void vm_reenter(struct var_t *func, struct var_t *owner,
                        int argc, struct var_t **argv);
 extern void moduleinit_vm(void);
 extern struct var_t *vm_get_this(void);
 extern struct var_t *vm_get_arg(unsigned int idx);
+extern int vm_get_stack(struct vm_location_t *loc, int max);
 /* TODO: Get rid of references ot frame_get_arg */
 # define frame_get_arg(i)       vm_get_arg(i)
 # define get_this()             vm_get_this()
@@ -0,0 +1,64 @@
+/* Auto-generated code, do not edit */
+/* (see tools/gen.c) */
+#ifndef EGQ_INSTRUCTION_DEFS_H
+#define EGQ_INSTRUCTION_DEFS_H
+enum {
+        INSTR_NOP = 0,
+        INSTR_LOAD,
+        INSTR_PUSH_LOCAL,
+        INSTR_PUSH_CONST,
+        INSTR_PUSH_PTR,
+        INSTR_POP,
+        INSTR_UNWIND,
+        INSTR_PUSH_BLOCK,
+        INSTR_POP_BLOCK,
+        INSTR_BREAK,
+        INSTR_ASSIGN,
+        INSTR_ASSIGN_ADD,
+        INSTR_ASSIGN_SUB,
+        INSTR_ASSIGN_MUL,
+        INSTR_ASSIGN_DIV,
+        INSTR_ASSIGN_MOD,
+        INSTR_ASSIGN_XOR,
+        INSTR_ASSIGN_LS,
+        INSTR_ASSIGN_RS,
+        INSTR_ASSIGN_OR,
+        INSTR_ASSIGN_AND,
+        INSTR_SYMTAB,
+        INSTR_PUSH_ZERO,
+        INSTR_RETURN_VALUE,
+        INSTR_CALL_FUNC,
+        INSTR_DEFFUNC,
+        INSTR_ADD_CLOSURE,
+        INSTR_ADD_DEFAULT,
+        INSTR_DEFLIST,
+        INSTR_LIST_APPEND,
+        INSTR_DEFDICT,
+        INSTR_ADDATTR,
+        INSTR_GETATTR,
+        INSTR_SETATTR,
+        INSTR_B_IF,
+        INSTR_B,
+        INSTR_JUMP_TABLE,
+        INSTR_BITWISE_NOT,
+        INSTR_NEGATE,
+        INSTR_LOGICAL_NOT,
+        INSTR_MUL,
+        INSTR_DIV,
+        INSTR_MOD,
+        INSTR_ADD,
+        INSTR_SUB,
+        INSTR_LSHIFT,
+        INSTR_RSHIFT,
+        INSTR_CMP,
+        INSTR_BINARY_AND,
+        INSTR_BINARY_OR,
+        INSTR_BINARY_XOR,
+        INSTR_LOGICAL_OR,
+        INSTR_LOGICAL_AND,
+        INSTR_INCR,
+        INSTR_DECR,
+        INSTR_END,
+        N_INSTR,
+};
+#endif /* EGQ_INSTRUCTION_DEFS_H */
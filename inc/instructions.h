@@ -3,8 +3,15 @@
 
 #include "instruction_defs.h"
 #include <lib/list.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
+struct jit_code_t;
+struct trace_set_t;
+struct evcc_mapping_t;
+struct vmframe_t;
+
 /* GETATTR, SETATTR, arg1 enumerations */
 enum {
         /* do not confuse with IARG_FLAG_CONST! */
@@ -54,6 +61,17 @@ enum {
         IARG_GT
 };
 
+/* PUSH_CONST arg1 enumerations */
+enum {
+        /* push a copy of the constant */
+        IARG_CONST_COPY = 0,
+        /*
+         * push the constant itself; the assembler proved that whatever
+         * pops it only reads it, see share_consts()
+         */
+        IARG_CONST_SHARE,
+};
+
 /*
  * ASSIGN, ADDATTR arg1 enumerations
  * (these are flags, not a sequence)
@@ -64,6 +82,12 @@ enum {
         IARG_FLAG_PRIV = 0x02,
 };
 
+/* JUMP_TABLE arg1 enumerations */
+enum {
+        IARG_JT_DENSE = 0,
+        IARG_JT_HASH,
+};
+
 /*
  * PUSH/POP_BLOCK args
  */
@@ -90,6 +114,75 @@ struct location_t {
         unsigned int offs;
 };
 
+/**
+ * struct jump_table_t - Dispatch table for a switch statement
+ * @dflt:       Branch offset if no case matches
+ * @min:        Case value of @offs[0], if the table is dense
+ * @n:          Number of entries in @offs
+ * @offs:       Branch offsets of each case.  Like INSTR_B, these are
+ *              relative to the instruction after JUMP_TABLE.
+ * @keys:       Case values of @offs[], if the table is hashed.  These
+ *              are rodata of the same executable.
+ * @htbl:       Hash table of @keys, whose data are the indexes into
+ *              @offs plus one; NULL if the table is dense
+ *
+ * Dense tables are indexed by the switch value minus @min, and are
+ * used when all the cases are integers close to each other.  Sparse
+ * integers and strings are looked up in @htbl.  String keys are
+ * literal_put() pointers, so they match by pointer alone.
+ */
+struct jump_table_t {
+        int dflt;
+        long long min;
+        int n;
+        int *offs;
+        struct var_t **keys;
+        struct hashtable_t *htbl;
+};
+
+/**
+ * struct lookup_cache_t - Saved result of a name or attribute lookup
+ * @v:          The result, borrowed from whoever owns it
+ * @oh:         Dictionary @v was looked up in: the object for GETATTR,
+ *              or ``this'' for PUSH_PTR SEEK.  NULL if not a dictionary.
+ * @ver:        Value of @oh->version at the time of the lookup
+ * @magic:      Type of the object, for when @oh is NULL
+ * @gver:       For SEEK, versions of the symbol table and of __gbl__
+ *              at the time of the lookup
+ *
+ * The VM keeps one of these per name in an executable's rodata, so
+ * that a loop calling Math.sqrt() does not search three hash tables for
+ * 'Math' and another for 'sqrt' every time around.  Adding or removing
+ * a dictionary's children changes its version, so an entry goes stale
+ * as soon as anything it depends on has changed.
+ */
+struct lookup_cache_t {
+        struct var_t *v;
+        struct object_handle_t *oh;
+        unsigned long long ver;
+        int magic;
+        unsigned long long gver[2];
+};
+
+/**
+ * struct lazy_body_t - Source of a function whose body has not been
+ *                      assembled yet, see assemble_lazy()
+ * @text:       Body of the function, from its '{' to the matching '}'
+ * @line:       Line number in the source file where @text starts
+ * @argv:       Names of the function's arguments
+ * @argc:       Number of arguments
+ * @clo:        Names of the function's closures
+ * @cp:         Number of closures
+ */
+struct lazy_body_t {
+        char *text;
+        int line;
+        char **argv;
+        int argc;
+        char **clo;
+        int cp;
+};
+
 /**
  * struct executable_t - Handle to the actual execution code of a
  *                       function or a script body
@@ -102,12 +195,9 @@ struct location_t {
  * @n_label:    Number of labels
  * @file_name:  Name of source file where this was defined
  * @file_line:  Starting line in source file where this was defined
- * @list:       Sibling list
- * @nref:       Reference count. Unlike other objects' reference count,
- *              this one starts at zero, since nothing has a handle to
- *              it.  Garbage collection will only occur if it is
- *              decremented back to zero from one.  (FIXME: Too many ways
- *              to count how this could go wrong.)  Except...
+ * @list:       Sibling list.  The top-level executable of a script is
+ *              the head of a ring of all the others assembled with it.
+ * @nref:       Reference count, see EXECUTABLE_CLAIM()
  * @locations:  Array that matches single-line expressions with line
  *              numbers in a script, used for splashing error messages.
  * @n_locations: Number of locations logged, ie. number of single-line
@@ -115,6 +205,37 @@ struct location_t {
  * @flags:      If FE_TOP is set, delete this after it has been executed
  *              once.  Do not delete anything it added to the symbol
  *              table, since later-executed code may use them.
+ *              If FE_MAPPED is set, @instr, @locations, and the @offs
+ *              of @jtabs point into a byte-code image (see serialize.c)
+ *              and must not be freed, and @rodata may have NULL slots
+ *              that evcc_rodata() fills in from @rodata_image.
+ * @jtabs:      Dispatch tables for JUMP_TABLE instructions
+ * @n_jtabs:    Number of dispatch tables
+ * @lazy:       If not NULL, the function body has not been assembled
+ *              yet, and this is where to find it.  Call assemble_lazy()
+ *              before executing.
+ * @max_stack:  Deepest the stack gets above the arguments, proven by
+ *              the assembler's stack verifier
+ * @n_args:     Number of arguments the function declares
+ * @n_closures: Number of closures the code expects its function to
+ *              have, ie. one more than the highest PUSH_PTR CP index
+ * @seek_cache: Lookup caches for PUSH_PTR SEEK, indexed like @rodata.
+ *              The VM allocates this the first time it needs it.
+ * @attr_cache: Same thing for GETATTR of a constant name
+ * @rodata_image: If FE_MAPPED, the image's table of constants
+ * @jit:        Machine code for this, or NULL if it hasn't been
+ *              translated, see jit.c
+ * @hot:        Count of calls and backward branches, for deciding
+ *              when to translate it
+ * @traces:     Loops in this that have been branched back to, and
+ *              their traces, see trace.c.  NULL until the first one.
+ * @native:     C function for this, if it's part of a program built
+ *              from the output of --emit-c, see emit_c.c.  It's run
+ *              the same way as @jit, and returns the same values as
+ *              jit_run().
+ * @mapping:    If FE_MAPPED from a cache file, the mapping shared by
+ *              all the executables from that file, unmapped when the
+ *              last of them is freed.  NULL if it's not ours to unmap.
  */
 struct executable_t {
         instruction_t *instr;
@@ -130,33 +251,100 @@ struct executable_t {
         struct location_t *locations;
         int n_locations;
         unsigned flags;
+        struct jump_table_t *jtabs;
+        int n_jtabs;
+        struct lazy_body_t *lazy;
+        int max_stack;
+        int n_args;
+        int n_closures;
+        struct lookup_cache_t *seek_cache;
+        struct lookup_cache_t *attr_cache;
+        const void *rodata_image;
+        struct jit_code_t *jit;
+        unsigned int hot;
+        struct trace_set_t *traces;
+        int (*native)(struct vmframe_t *fr);
+        struct evcc_mapping_t *mapping;
 };
 
 /*
- * FIXME: currently executable code has to stay in RAM for the duration
- * of the program.  Consider the exmample:
+ * An executable is freed when the last of these lets go of it:
+ *
+ * - Each function made from it, see function_init().
+ * - The XPTR constant in its parent's @rodata that DEFFUNC makes those
+ *   functions from.  So in
  *
  *      x.foreach(function(e, s) { ...code... });
  *
- * Because it is anonymously defined in the argument, it will go out of
- * scope after it is removed from x.foreach's argument stack, destroying
- * the code.  The next time an object's .foreach method is called, the
- * program will crash due to the executable code being deleted.
+ *   the code isn't freed along with the function when .foreach is
+ *   done with it, since the next pass through this line needs it
+ *   again.  It goes when the code around it goes.
+ * - For a script's top level, whoever got it from assemble() or
+ *   evcc_load(), until vm_execute() is done with it.
+ *
+ * A running frame's @ex is kept by the function in its @func, and the
+ * top level by vm_execute(), so code is never freed while it runs.
  */
-#if 1
-# define EXECUTABLE_CLAIM(ex) do { (void)0; } while (0)
-# define EXECUTABLE_RELEASE(ex) do { (void)0; } while (0)
-#else
-# define EXECUTABLE_CLAIM(ex) do { (ex)->nref++; } while (0)
-# define EXECUTABLE_RELEASE(ex) do { \
+#define EXECUTABLE_CLAIM(ex) do { (ex)->nref++; } while (0)
+#define EXECUTABLE_RELEASE(ex) do { \
         struct executable_t *ex_ = (ex); \
         ex_->nref--; \
         if (ex_->nref <= 0) \
                 executable_free__(ex_); \
 } while (0)
-#endif
 
 /* in assembler.c */
 extern void executable_free__(struct executable_t *ex);
+extern void executable_disown__(struct executable_t *ex);
+extern int jump_table_hash_keys(struct jump_table_t *jt);
+
+/**
+ * struct jit_hooks_t - What jit.c needs from vm.c
+ * @handlers:   The do_* functions, indexed by opcode
+ * @branch:     Pop and test the condition of a B_IF, return nonzero if
+ *              it branches
+ * @cmp_branch: Same thing for a CMP followed by a B_IF
+ * @frame:      Address of the VM's current-frame pointer
+ */
+struct jit_hooks_t {
+        void (*const *handlers)(struct vmframe_t *, instruction_t);
+        int (*branch)(struct vmframe_t *, instruction_t);
+        int (*cmp_branch)(struct vmframe_t *, instruction_t, instruction_t);
+        struct vmframe_t **frame;
+};
+
+/* jit_run() return values */
+enum {
+        JIT_LEAVE = 0,
+        JIT_END = 1,
+};
+
+/* in jit.c */
+extern bool jit_compile(struct executable_t *ex,
+                        const struct jit_hooks_t *hooks);
+extern int jit_run(struct vmframe_t *fr);
+extern void jit_free(struct jit_code_t *jit);
+
+/* in vm.c, for code written by emit_c.c */
+extern const struct jit_hooks_t *vm_jit_hooks(void);
+
+/* in emit_c.c, called by the programs it writes */
+extern int emit_c_run(const void *image, size_t size, const char *file_name,
+                      int (*const *fns)(struct vmframe_t *), int n_fns);
+
+/**
+ * struct trace_hooks_t - What trace.c needs from vm.c
+ * @handlers:   The do_* functions, indexed by opcode
+ * @varptr:     Get the variable a PUSH_PTR instruction would push
+ */
+struct trace_hooks_t {
+        void (*const *handlers)(struct vmframe_t *, instruction_t);
+        struct var_t *(*varptr)(struct vmframe_t *, instruction_t);
+};
+
+/* in trace.c */
+extern void trace_loop(struct vmframe_t *fr,
+                       const struct trace_hooks_t *hooks);
+extern void trace_free(struct trace_set_t *ts);
 
 #endif /* EGQ_INSTRUCTIONS_H */
@@ -23,6 +23,7 @@ struct hashtable_t {
         hash_t (*calc_hash)(const void *);
         bool (*key_match)(const void *, const void *);
         void (*delete_data)(void *);
+        void (*delete_key)(void *);
 };
 
 extern int hashtable_put(struct hashtable_t *htbl,
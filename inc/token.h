@@ -87,6 +87,9 @@ enum {
         KW_TRUE,
         KW_FALSE,
         KW_NULL,
+        KW_SWITCH,
+        KW_CASE,
+        KW_DEFAULT,
         N_KW,
 };
 
@@ -161,6 +164,9 @@ enum {
         OC_TRUE         = TO_KTOK(KW_TRUE),
         OC_FALSE        = TO_KTOK(KW_FALSE),
         OC_NULL         = TO_KTOK(KW_NULL),
+        OC_SWITCH       = TO_KTOK(KW_SWITCH),
+        OC_CASE         = TO_KTOK(KW_CASE),
+        OC_DEFAULT      = TO_KTOK(KW_DEFAULT),
 };
 
 /**
@@ -53,6 +53,10 @@ struct operator_methods_t {
  * @name:       Name of the type
  * @methods:    Linked list of built-in methods for the type; these are
  *              things scripts call as functions.
+ * @methods_tbl: Table that @methods has yet to be filled from, or NULL
+ *              if it already has been.  Most scripts never call a
+ *              method of most types, so this waits for the first
+ *              lookup instead of being done at startup.
  * @reset:      Callback to reset the variable, or NULL if no special
  *              action is needed.
  * @opm:        Callbacks for performing primitive operations like
@@ -61,6 +65,7 @@ struct operator_methods_t {
 struct type_t {
         const char *name;
         struct hashtable_t methods;
+        const struct type_inittbl_t *methods_tbl;
         void (*reset)(struct var_t *);
         const struct operator_methods_t *opm;
 };
@@ -0,0 +1,265 @@
+/*
+ * allocprof.c - Find out which lines of a script allocate the most
+ *
+ * With the -P alloc option, var_new() and type_handle_new() call
+ * allocprof_record(), which gets the script's call stack from
+ * vm_get_stack() and adds the allocation to that stack's counters.
+ * At exit, allocprof_report() does two things:
+ *
+ * 1. It prints the lines that allocated the most bytes to stderr,
+ *    adding up all the stacks with the same innermost line.
+ *
+ * 2. It writes every stack to ALLOCPROF_FOLDED, one per line with the
+ *    outermost call first and the number of bytes allocated there
+ *    last, the "folded" format flame graph tools read:
+ *
+ *      demo.egq:40;demo.egq:12 4096
+ *
+ * Allocations made while no script is running, such as those of the
+ * assembler or of setting up the built-in objects, are counted under
+ * "(no script)".
+ *
+ * vm_get_stack() finds each frame's line from its instruction pointer,
+ * which code translated by -j and -t doesn't keep up to date, so main()
+ * turns those off.  The counters aren't locked, so this can't be used
+ * with --compile's threads either.
+ */
+#include <evilcandy.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* deepest stack recorded, deeper ones lose their outermost calls */
+#define ALLOCPROF_MAX_DEPTH 64
+/* number of lines in the report */
+#define ALLOCPROF_TOP 25
+#define ALLOCPROF_FOLDED "evilcandy-alloc.folded"
+
+/**
+ * struct allocprof_stack_t - Counters for one call stack
+ * @hash:       Hash of @loc, see stack_hash()
+ * @count:      Number of allocations made with this stack
+ * @bytes:      Bytes allocated with this stack
+ * @n:          Length of @loc
+ * @loc:        The stack, innermost call first
+ */
+struct allocprof_stack_t {
+        hash_t hash;
+        unsigned long count;
+        unsigned long long bytes;
+        int n;
+        struct vm_location_t loc[];
+};
+
+static struct hashtable_t allocprof_stacks;
+
+/* scratch space for allocprof_record(), big enough for any stack */
+static struct allocprof_stack_t *allocprof_key;
+
+static hash_t
+stack_hash(const void *key)
+{
+        return ((struct allocprof_stack_t *)key)->hash;
+}
+
+static bool
+stack_match(const void *k1, const void *k2)
+{
+        const struct allocprof_stack_t *s1 = k1, *s2 = k2;
+
+        return s1->n == s2->n
+               && !memcmp(s1->loc, s2->loc, s1->n * sizeof(s1->loc[0]));
+}
+
+/* FNV-1a, like fnv_hash(), but of the pointers and numbers in @loc */
+static hash_t
+calc_stack_hash(struct vm_location_t *loc, int n)
+{
+        hash_t hash = 0x811c9dc5;
+        int i;
+
+        for (i = 0; i < n; i++) {
+                hash = (hash ^ (uintptr_t)loc[i].file_name) * 0x01000193;
+                hash = (hash ^ loc[i].line) * 0x01000193;
+        }
+        return hash;
+}
+
+/**
+ * allocprof_record - Count an allocation at the current script location
+ * @size:       Bytes allocated
+ *
+ * Called only if q_.opt.prof_alloc is set, after allocprof_init()
+ */
+void
+allocprof_record(size_t size)
+{
+        struct allocprof_stack_t *key = allocprof_key;
+        struct allocprof_stack_t *s;
+
+        key->n = vm_get_stack(key->loc, ALLOCPROF_MAX_DEPTH);
+        key->hash = calc_stack_hash(key->loc, key->n);
+
+        s = hashtable_get(&allocprof_stacks, key);
+        if (!s) {
+                size_t len = sizeof(*s) + key->n * sizeof(s->loc[0]);
+                s = emalloc(len);
+                memcpy(s, key, len);
+                s->count = 0;
+                s->bytes = 0;
+                hashtable_put(&allocprof_stacks, s, s);
+        }
+        s->count++;
+        s->bytes += size;
+}
+
+/* sort by innermost location, so the same lines are next to each other */
+static int
+stack_cmp_line(const void *a, const void *b)
+{
+        const struct allocprof_stack_t *s1 = *(void **)a;
+        const struct allocprof_stack_t *s2 = *(void **)b;
+        uintptr_t f1, f2;
+
+        if (s1->n == 0 || s2->n == 0)
+                return (s1->n != 0) - (s2->n != 0);
+        f1 = (uintptr_t)s1->loc[0].file_name;
+        f2 = (uintptr_t)s2->loc[0].file_name;
+        if (f1 != f2)
+                return f1 < f2 ? -1 : 1;
+        if (s1->loc[0].line != s2->loc[0].line)
+                return s1->loc[0].line < s2->loc[0].line ? -1 : 1;
+        return 0;
+}
+
+static int
+stack_cmp_bytes(const void *a, const void *b)
+{
+        const struct allocprof_stack_t *s1 = *(void **)a;
+        const struct allocprof_stack_t *s2 = *(void **)b;
+
+        if (s1->bytes != s2->bytes)
+                return s1->bytes > s2->bytes ? -1 : 1;
+        if (s1->count != s2->count)
+                return s1->count > s2->count ? -1 : 1;
+        return 0;
+}
+
+static void
+print_location(FILE *fp, struct allocprof_stack_t *s, int i)
+{
+        const char *file_name;
+
+        if (s->n == 0) {
+                fputs("(no script)", fp);
+                return;
+        }
+        file_name = s->loc[i].file_name;
+        fprintf(fp, "%s:%u", file_name ? file_name : "(null)",
+                s->loc[i].line);
+}
+
+static void
+write_folded(struct allocprof_stack_t **sv, size_t n)
+{
+        FILE *fp = fopen(ALLOCPROF_FOLDED, "w");
+        size_t i;
+        int j;
+
+        if (!fp) {
+                warning("Could not write %s", ALLOCPROF_FOLDED);
+                return;
+        }
+        for (i = 0; i < n; i++) {
+                struct allocprof_stack_t *s = sv[i];
+                for (j = s->n - 1; j > 0; j--) {
+                        print_location(fp, s, j);
+                        putc(';', fp);
+                }
+                print_location(fp, s, 0);
+                fprintf(fp, " %llu\n", s->bytes);
+        }
+        fclose(fp);
+        fprintf(stderr, "[EvilCandy] allocation stacks written to %s\n",
+                ALLOCPROF_FOLDED);
+}
+
+/**
+ * allocprof_report - atexit() callback for the -P alloc option
+ */
+void
+allocprof_report(void)
+{
+        struct allocprof_stack_t **sv, **lines;
+        unsigned int idx = 0;
+        size_t i, n = 0, n_lines = 0;
+        void *key, *val;
+
+        /* don't count what we do here */
+        q_.opt.prof_alloc = false;
+
+        sv = emalloc((allocprof_stacks.used + 1) * sizeof(*sv));
+        while (hashtable_iterate(&allocprof_stacks, &key, &val, &idx) == 0)
+                sv[n++] = val;
+
+        /*
+         * Add up stacks by their innermost line.  Each line's total
+         * goes in a struct allocprof_stack_t of its own, with just
+         * that one location.
+         */
+        lines = emalloc((n + 1) * sizeof(*lines));
+        qsort(sv, n, sizeof(*sv), stack_cmp_line);
+        for (i = 0; i < n; i++) {
+                struct allocprof_stack_t *s = sv[i];
+                struct allocprof_stack_t *l;
+
+                if (n_lines > 0
+                    && stack_cmp_line(&lines[n_lines - 1], &sv[i]) == 0) {
+                        l = lines[n_lines - 1];
+                } else {
+                        l = ecalloc(sizeof(*l) + sizeof(l->loc[0]));
+                        l->n = s->n ? 1 : 0;
+                        if (s->n)
+                                l->loc[0] = s->loc[0];
+                        lines[n_lines++] = l;
+                }
+                l->count += s->count;
+                l->bytes += s->bytes;
+        }
+
+        qsort(lines, n_lines, sizeof(*lines), stack_cmp_bytes);
+        fprintf(stderr,
+                "[EvilCandy] allocations by line, most bytes first:\n");
+        fprintf(stderr, "%12s %12s  %s\n", "bytes", "count", "line");
+        for (i = 0; i < n_lines && i < ALLOCPROF_TOP; i++) {
+                fprintf(stderr, "%12llu %12lu  ",
+                        lines[i]->bytes, lines[i]->count);
+                print_location(stderr, lines[i], 0);
+                putc('\n', stderr);
+        }
+        if (n_lines > ALLOCPROF_TOP) {
+                fprintf(stderr, "(%lu more lines)\n",
+                        (unsigned long)(n_lines - ALLOCPROF_TOP));
+        }
+
+        qsort(sv, n, sizeof(*sv), stack_cmp_bytes);
+        write_folded(sv, n);
+
+        for (i = 0; i < n_lines; i++)
+                free(lines[i]);
+        free(lines);
+        free(sv);
+}
+
+/**
+ * allocprof_init - Start counting allocations, for the -P alloc option
+ */
+void
+allocprof_init(void)
+{
+        hashtable_init(&allocprof_stacks, stack_hash, stack_match, free);
+        allocprof_key = emalloc(sizeof(*allocprof_key)
+                        + ALLOCPROF_MAX_DEPTH * sizeof(allocprof_key->loc[0]));
+        atexit(allocprof_report);
+}
@@ -16,6 +16,7 @@
 /* TODO: define instr_t and use sizeof() here */
 #define INSTR_SIZE      sizeof(instruction_t)
 #define DATA_ALIGN_SIZE 8
+#define LOOKBACK_SIZE   8
 
 #define PAD_ALIGN(x) \
         (DATA_ALIGN_SIZE - (((x) * INSTR_SIZE) & (DATA_ALIGN_SIZE-1)))
@@ -50,6 +51,8 @@ enum {
         AE_NOTIMPL,
         AE_ARGNAME,
         AE_BADINSTR,
+        AE_DUPCASE,
+        AE_STACK,
 };
 
 enum {
@@ -81,6 +84,10 @@ enum {
  * @label_alloc: Bytes currently allocated for @x->label
  * @instr_alloc: Bytes currently allocated for @x->instr
  * @location_alloc: Bytes currently allocated for @x->locations
+ * @jtab_alloc: Bytes currently allocated for @x->jtabs
+ * @consts:     Index into @x->rodata, keyed by the rodata variables'
+ *              values, so seeking a constant does not require a scan
+ *              of the whole array.
  * @x:          Executable code being built up by this assembler.
  *
  * This wraps @x (the true intended result of this assembly, and will
@@ -106,14 +113,21 @@ struct as_frame_t {
         size_t label_alloc;
         size_t instr_alloc;
         size_t location_alloc;
+        size_t jtab_alloc;
+        struct hashtable_t consts;
         struct executable_t *x;
 };
 
 /**
  * struct assemble_t - The top-level assembler, contains all the
  *                     function definitions in the same source file.
- * @prog:       The full array of tokens for input file
- * @oc:         Pointer into @prog
+ * @oc:         Pointer to the current token in @lookback
+ * @lookback:   Ring of the most recently lexed tokens.  Tokens are
+ *              pulled from the lexer on demand; this only needs to be
+ *              big enough for as_unlex() and for the few places that
+ *              hold on to a token pointer while lexing ahead.
+ * @lb_pos:     Sequence number of @oc
+ * @lb_end:     Sequence number of the next token to get from the lexer
  * @func:       Label number for next function
  * @env:        Buffer to longjmp from in case of error
  * @active_frames:
@@ -125,16 +139,31 @@ struct as_frame_t {
  *              Linked list of frames that have been fully parsed.
  * @fr:         Current active frame, should be last member of
  *              @active frames
+ * @funcs:      Array of all frames, indexed by their @funcno, for
+ *              resolving DEFFUNC instructions in the second pass.
+ * @funcs_alloc: Bytes currently allocated for @funcs
+ * @lex:        Where the tokens come from
+ * @lazy:       Leave the bodies of top-level functions for
+ *              assemble_lazy(), see assemble_function_lazy()
+ * @recursion:  Nesting depth of assemble_expression(), kept here
+ *              instead of in q_ so that threads don't share it
  */
 struct assemble_t {
         char *file_name;
-        struct token_t *prog;
         struct token_t *oc;
+        struct token_t lookback[LOOKBACK_SIZE];
+        unsigned long lb_pos;
+        unsigned long lb_end;
         int func;
         jmp_buf env;
         struct list_t active_frames;
         struct list_t finished_frames;
         struct as_frame_t *fr;
+        struct as_frame_t **funcs;
+        size_t funcs_alloc;
+        struct lexer_t *lex;
+        bool lazy;
+        int recursion;
 };
 
 static void assemble_eval(struct assemble_t *a);
@@ -144,6 +173,31 @@ static void assemble_expression(struct assemble_t *a,
 static inline bool frame_is_top(struct assemble_t *a)
         { return a->active_frames.next == &a->fr->list; }
 
+static void
+lazy_body_free(struct lazy_body_t *lz)
+{
+        if (lz->text)
+                free(lz->text);
+        if (lz->argv)
+                free(lz->argv);
+        if (lz->clo)
+                free(lz->clo);
+        free(lz);
+}
+
+static void
+jump_table_free(struct jump_table_t *jt)
+{
+        if (jt->offs)
+                free(jt->offs);
+        if (jt->keys)
+                free(jt->keys);
+        if (jt->htbl) {
+                hashtable_destroy(jt->htbl);
+                free(jt->htbl);
+        }
+}
+
 /*
  * This function wrapped by public macros
  * EXECUTABLE_CLAIM and EXECUTABLE_RELEASE
@@ -157,21 +211,128 @@ static inline bool frame_is_top(struct assemble_t *a)
 void
 executable_free__(struct executable_t *ex)
 {
-        if (ex->instr)
+        bool mapped = !!(ex->flags & FE_MAPPED);
+
+        if (ex->instr && !mapped)
                 free(ex->instr);
         if (ex->rodata) {
                 int i;
-                for (i = 0; i < ex->n_rodata; i++)
-                        VAR_DECR_REF(ex->rodata[i]);
+                for (i = 0; i < ex->n_rodata; i++) {
+                        /* could be unbuilt if @mapped */
+                        if (ex->rodata[i])
+                                VAR_DECR_REF(ex->rodata[i]);
+                }
+                free(ex->rodata);
         }
         if (ex->label)
                 free(ex->label);
-        if (ex->locations)
+        if (ex->locations && !mapped)
                 free(ex->locations);
+        if (ex->jtabs) {
+                int i;
+                for (i = 0; i < ex->n_jtabs; i++) {
+                        if (mapped)
+                                ex->jtabs[i].offs = NULL;
+                        jump_table_free(&ex->jtabs[i]);
+                }
+                free(ex->jtabs);
+        }
+        if (ex->lazy)
+                lazy_body_free(ex->lazy);
+        if (ex->seek_cache)
+                free(ex->seek_cache);
+        if (ex->attr_cache)
+                free(ex->attr_cache);
+        if (ex->jit)
+                jit_free(ex->jit);
+        if (ex->traces)
+                trace_free(ex->traces);
+        if (ex->mapping)
+                evcc_mapping_put(ex->mapping);
         list_remove(&ex->list);
+        memstat_free(MS_EXECUTABLE, sizeof(*ex));
         free(ex);
 }
 
+/**
+ * executable_disown__ - Keep @ex from releasing the executables its
+ *                       XPTR constants hold when it's freed
+ *
+ * This is for error paths that free every executable of a script
+ * with executable_free__() themselves, whatever their @nref.
+ */
+void
+executable_disown__(struct executable_t *ex)
+{
+        int i;
+        for (i = 0; i < ex->n_rodata; i++) {
+                struct var_t *v = ex->rodata[i];
+                if (v && v->magic == TYPE_XPTR)
+                        v->magic = TYPE_EMPTY;
+        }
+}
+
+static hash_t
+const_hash(const void *key)
+{
+        const struct var_t *v = key;
+        uint64_t bits;
+
+        switch (v->magic) {
+        case TYPE_INT:
+                bits = (uint64_t)v->i;
+                break;
+        case TYPE_FLOAT:
+                /* so that 0.0 and -0.0 land together, like '==' */
+                if (v->f == 0.0) {
+                        bits = 0;
+                        break;
+                }
+                memcpy(&bits, &v->f, sizeof(bits));
+                break;
+        case TYPE_STRPTR:
+                return ptr_hash(v->strptr);
+        case TYPE_XPTR:
+                return ptr_hash(v->xptr);
+        default:
+                bug();
+                return 0;
+        }
+        /*
+         * Sequential integers are the common case for data tables.
+         * Multiply by an odd constant so they scatter across the
+         * table, and fold the high bits back down for perturbation.
+         */
+        bits *= 0x9e3779b97f4a7c15ull;
+        return bits ^ (bits >> 32);
+}
+
+static bool
+const_key_match(const void *k1, const void *k2)
+{
+        const struct var_t *a = k1, *b = k2;
+        if (a->magic != b->magic)
+                return false;
+        switch (a->magic) {
+        case TYPE_INT:
+                return a->i == b->i;
+        case TYPE_FLOAT:
+                return a->f == b->f;
+        case TYPE_STRPTR:
+                return a->strptr == b->strptr;
+        case TYPE_XPTR:
+                return a->xptr == b->xptr;
+        }
+        bug();
+        return false;
+}
+
+/* @consts does not own its data, they're just indexes into rodata */
+static void
+const_bucket_delete(void *data)
+{
+}
+
 static void
 as_frame_push(struct assemble_t *a, int funcno)
 {
@@ -182,10 +343,13 @@ as_frame_push(struct assemble_t *a, int funcno)
 
         fr->funcno = funcno;
         fr->x = ecalloc(sizeof(*(fr->x)));
+        memstat_alloc(MS_EXECUTABLE, sizeof(*(fr->x)));
         list_init(&fr->x->list);
         fr->x->file_name = a->file_name;
         fr->x->file_line = a->oc->line;
         fr->x->n_label = JMP_INIT;
+        hashtable_init(&fr->consts, const_hash,
+                       const_key_match, const_bucket_delete);
 
         list_init(&fr->list);
         list_add_tail(&fr->list, &a->active_frames);
@@ -288,11 +452,19 @@ static void
 as_delete_frame_list(struct list_t *parent_list, int err)
 {
         struct list_t *li, *tmp;
+        if (err) {
+                list_foreach(li, parent_list) {
+                        struct as_frame_t *fr = list2frame(li);
+                        if (fr->x)
+                                executable_disown__(fr->x);
+                }
+        }
         list_foreach_safe(li, tmp, parent_list) {
                 struct as_frame_t *fr = list2frame(li);
                 list_remove(&fr->list);
                 if (err && fr->x)
                         executable_free__(fr->x);
+                hashtable_destroy(&fr->consts);
                 free(fr);
         }
 }
@@ -308,15 +480,25 @@ static void
 as_unlex(struct assemble_t *a)
 {
         /* "minus one" should be fine */
-        bug_on(a->oc < a->prog);
-        a->oc--;
+        bug_on(a->lb_pos == 0);
+        /* backed up further than we remember */
+        bug_on(a->lb_end - a->lb_pos >= LOOKBACK_SIZE);
+        a->lb_pos--;
+        a->oc = &a->lookback[a->lb_pos % LOOKBACK_SIZE];
 }
 
 static int
 as_lex(struct assemble_t *a)
 {
-        if (a->oc->t != EOF)
-                a->oc++;
+        if (a->oc->t == EOF)
+                return EOF;
+
+        a->lb_pos++;
+        a->oc = &a->lookback[a->lb_pos % LOOKBACK_SIZE];
+        if (a->lb_pos == a->lb_end) {
+                tokenize(a->lex, a->oc);
+                a->lb_end++;
+        }
         return a->oc->t;
 }
 
@@ -452,44 +634,55 @@ as_next_label(struct assemble_t *a)
 }
 
 /*
- * ie pointer to the execution struct of a function.
- * Different instances of functions have their own metadata,
- * but if a function was created as, perhaps, a return value
- * of another function, the *executable* part will always
- * point to this.
+ * Return index into a->fr->x->rodata of constant matching @key,
+ * or -1 if it is not there yet.
  */
 static int
-seek_or_add_const_xptr(struct assemble_t *a, void *p)
+const_seek(struct assemble_t *a, struct var_t *key)
+{
+        /* data is stored as index+1, so that zero is not NULL */
+        void *p = hashtable_get(&a->fr->consts, key);
+        return p ? (int)((uintptr_t)p - 1) : -1;
+}
+
+/* Append @v to rodata and index it, return its index */
+static int
+const_add(struct assemble_t *a, struct var_t *v)
 {
-        int i;
-        struct var_t *v;
         struct as_frame_t *fr = a->fr;
         struct executable_t *x = fr->x;
-        for (i = 0; i < x->n_rodata; i++) {
-                v = x->rodata[i];
-                if (v->magic == TYPE_XPTR && v->xptr == p)
-                        break;
-        }
+        int i = x->n_rodata;
 
-        if (i == x->n_rodata) {
-                as_assert_array_pos(a, x->n_rodata + 1,
-                                    &x->rodata, &fr->const_alloc);
-                v = var_new();
-                v->magic = TYPE_XPTR;
-                v->xptr = p;
-                x->rodata[x->n_rodata++] = v;
-        }
+        /* must fit in an instruction's arg2 */
+        as_err_if(a, i >= 32768, AE_OVERFLOW);
+        as_assert_array_pos(a, i + 1, &x->rodata, &fr->const_alloc);
+
+        x->rodata[i] = v;
+        x->n_rodata++;
+        hashtable_put(&fr->consts, v, (void *)(uintptr_t)(i + 1));
         return i;
 }
 
+/*
+ * ie pointer to the execution struct of a function.
+ * Different instances of functions have their own metadata,
+ * but if a function was created as, perhaps, a return value
+ * of another function, the *executable* part will always
+ * point to this.  The constant holds a reference to it, see
+ * EXECUTABLE_CLAIM().
+ */
 static int
-seek_const_int(struct assemble_t *a, struct executable_t *x, long long vi)
+seek_or_add_const_xptr(struct assemble_t *a, void *p)
 {
         int i;
-        for (i = 0; i < x->n_rodata; i++) {
-                struct var_t *v = x->rodata[i];
-                if (v->magic == TYPE_INT && v->i == vi)
-                        break;
+        struct var_t key = { .magic = TYPE_XPTR, .xptr = p };
+
+        if ((i = const_seek(a, &key)) < 0) {
+                struct var_t *v = var_new();
+                v->magic = TYPE_XPTR;
+                v->xptr = p;
+                i = const_add(a, v);
+                EXECUTABLE_CLAIM((struct executable_t *)p);
         }
         return i;
 }
@@ -499,67 +692,49 @@ static int
 seek_or_add_const(struct assemble_t *a, struct token_t *oc)
 {
         int i;
-        struct as_frame_t *fr = a->fr;
-        struct executable_t *x = fr->x;
-        struct var_t *v;
+        struct var_t key = { .magic = TYPE_EMPTY };
+
         switch (oc->t) {
         case 'i':
-                i = seek_const_int(a, x, oc->i);
+                key.magic = TYPE_INT;
+                key.i = oc->i;
                 break;
         case 'f':
-                for (i = 0; i < x->n_rodata; i++) {
-                        v = x->rodata[i];
-                        if (v->magic == TYPE_FLOAT && v->f == oc->f)
-                                break;
-                }
+                key.magic = TYPE_FLOAT;
+                key.f = oc->f;
                 break;
         case 'u':
         case 'q':
-                for (i = 0; i < x->n_rodata; i++) {
-                        v = x->rodata[i];
-                        if (v->magic == TYPE_STRPTR
-                            && v->strptr == oc->s) {
-                                break;
-                        }
-                }
+                key.magic = TYPE_STRPTR;
+                key.strptr = oc->s;
                 break;
         case OC_TRUE:
-                i = seek_const_int(a, x, 1LL);
+                key.magic = TYPE_INT;
+                key.i = 1LL;
                 break;
         case OC_FALSE:
-                i = seek_const_int(a, x, 0LL);
+                key.magic = TYPE_INT;
+                key.i = 0LL;
                 break;
         default:
-                i = 0; /* satisfied, compiler? */
                 bug();
         }
 
-        if (i == x->n_rodata) {
-                as_assert_array_pos(a, x->n_rodata + 1,
-                                    &x->rodata, &fr->const_alloc);
-
-                v = var_new();
-                switch (oc->t) {
-                case OC_TRUE:
-                        integer_init(v, 1);
-                        break;
-                case OC_FALSE:
-                        integer_init(v, 0);
+        if ((i = const_seek(a, &key)) < 0) {
+                struct var_t *v = var_new();
+                switch (key.magic) {
+                case TYPE_INT:
+                        integer_init(v, key.i);
                         break;
-                case 'i':
-                        integer_init(v, oc->i);
+                case TYPE_FLOAT:
+                        float_init(v, key.f);
                         break;
-                case 'f':
-                        float_init(v, oc->f);
-                        break;
-                case 'u':
-                case 'q':
+                case TYPE_STRPTR:
                         v->magic = TYPE_STRPTR;
-                        v->strptr = oc->s;
+                        v->strptr = key.strptr;
                         break;
                 }
-
-                x->rodata[x->n_rodata++] = v;
+                i = const_add(a, v);
         }
         return i;
 }
@@ -624,6 +799,85 @@ assemble_function(struct assemble_t *a, bool lambda, int funcno)
         add_instr(a, INSTR_RETURN_VALUE, 0, 0);
 }
 
+/* helper to assemble_function_lazy */
+static char **
+copy_names(char **names, int n)
+{
+        char **ret;
+        if (!n)
+                return NULL;
+        ret = emalloc(n * sizeof(*ret));
+        memcpy(ret, names, n * sizeof(*ret));
+        return ret;
+}
+
+/*
+ * Only functions defined at the top level may be assembled lazily.
+ * Deeper functions may need to add closures to their parents while
+ * they are being assembled, and by the time they are first called,
+ * their parents have long since been assembled.
+ */
+static bool
+frame_may_be_lazy(struct assemble_t *a)
+{
+        return a->lazy && a->fr->list.prev == a->active_frames.next;
+}
+
+/*
+ * Skip over a function body without assembling it, only matching
+ * braces.  Save enough of it in the frame's executable that
+ * assemble_lazy() can finish the job when the function is first
+ * called.
+ */
+static void
+assemble_function_lazy(struct assemble_t *a, int funcno)
+{
+        struct as_frame_t *fr = a->fr;
+        struct lazy_body_t *lz;
+        const char *start;
+        size_t len;
+        int line, depth;
+
+        if (as_lex(a) != OC_LBRACE || a->lb_pos + 1 != a->lb_end) {
+                /*
+                 * Not a {...} body, or we've lexed ahead and so
+                 * lex_pos() can't tell us where it starts.
+                 */
+                as_unlex(a);
+                assemble_function(a, false, funcno);
+                return;
+        }
+
+        /* we just lexed the '{' */
+        start = lex_pos(a->lex) - 1;
+        line = a->oc->line;
+        depth = 1;
+        do {
+                switch (as_lex(a)) {
+                case OC_LBRACE:
+                        depth++;
+                        break;
+                case OC_RBRACE:
+                        depth--;
+                        break;
+                case EOF:
+                        as_err(a, AE_BRACE);
+                }
+        } while (depth > 0);
+
+        len = lex_pos(a->lex) - start;
+        lz = emalloc(sizeof(*lz));
+        lz->text = emalloc(len + 1);
+        memcpy(lz->text, start, len);
+        lz->text[len] = '\0';
+        lz->line = line;
+        lz->argv = copy_names(fr->argv, fr->argc);
+        lz->argc = fr->argc;
+        lz->clo = copy_names(fr->clo, fr->cp);
+        lz->cp = fr->cp;
+        fr->x->lazy = lz;
+}
+
 static void
 assemble_funcdef(struct assemble_t *a, bool lambda)
 {
@@ -634,6 +888,8 @@ assemble_funcdef(struct assemble_t *a, bool lambda)
         as_errlex(a, OC_LPAR);
 
         as_frame_push(a, funcno);
+        as_assert_array_pos(a, funcno, &a->funcs, &a->funcs_alloc);
+        a->funcs[funcno] = a->fr;
 
         do {
                 bool closure = false;
@@ -670,8 +926,11 @@ assemble_funcdef(struct assemble_t *a, bool lambda)
                         a->fr->clo[a->fr->cp++] = name;
                 } else {
                         if (deflt) {
+                                /* this frame's argc, not the parent's */
+                                int argno = a->fr->argc;
+
                                 as_frame_swap(a);
-                                add_instr(a, INSTR_ADD_DEFAULT, 0, a->fr->argc);
+                                add_instr(a, INSTR_ADD_DEFAULT, 0, argno);
                                 as_frame_swap(a);
                         }
 
@@ -681,7 +940,10 @@ assemble_funcdef(struct assemble_t *a, bool lambda)
         } while (a->oc->t == OC_COMMA);
         as_err_if(a, a->oc->t != OC_RPAR, AE_PAR);
 
-        assemble_function(a, lambda, funcno);
+        if (!lambda && frame_may_be_lazy(a))
+                assemble_function_lazy(a, funcno);
+        else
+                assemble_function(a, lambda, funcno);
         as_frame_pop(a);
 }
 
@@ -1234,8 +1496,16 @@ assemble_ident_helper(struct assemble_t *a, unsigned int flags)
 
         as_lex(a);
 
-        if (a->oc->t == OC_SEMI)
-                return; /* empty statement? are we ok with this? */
+        if (a->oc->t == OC_SEMI) {
+                /*
+                 * Bare identifier, like `if (x) foo;'.  Throw away
+                 * what ainstr_push_symbol() pushed, or the depth
+                 * would depend on which way the branch went, see
+                 * verify_stack().
+                 */
+                add_instr(a, INSTR_POP, 0, 0);
+                return;
+        }
 
         for (;;) {
                 int namei;
@@ -1347,9 +1617,13 @@ assemble_ident_helper(struct assemble_t *a, unsigned int flags)
         }
 
 done:
+        /*
+         * Unlike in eval8, there's no result on top to save, only the
+         * parents the GETATTRs left behind, so don't use INSTR_UNWIND.
+         */
         bug_on(inbal < 0);
-        if (inbal)
-                add_instr(a, INSTR_UNWIND, 0, inbal);
+        while (inbal-- > 0)
+                add_instr(a, INSTR_POP, 0, 0);
 
         if (!!(flags & FE_FOR))
                 as_errlex(a, OC_RPAR);
@@ -1489,6 +1763,7 @@ static void
 assemble_while(struct assemble_t *a)
 {
         int start = as_next_label(a);
+        int done  = as_next_label(a);
         int skip  = as_next_label(a);
 
         add_instr(a, INSTR_PUSH_BLOCK, IARG_LOOP, 0);
@@ -1500,10 +1775,15 @@ assemble_while(struct assemble_t *a)
         assemble_eval(a);
         as_errlex(a, OC_RPAR);
 
-        add_instr(a, INSTR_B_IF, 0, skip);
+        /*
+         * A false condition still has the loop's block to pop.  'break'
+         * pops it itself, so it skips the POP_BLOCK.
+         */
+        add_instr(a, INSTR_B_IF, 0, done);
         assemble_expression(a, 0, skip);
         add_instr(a, INSTR_B, 0, start);
 
+        as_set_label(a, done);
         apop_scope(a);
         add_instr(a, INSTR_POP_BLOCK, 0, 0);
 
@@ -1594,6 +1874,189 @@ assemble_load(struct assemble_t *a)
         as_errlex(a, OC_SEMI);
 }
 
+/**
+ * jump_table_hash_keys - Build the hash table of a sparse switch
+ * @jt: Table whose @keys and @n are filled in
+ *
+ * Return: 0 if OK, -1 if two keys are the same
+ */
+int
+jump_table_hash_keys(struct jump_table_t *jt)
+{
+        int i;
+
+        jt->htbl = emalloc(sizeof(*jt->htbl));
+        hashtable_init(jt->htbl, const_hash,
+                       const_key_match, const_bucket_delete);
+        for (i = 0; i < jt->n; i++) {
+                void *data = (void *)(uintptr_t)(i + 1);
+                if (hashtable_put(jt->htbl, jt->keys[i], data) < 0)
+                        return -1;
+        }
+        return 0;
+}
+
+/*
+ * Helper to assemble_switch: fill in the dispatch table @jt for cases
+ * whose values are the rodata at indexes @keys and which start at
+ * @labels.  Labels are converted to branch offsets later, in
+ * resolve_jump_table().
+ *
+ * Return: IARG_JT_DENSE or IARG_JT_HASH
+ */
+static int
+switch_fill_table(struct assemble_t *a, struct jump_table_t *jt,
+                  int *keys, int *labels, int ncase)
+{
+        struct executable_t *x = a->fr->x;
+        long long min = 0, max = 0;
+        bool dense = true;
+        int i;
+
+        for (i = 0; i < ncase; i++) {
+                struct var_t *k = x->rodata[keys[i]];
+                if (k->magic != TYPE_INT) {
+                        dense = false;
+                        break;
+                }
+                if (i == 0 || k->i < min)
+                        min = k->i;
+                if (i == 0 || k->i > max)
+                        max = k->i;
+        }
+
+        /* dense if at least half the slots would be used */
+        if (dense && (!ncase || (unsigned long long)max - min < 2ull * ncase)) {
+                jt->min = min;
+                jt->n = ncase ? max - min + 1 : 0;
+                jt->offs = emalloc(jt->n * sizeof(*jt->offs) + 1);
+                for (i = 0; i < jt->n; i++)
+                        jt->offs[i] = -1;
+                for (i = 0; i < ncase; i++) {
+                        long long idx = x->rodata[keys[i]]->i - min;
+                        as_err_if(a, jt->offs[idx] >= 0, AE_DUPCASE);
+                        jt->offs[idx] = labels[i];
+                }
+                return IARG_JT_DENSE;
+        }
+
+        jt->n = ncase;
+        jt->offs = emalloc(ncase * sizeof(*jt->offs));
+        jt->keys = emalloc(ncase * sizeof(*jt->keys));
+        for (i = 0; i < ncase; i++) {
+                jt->keys[i] = x->rodata[keys[i]];
+                jt->offs[i] = labels[i];
+        }
+        as_err_if(a, jump_table_hash_keys(jt) < 0, AE_DUPCASE);
+        return IARG_JT_HASH;
+}
+
+/*
+ *      switch '(' VALUE ')' '{' CASES... '}'
+ *
+ * where CASES is any mix of
+ *
+ *      case LITERAL ':'
+ *      default ':'
+ *      EXPR
+ *
+ * LITERAL is an integer, maybe negative, or a quoted string.  Like C,
+ * a case falls through to the next one unless there's a 'break'.  A
+ * 'let' declaration must be inside a {...} block within the case,
+ * since jumping past it would leave the stack out of step with the
+ * symbol table.
+ */
+static void
+assemble_switch(struct assemble_t *a)
+{
+        struct executable_t *x = a->fr->x;
+        int *keys = NULL, *labels = NULL;
+        size_t keys_alloc = 0, labels_alloc = 0;
+        int ncase = 0, dflt = -1;
+        int tbl, ji;
+        int skip = as_next_label(a);
+        int end = as_next_label(a);
+
+        add_instr(a, INSTR_PUSH_BLOCK, IARG_LOOP, 0);
+        apush_scope(a);
+
+        as_errlex(a, OC_LPAR);
+        assemble_eval(a);
+        as_errlex(a, OC_RPAR);
+
+        /* Claim our table now, nested switches will add theirs first */
+        tbl = x->n_jtabs++;
+        as_assert_array_pos(a, tbl, &x->jtabs, &a->fr->jtab_alloc);
+        memset(&x->jtabs[tbl], 0, sizeof(x->jtabs[tbl]));
+        ji = x->n_instr;
+        add_instr(a, INSTR_JUMP_TABLE, 0, tbl);
+
+        as_errlex(a, OC_LBRACE);
+        for (;;) {
+                struct token_t tok;
+                int label;
+
+                as_lex(a);
+                if (a->oc->t == OC_RBRACE)
+                        break;
+
+                switch (a->oc->t) {
+                case OC_CASE:
+                        as_lex(a);
+                        tok = *a->oc;
+                        if (tok.t == OC_MINUS) {
+                                as_errlex(a, 'i');
+                                tok = *a->oc;
+                                tok.i = -tok.i;
+                        } else if (tok.t != 'i' && tok.t != 'q') {
+                                as_err(a, AE_BADTOK);
+                        }
+                        as_errlex(a, OC_COLON);
+
+                        label = as_next_label(a);
+                        as_set_label(a, label);
+                        as_assert_array_pos(a, ncase, &keys, &keys_alloc);
+                        as_assert_array_pos(a, ncase,
+                                            &labels, &labels_alloc);
+                        keys[ncase] = seek_or_add_const(a, &tok);
+                        labels[ncase] = label;
+                        ncase++;
+                        break;
+                case OC_DEFAULT:
+                        as_err_if(a, dflt >= 0, AE_DUPCASE);
+                        as_errlex(a, OC_COLON);
+                        dflt = as_next_label(a);
+                        as_set_label(a, dflt);
+                        break;
+                case EOF:
+                        as_err(a, AE_BRACE);
+                        break;
+                case OC_LET:
+                        as_err(a, AE_BADTOK);
+                        break;
+                default:
+                        /* code before the first case could never run */
+                        as_err_if(a, !ncase && dflt < 0, AE_BADTOK);
+                        as_unlex(a);
+                        assemble_expression(a, 0, skip);
+                }
+        }
+
+        /* no match and no default goes here */
+        as_set_label(a, end);
+        apop_scope(a);
+        add_instr(a, INSTR_POP_BLOCK, 0, 0);
+        as_set_label(a, skip);
+
+        x->jtabs[tbl].dflt = dflt >= 0 ? dflt : end;
+        x->instr[ji].arg1 = switch_fill_table(a, &x->jtabs[tbl],
+                                              keys, labels, ncase);
+        if (keys)
+                free(keys);
+        if (labels)
+                free(labels);
+}
+
 /*
  * assemble_expression - Parser for the top-level expresison
  * @flags: If FE_FOR, we're in the iterator part of a for loop header.
@@ -1618,6 +2081,7 @@ assemble_load(struct assemble_t *a)
  * #9     ""     "" :           while '(' VALUE ')' EXPR
  * #10    ""     "" :           do EXPR while '(' VALUE ')'
  * #11    ""     "":            for '(' EXPR... ')' EXPR
+ * #12    ""     "":            switch '(' VALUE ')' '{' CASES... '}'
  * #12  return nothing:         return
  * #13  return something:       return VALUE
  * #10  break:                  break
@@ -1632,7 +2096,8 @@ assemble_expression(struct assemble_t *a, unsigned int flags, int skip)
         int brace = 0;
         bool pop = false;
 
-        RECURSION_INCR();
+        as_err_if(a, a->recursion >= RECURSION_MAX, AE_OVERFLOW);
+        a->recursion++;
 
         as_lex(a);
         if (a->oc->t == OC_LBRACE) {
@@ -1703,6 +2168,9 @@ assemble_expression(struct assemble_t *a, unsigned int flags, int skip)
                 case OC_DO:
                         assemble_do(a);
                         break;
+                case OC_SWITCH:
+                        assemble_switch(a);
+                        break;
                 case OC_LOAD:
                         /*
                          * TODO: If we are in a function or loop statement,
@@ -1719,7 +2187,7 @@ assemble_expression(struct assemble_t *a, unsigned int flags, int skip)
                 }
         } while (brace);
 
-        RECURSION_DECR();
+        a->recursion--;
 
         if (pop) {
                 add_instr(a, INSTR_POP_BLOCK, 0, 0);
@@ -1732,18 +2200,31 @@ resolve_func_label(struct assemble_t *a,
                    struct as_frame_t *fr,
                    instruction_t *ii)
 {
-        struct list_t *li;
-        bug_on(ii->arg2 == fr->funcno);
-        list_foreach(li, &a->finished_frames) {
-                struct as_frame_t *sib = list2frame(li);
-                if (sib == fr)
-                        continue;
-                if (sib->funcno == ii->arg2) {
-                        ii->arg2 = seek_or_add_const_xptr(a, sib->x);
-                        return;
-                }
+        int funcno = ii->arg2;
+        bug_on(funcno == fr->funcno);
+        bug_on(funcno < FUNC_INIT || funcno >= a->func);
+        ii->arg2 = seek_or_add_const_xptr(a, a->funcs[funcno]->x);
+}
+
+/* turn the labels in a switch's table into branch offsets */
+static void
+resolve_jump_table(struct as_frame_t *fr, instruction_t *ii, int i)
+{
+        struct jump_table_t *jt = &fr->x->jtabs[ii->arg2];
+        unsigned short *label = fr->x->label;
+        int j;
+
+        bug_on(ii->arg2 >= fr->x->n_jtabs);
+
+        /* minus one, same as for B */
+        jt->dflt = label[jt->dflt - JMP_INIT] - i - 1;
+        for (j = 0; j < jt->n; j++) {
+                /* holes in dense tables go to default */
+                if (jt->offs[j] < 0)
+                        jt->offs[j] = jt->dflt;
+                else
+                        jt->offs[j] = label[jt->offs[j] - JMP_INIT] - i - 1;
         }
-        bug();
 }
 
 static void
@@ -1766,6 +2247,10 @@ resolve_jump_labels(struct assemble_t *a, struct as_frame_t *fr)
                         ii->arg2 = fr->x->label[arg2] - i - 1;
                         continue;
                 }
+                if (ii->code == INSTR_JUMP_TABLE) {
+                        resolve_jump_table(fr, ii, i);
+                        continue;
+                }
                 if (ii->code == INSTR_DEFFUNC)
                         resolve_func_label(a, fr, ii);
         }
@@ -1779,8 +2264,10 @@ resolve_jump_labels(struct assemble_t *a, struct as_frame_t *fr)
 static void
 assemble_first_pass(struct assemble_t *a)
 {
-        while (a->oc->t != EOF)
+        while (as_lex(a) != EOF) {
+                as_unlex(a);
                 assemble_expression(a, FE_TOP, -1);
+        }
         add_instr(a, INSTR_END, 0, 0);
 
         list_remove(&a->fr->list);
@@ -1797,61 +2284,457 @@ assemble_second_pass(struct assemble_t *a)
 }
 
 /*
- * Since data going into executable_t won't be resized anymore,
- * ie. the pointers won't change from further reallocs, it's safe to
- * move them into their permanent struct.
+ * Helper to verify_stack: get how many stack items @ii takes and how
+ * many it leaves in their place.  Block instructions are handled by
+ * verify_stack itself.
+ * Return: 0, or -1 if @ii isn't an instruction this knows
+ */
+static int
+instr_stack_effect(instruction_t *ii, int *npop, int *npush)
+{
+        *npop = *npush = 0;
+        switch (ii->code) {
+        case INSTR_NOP:
+        case INSTR_LOAD:
+        case INSTR_SYMTAB:
+        case INSTR_B:
+        case INSTR_END:
+                break;
+        case INSTR_PUSH_LOCAL:
+        case INSTR_PUSH_CONST:
+        case INSTR_PUSH_PTR:
+        case INSTR_PUSH_ZERO:
+        case INSTR_DEFFUNC:
+        case INSTR_DEFLIST:
+        case INSTR_DEFDICT:
+                *npush = 1;
+                break;
+        case INSTR_POP:
+        case INSTR_RETURN_VALUE:
+        case INSTR_B_IF:
+        case INSTR_JUMP_TABLE:
+        case INSTR_INCR:
+        case INSTR_DECR:
+                *npop = 1;
+                break;
+        case INSTR_UNWIND:
+                *npop = ii->arg2 + 1;
+                *npush = 1;
+                break;
+        case INSTR_ASSIGN:
+        case INSTR_ASSIGN_ADD:
+        case INSTR_ASSIGN_SUB:
+        case INSTR_ASSIGN_MUL:
+        case INSTR_ASSIGN_DIV:
+        case INSTR_ASSIGN_MOD:
+        case INSTR_ASSIGN_XOR:
+        case INSTR_ASSIGN_LS:
+        case INSTR_ASSIGN_RS:
+        case INSTR_ASSIGN_OR:
+        case INSTR_ASSIGN_AND:
+                *npop = 2;
+                break;
+        case INSTR_CALL_FUNC:
+                /* args, function, maybe parent; result */
+                *npop = ii->arg2 + 1;
+                if (ii->arg1 == IARG_WITH_PARENT)
+                        (*npop)++;
+                *npush = 1;
+                break;
+        case INSTR_ADD_CLOSURE:
+        case INSTR_ADD_DEFAULT:
+        case INSTR_LIST_APPEND:
+        case INSTR_ADDATTR:
+                *npop = 2;
+                *npush = 1;
+                break;
+        case INSTR_GETATTR:
+                /* parent stays, see do_getattr */
+                *npop = ii->arg1 == IARG_ATTR_STACK ? 2 : 1;
+                *npush = 2;
+                break;
+        case INSTR_SETATTR:
+                *npop = ii->arg1 == IARG_ATTR_STACK ? 3 : 2;
+                break;
+        case INSTR_BITWISE_NOT:
+        case INSTR_NEGATE:
+        case INSTR_LOGICAL_NOT:
+                *npop = 1;
+                *npush = 1;
+                break;
+        case INSTR_MUL:
+        case INSTR_DIV:
+        case INSTR_MOD:
+        case INSTR_ADD:
+        case INSTR_SUB:
+        case INSTR_LSHIFT:
+        case INSTR_RSHIFT:
+        case INSTR_CMP:
+        case INSTR_BINARY_AND:
+        case INSTR_BINARY_OR:
+        case INSTR_BINARY_XOR:
+        case INSTR_LOGICAL_OR:
+        case INSTR_LOGICAL_AND:
+                *npop = 2;
+                *npush = 1;
+                break;
+        default:
+                return -1;
+        }
+        return 0;
+}
+
+/**
+ * struct vstate_t - State of the stack before an instruction, used by
+ *                   verify_stack
+ * @depth:      Stack depth above the frame's arguments, or -1 if the
+ *              instruction has not been reached yet
+ * @blk:        Index of the PUSH_BLOCK of the innermost block, or -1
+ *              if not in a block.  That instruction's own vstate_t
+ *              gives the depth to unwind to and the next block out.
+ * @nest:       Number of blocks
+ */
+struct vstate_t {
+        int depth;
+        int blk;
+        int nest;
+};
+
+/*
+ * Fail with error @err from verify_stack, reported at the source line
+ * of instruction @i, since the tokens are all used up by now.
  */
 static void
-assemble_third_pass(struct assemble_t *a)
+verify_err(struct assemble_t *a, struct executable_t *x, int i, int err)
 {
-        struct list_t *li;
-        list_foreach(li, &a->finished_frames) {
-                struct as_frame_t *fr = list2frame(li);
-                struct executable_t *x = fr->x;
-                if (!(x->flags & FE_TOP))
-                        list_add_tail(&q_.executables, &x->list);
+        int j;
+        for (j = 0; j < x->n_locations; j++) {
+                if (i < x->locations[j].offs)
+                        break;
         }
+        if (j > 0)
+                a->oc->line = x->locations[j - 1].line;
+        as_err(a, err);
 }
 
-#ifdef NDEBUG
-
+/*
+ * Helper to verify_stack: follow a branch or fall-through to
+ * instruction @to.
+ * Return: 0, or AE_STACK if @to is out of bounds or disagrees
+ */
 static int
-assemble_fourth_pass(struct assemble_t *a)
-{
-        if (q_.opt.disassemble)
-                warning("Disassembly unavailable in release mode");
+verify_visit(struct executable_t *x, struct vstate_t *st,
+             int *work, int *nwork, int to, struct vstate_t *from)
+{
+        if (to < 0 || to >= x->n_instr)
+                return AE_STACK;
+        if (st[to].depth < 0) {
+                st[to] = *from;
+                work[(*nwork)++] = to;
+        } else if (st[to].depth != from->depth || st[to].blk != from->blk) {
+                /* every path into an instruction must agree */
+                return AE_STACK;
+        }
         return 0;
 }
 
-#else
+#define verify_fail_if(cond_, err_) \
+        do { if (cond_) { err = (err_); goto out; } } while (0)
+#define verify_visit_(to_) \
+        verify_fail_if(verify_visit(x, st, work, &nwork, to_, &cur), AE_STACK)
 
+/*
+ * Prove that @x never pops more than it pushed, that every path to an
+ * instruction arrives with the same stack depth and block nesting, and
+ * that the stack and block stack stay in bounds.  Set @x->max_stack.
+ *
+ * With this done at assembly time, the VM does not need to check each
+ * push, pop, or PUSH_BLOCK at run time.  Unreachable code, such as
+ * whatever follows a 'return', is never visited.
+ *
+ * Return: 0, or an AE_* error with @*where set to the index of the
+ * instruction it was found at
+ */
 static int
-assemble_fourth_pass(struct assemble_t *a)
+verify_stack(struct executable_t *x, int *where)
 {
-        FILE *fp;
+        struct vstate_t *st, cur;
+        int *work, nwork = 0;
+        int max_depth = 0;
+        int err = 0;
+        int i = 0, j;
 
-        if (!q_.opt.disassemble)
+        /* skipped by -L, we'll get it when it's assembled for real */
+        if (x->lazy)
                 return 0;
+        if (x->n_instr <= 0)
+                return AE_STACK;
+
+        st = emalloc(x->n_instr * sizeof(*st));
+        work = emalloc(x->n_instr * sizeof(*work));
+        for (i = 0; i < x->n_instr; i++)
+                st[i].depth = -1;
+
+        cur.depth = 0;
+        cur.blk = -1;
+        cur.nest = 0;
+        verify_visit_(0);
+
+        while (nwork > 0) {
+                instruction_t *ii;
+                int blk, npop, npush;
+
+                i = work[--nwork];
+                ii = &x->instr[i];
+                cur = st[i];
+
+                switch (ii->code) {
+                case INSTR_PUSH_BLOCK:
+                        cur.blk = i;
+                        cur.nest++;
+                        verify_fail_if(cur.nest > FRAME_NEST_MAX, AE_OVERFLOW);
+                        break;
+                case INSTR_POP_BLOCK:
+                case INSTR_BREAK:
+                        blk = cur.blk;
+                        if (ii->code == INSTR_BREAK) {
+                                while (blk >= 0 &&
+                                       x->instr[blk].arg1 != IARG_LOOP) {
+                                        blk = st[blk].blk;
+                                }
+                        }
+                        verify_fail_if(blk < 0, AE_STACK);
+                        verify_fail_if(cur.depth < st[blk].depth, AE_STACK);
+                        cur = st[blk];
+                        break;
+                default:
+                        /* a local is one of the items above the args */
+                        verify_fail_if(ii->code == INSTR_PUSH_PTR
+                                       && ii->arg1 == IARG_PTR_AP
+                                       && (ii->arg2 < 0
+                                           || ii->arg2 >= cur.depth),
+                                       AE_STACK);
+                        verify_fail_if(instr_stack_effect(ii, &npop,
+                                                &npush) < 0, AE_BADINSTR);
+                        verify_fail_if(cur.depth < npop, AE_STACK);
+                        cur.depth += npush - npop;
+                        verify_fail_if(cur.depth > FRAME_STACK_MAX,
+                                       AE_OVERFLOW);
+                        if (cur.depth > max_depth)
+                                max_depth = cur.depth;
+                }
 
-        fp = fopen(q_.opt.disassemble_outfile, "w");
-        if (!fp)
-                return -1;
-        /* If disassembly requested, run it */
-        disassemble_start(fp, a->file_name);
+                switch (ii->code) {
+                case INSTR_RETURN_VALUE:
+                case INSTR_END:
+                        break;
+                case INSTR_B:
+                        verify_visit_(i + 1 + ii->arg2);
+                        break;
+                case INSTR_B_IF:
+                        verify_visit_(i + 1);
+                        verify_visit_(i + 1 + ii->arg2);
+                        break;
+                case INSTR_JUMP_TABLE: {
+                        struct jump_table_t *jt;
+                        verify_fail_if(ii->arg2 < 0
+                                       || ii->arg2 >= x->n_jtabs,
+                                       AE_BADINSTR);
+                        jt = &x->jtabs[ii->arg2];
+                        verify_visit_(i + 1 + jt->dflt);
+                        for (j = 0; j < jt->n; j++)
+                                verify_visit_(i + 1 + jt->offs[j]);
+                        break;
+                }
+                default:
+                        verify_visit_(i + 1);
+                }
+        }
+
+out:
+        free(st);
+        free(work);
+        if (err)
+                *where = i;
+        else
+                x->max_stack = max_depth;
+        return err;
+}
+
+#undef verify_visit_
+#undef verify_fail_if
+
+/**
+ * assemble_verify - Check code that didn't come from the assembler
+ * @x:          Executable loaded from a byte-code image, whose
+ *              instructions' operands have already been checked, see
+ *              serialize.c
+ *
+ * Do the checks verify_stack() does at assembly time, so the VM can
+ * trust @x as much as freshly assembled code, and set @x->max_stack.
+ *
+ * Return: 0 if @x is OK, -1 if not
+ */
+int
+assemble_verify(struct executable_t *x)
+{
+        int where;
+
+        return verify_stack(x, &where) ? -1 : 0;
+}
+
+/*
+ * Helper to share_consts: true if instruction @ii, which pops a
+ * constant @pos items down from the top of the stack, only reads it.
+ * Anything that keeps it, changes it, or hands it to another function
+ * needs its own copy.
+ */
+static bool
+const_consumer_reads_only(instruction_t *ii, int pos)
+{
+        switch (ii->code) {
+        case INSTR_MUL:
+        case INSTR_DIV:
+        case INSTR_MOD:
+        case INSTR_ADD:
+        case INSTR_SUB:
+        case INSTR_LSHIFT:
+        case INSTR_RSHIFT:
+        case INSTR_CMP:
+        case INSTR_BINARY_AND:
+        case INSTR_BINARY_OR:
+        case INSTR_BINARY_XOR:
+        case INSTR_LOGICAL_OR:
+        case INSTR_LOGICAL_AND:
+                return true;
+        case INSTR_BITWISE_NOT:
+        case INSTR_NEGATE:
+        case INSTR_LOGICAL_NOT:
+        case INSTR_POP:
+        case INSTR_B_IF:
+        case INSTR_JUMP_TABLE:
+        /* the 'from' side, which is copied into the 'to' side */
+        case INSTR_ASSIGN:
+        case INSTR_ASSIGN_ADD:
+        case INSTR_ASSIGN_SUB:
+        case INSTR_ASSIGN_MUL:
+        case INSTR_ASSIGN_DIV:
+        case INSTR_ASSIGN_MOD:
+        case INSTR_ASSIGN_XOR:
+        case INSTR_ASSIGN_LS:
+        case INSTR_ASSIGN_RS:
+        case INSTR_ASSIGN_OR:
+        case INSTR_ASSIGN_AND:
+                return pos == 0;
+        case INSTR_GETATTR:
+                /* the key; the parent is pushed back */
+                return ii->arg1 == IARG_ATTR_STACK && pos == 0;
+        case INSTR_SETATTR:
+                /* the key; the value at the top is stored */
+                return ii->arg1 == IARG_ATTR_STACK && pos == 1;
+        default:
+                return false;
+        }
+}
+
+/*
+ * Mark the PUSH_CONST instructions of @x whose constant can be pushed
+ * as-is instead of copied, so the VM doesn't have to make a new
+ * variable for every '1' in 'i + 1'.
+ *
+ * Only numbers are shared; strings are stored as TYPE_STRPTR and have
+ * to be converted anyway.  Each one is followed forward, without
+ * taking any branches, to the instruction that pops it.  If that's out
+ * of reach--past a branch, a block, or a function call--it isn't
+ * shared either.  The call is ruled out so that a recursive function
+ * can't pile up references to one constant.
+ */
+static void
+share_consts(struct assemble_t *a, struct executable_t *x)
+{
+        int i, j;
+
+        for (i = 0; i < x->n_instr; i++) {
+                instruction_t *ii = &x->instr[i];
+                struct var_t *v;
+                int depth = 0;
+
+                if (ii->code != INSTR_PUSH_CONST)
+                        continue;
+                v = x->rodata[ii->arg2];
+                if (v->magic != TYPE_INT && v->magic != TYPE_FLOAT)
+                        continue;
+
+                /* @depth is the number of items above the constant */
+                for (j = i + 1; j < x->n_instr; j++) {
+                        instruction_t *jj = &x->instr[j];
+                        int npop, npush;
+
+                        switch (jj->code) {
+                        case INSTR_PUSH_BLOCK:
+                        case INSTR_POP_BLOCK:
+                        case INSTR_BREAK:
+                        case INSTR_B:
+                        case INSTR_CALL_FUNC:
+                        case INSTR_RETURN_VALUE:
+                        case INSTR_UNWIND:
+                        case INSTR_LOAD:
+                        case INSTR_END:
+                                goto next;
+                        default:
+                                break;
+                        }
+
+                        if (instr_stack_effect(jj, &npop, &npush) < 0)
+                                bug();
+                        if (npop > depth) {
+                                if (const_consumer_reads_only(jj, depth))
+                                        ii->arg1 = IARG_CONST_SHARE;
+                                goto next;
+                        }
+                        if (jj->code == INSTR_B_IF
+                            || jj->code == INSTR_JUMP_TABLE) {
+                                goto next;
+                        }
+                        depth += npush - npop;
+                }
+next:
+                ;
+        }
+}
+
+/*
+ * Since data going into executable_t won't be resized anymore,
+ * ie. the pointers won't change from further reallocs, it's safe to
+ * move them into their permanent struct.
+ *
+ * Each function's executable goes on the @list of @top, in the order
+ * they were finished, so the caller can find them all.
+ */
+static void
+assemble_third_pass(struct assemble_t *a, struct executable_t *top)
+{
         struct list_t *li;
         list_foreach(li, &a->finished_frames) {
                 struct as_frame_t *fr = list2frame(li);
                 struct executable_t *x = fr->x;
-                disassemble(fp, x);
+                int err, where;
+
+                if ((err = verify_stack(x, &where)) != 0)
+                        verify_err(a, x, where, err);
+                x->n_args = fr->argc;
+                x->n_closures = fr->cp;
+                if (!x->lazy)
+                        share_consts(a, x);
+                /* list not empty if assemble_lazy() is filling it in */
+                if (!(x->flags & FE_TOP) && list_is_empty(&x->list))
+                        list_add_tail(&x->list, &top->list);
         }
-        fclose(fp);
-        return 0;
 }
 
-#endif
-
+/* Get the executable for the script's top level */
 static struct executable_t *
-assemble_fifth_pass(struct assemble_t *a)
+as_top_executable(struct assemble_t *a)
 {
         struct as_frame_t *fr = list2frame(a->finished_frames.next);
         bug_on(&fr->list == &a->finished_frames);
@@ -1861,20 +2744,23 @@ assemble_fifth_pass(struct assemble_t *a)
 }
 
 static struct assemble_t *
-new_assembler(const char *source_file_name, struct token_t *token_arr)
+new_assembler(struct lexer_t *lex, const char *source_file_name)
 {
         struct assemble_t *a = ecalloc(sizeof(*a));
         a->file_name = (char *)source_file_name;
-        a->prog = token_arr;
-        a->oc = a->prog;
+        a->lex = lex;
+        /*
+         * Slot zero is a blank "minus one" token, so the first
+         * as_lex() is @1.
+         */
+        a->oc = &a->lookback[0];
+        a->lb_pos = 0;
+        a->lb_end = 1;
         /* don't let the first ones be zero, that looks bad */
         a->func = FUNC_INIT;
         list_init(&a->active_frames);
         list_init(&a->finished_frames);
         as_frame_push(a, 0);
-
-        /* first alex() is @0 */
-        a->oc--;
         return a;
 }
 
@@ -1882,6 +2768,8 @@ static void
 free_assembler(struct assemble_t *a, int err)
 {
         as_delete_frames(a, err);
+        if (a->funcs)
+                free(a->funcs);
         free(a);
 }
 
@@ -1896,97 +2784,195 @@ as_get_location(const char **file_name, void *h)
         return a->oc->line;
 }
 
+static void
+as_syntax(int res)
+{
+        const char *msg;
+
+        switch (res) {
+        default:
+        case AE_GEN:
+                msg = "Undefined error";
+                break;
+        case AE_BADEOF:
+                msg = "Unexpected termination";
+                break;
+        case AE_BADTOK:
+                msg = "Invalid token";
+                break;
+        case AE_EXPECT:
+                msg = "Expected token missing";
+                break;
+        case AE_REDEF:
+                msg = "Redefinition of local variable";
+                break;
+        case AE_OVERFLOW:
+                msg = "Frame overflow";
+                break;
+        case AE_PAR:
+                msg = "Unbalanced parenthesis";
+                break;
+        case AE_LAMBDA:
+                msg = "Unbalanced lambda";
+                break;
+        case AE_BRACK:
+                msg = "Unbalanced bracket";
+                break;
+        case AE_BRACE:
+                msg = "Unbalanced brace";
+                break;
+        case AE_BREAK:
+                msg = "Unexpected break";
+                break;
+        case AE_NOTIMPL:
+                msg = "Not implemented yet";
+                break;
+        case AE_ARGNAME:
+                msg = "Malformed argument name";
+                break;
+        case AE_BADINSTR:
+                msg = "Bad instruction";
+                break;
+        case AE_DUPCASE:
+                msg = "Duplicate case in switch statement";
+                break;
+        case AE_STACK:
+                msg = "Unbalanced stack";
+                break;
+        }
+        syntax("Assembler returned error code %d (%s)", res, msg);
+}
+
 /**
- * assemble - Convert an array of tokens into an array of pseudo-
+ * assemble - Convert the tokens of a file into an array of pseudo-
  *            assembly instructions
+ * @lex:        Lexer for the file, from lex_open().  Its tokens are
+ *              pulled as they are needed.  The caller still owns it.
  * @source_file_name:   Name of the input source file, for record
  *      keeping and reporting in case a syntax error was found
- * @token_arr: Array of tokens from a file.  These MUST be EOF-
- *      terminated.
+ * @lazy:       If true, leave the bodies of top-level functions to be
+ *              assembled by assemble_lazy() when they are first called
+ *
+ * This uses no global state besides literal() and the memory
+ * allocators, so different threads may assemble different files at
+ * the same time.  A syntax error is reported with syntax(), so it
+ * exits the program unless the caller used err_catch().
  *
  * Return:
  * Array of executable instructions for the top-level scope, which
  * happens to be all you need.  The instructions for any functions
  * defined in the script exist out there in RAM somewhere, but they
  * will be reached eventually, since they are referenced by top-level
- * instructions.  GC will happen when the last variable referencing them
- * is destroyed.  Note to users: Don't assign an insignificant function
+ * instructions.  The caller holds one reference to the top level,
+ * which vm_execute() releases when it's done; each function's code is
+ * freed when neither that nor the last function made from it needs it
+ * anymore.  Note to users: Don't assign an insignificant function
  * to a global-, therefore immortal-, scope variable, or it will remain
  * in memory until the program terminates.
  */
 struct executable_t *
-assemble(const char *source_file_name, struct token_t *token_arr)
+assemble(struct lexer_t *lex, const char *source_file_name, bool lazy)
 {
         struct assemble_t *a;
         struct executable_t *ex;
+        jmp_buf *caller;
+        unsigned int depth;
         int res;
 
-        a = new_assembler(source_file_name, token_arr);
+        a = new_assembler(lex, source_file_name);
+        a->lazy = lazy;
 
+        depth = getloc_depth();
         getloc_push(as_get_location, a);
 
+        /*
+         * Catch as_syntax()'s err_throw() too, so we get to clean up
+         * before passing it on to the caller's catcher, if any.
+         */
+        caller = err_catch(&a->env);
         if ((res = setjmp(a->env)) != 0) {
-                const char *msg;
-                switch (res) {
-                default:
-                case AE_GEN:
-                        msg = "Undefined error";
-                        break;
-                case AE_BADEOF:
-                        msg = "Unexpected termination";
-                        break;
-                case AE_BADTOK:
-                        msg = "Invalid token";
-                        break;
-                case AE_EXPECT:
-                        msg = "Expected token missing";
-                        break;
-                case AE_REDEF:
-                        msg = "Redefinition of local variable";
-                        break;
-                case AE_OVERFLOW:
-                        msg = "Frame overflow";
-                        break;
-                case AE_PAR:
-                        msg = "Unbalanced parenthesis";
-                        break;
-                case AE_LAMBDA:
-                        msg = "Unbalanced lambda";
-                        break;
-                case AE_BRACK:
-                        msg = "Unbalanced bracket";
-                        break;
-                case AE_BRACE:
-                        msg = "Unbalanced brace";
-                        break;
-                case AE_BREAK:
-                        msg = "Unexpected break";
-                        break;
-                case AE_NOTIMPL:
-                        msg = "Not implemented yet";
-                        break;
-                case AE_ARGNAME:
-                        msg = "Malformed argument name";
-                        break;
-                case AE_BADINSTR:
-                        msg = "Bad instruction";
-                        break;
-                }
-                syntax("Assembler returned error code %d (%s)", res, msg);
+                if (res != ERR_THROWN)
+                        as_syntax(res);
                 ex = NULL;
         } else {
                 assemble_first_pass(a);
                 assemble_second_pass(a);
-                assemble_third_pass(a);
-                if (assemble_fourth_pass(a) < 0)
-                        warning("Could not disassemble %s", a->file_name);
-                ex = assemble_fifth_pass(a);
+                ex = as_top_executable(a);
+                assemble_third_pass(a, ex);
+                EXECUTABLE_CLAIM(ex);
         }
+        err_catch(caller);
 
-        getloc_pop();
+        /* tokenize()'s might be left over if it threw an error */
+        getloc_unwind(depth);
 
         free_assembler(a, res);
+        if (!ex)
+                err_throw();
         return ex;
 }
 
+/**
+ * assemble_lazy - Assemble a function whose body was skipped over
+ *                 when its file was assembled
+ * @x:  Executable code for the function.  @x->lazy has the source for
+ *      the function body, and it will be freed and set to NULL.  The
+ *      rest of @x gets filled in place, since the file's top-level
+ *      code and the function variables already point to it.
+ *
+ * This can only be called while nothing else is being tokenized.
+ */
+void
+assemble_lazy(struct executable_t *x)
+{
+        struct lazy_body_t *lz = x->lazy;
+        struct assemble_t *a;
+        struct as_frame_t *fr;
+        struct lexer_t *lex;
+        int res;
+
+        bug_on(!lz);
+        x->lazy = NULL;
+
+        /* the lexer owns lz->text now */
+        lex = lex_open_str(lz->text, notdir(x->file_name), lz->line);
+        lz->text = NULL;
+
+        /* new_assembler's top-level frame is just a placeholder */
+        a = new_assembler(lex, x->file_name);
 
+        getloc_push(as_get_location, a);
+
+        if ((res = setjmp(a->env)) != 0) {
+                as_syntax(res);
+        } else {
+                as_frame_push(a, a->func++);
+                fr = a->fr;
+                memstat_free(MS_EXECUTABLE, sizeof(*(fr->x)));
+                free(fr->x);
+                fr->x = x;
+                if (lz->argc)
+                        memcpy(fr->argv, lz->argv, lz->argc * sizeof(char *));
+                fr->argc = lz->argc;
+                if (lz->cp)
+                        memcpy(fr->clo, lz->clo, lz->cp * sizeof(char *));
+                fr->cp = lz->cp;
+                as_assert_array_pos(a, fr->funcno,
+                                    &a->funcs, &a->funcs_alloc);
+                a->funcs[fr->funcno] = fr;
+
+                assemble_function(a, false, fr->funcno);
+                as_err_if(a, as_lex(a) != EOF, AE_BADTOK);
+                as_frame_pop(a);
+
+                assemble_second_pass(a);
+                assemble_third_pass(a, x);
+        }
+
+        getloc_pop();
+        lex_close(lex);
+
+        executable_free__(a->fr->x);
+        free_assembler(a, res);
+        lazy_body_free(lz);
+}
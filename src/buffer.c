@@ -40,6 +40,10 @@
  *
  * DO NOT mix/match the binary API and the C-string API on the
  * same buffer unless you call buffer_reset between them.
+ *
+ * The data comes from mem_alloc(), and @size is always a whole size
+ * class (see mempool.c), so short strings that are built and thrown
+ * away all the time just go back and forth to a free list.
  */
 #include <lib/buffer.h>
 #include <evilcandy.h>
@@ -47,82 +51,6 @@
 #include <stdlib.h>
 #include <string.h>
 
-struct bufblk_t {
-        struct list_t list;
-        struct buffer_t bufs[64];
-        uint64_t b;
-};
-
-/*
- * Graveyard of discarded struct buffer_t's, so we don't have to keep
- * malloc'ing and free'ing whenever we push and pop strings on and off
- * the stack.
- *
- * FIXME: This looks like a DRY violation with the memory management
- * in var.c (because it sort of is), but I cannot combine the two,
- * because they are fundamentally different from each other.
- */
-struct list_t bufblk_list = {
-        .next = &bufblk_list,
-        .prev = &bufblk_list
-};
-
-#define list2blk(li)    container_of(li, struct bufblk_t, list)
-
-static struct buffer_t *
-buffer_from_graveyard(void)
-{
-        struct list_t *list;
-        struct bufblk_t *blk = NULL;
-        uint64_t x;
-        unsigned int i;
-        list_foreach(list, &bufblk_list) {
-                struct bufblk_t *tblk = list2blk(list);
-                if (tblk->b) {
-                        blk = tblk;
-                        break;
-                }
-        }
-        if (!blk)
-                return NULL;
-        i = __builtin_ctz(blk->b);
-        bug_on(i >= 64);
-        x = 1ull << i;
-        blk->b &= ~x;
-        return &blk->bufs[i];
-}
-
-static void
-buffer_to_graveyard(struct buffer_t *b)
-{
-        struct list_t *list;
-        struct bufblk_t *blk = NULL;
-        uint64_t x;
-        unsigned int i;
-
-        list_foreach(list, &bufblk_list) {
-                struct bufblk_t *tblk = list2blk(list);
-                if (~tblk->b) {
-                        blk = tblk;
-                        break;
-                }
-        }
-        if (!blk) {
-                blk = emalloc(sizeof(*blk));
-                list_init(&blk->list);
-                blk->b = 0LL;
-                list_add_tail(&blk->list, &bufblk_list);
-        }
-        i = __builtin_ctz(~blk->b);
-        bug_on(i >= 64);
-        x = 1ull << i;
-        blk->b |= x;
-
-        blk->bufs[i].s    = b->s;
-        blk->bufs[i].size = b->size;
-        blk->bufs[i].p    = 0;
-}
-
 static void
 buffer_init_(struct buffer_t *b)
 {
@@ -132,6 +60,9 @@ buffer_init_(struct buffer_t *b)
 /**
  * buffer_init_from - Initialize @buf using pre-existing pointer
  *                    and alloc size
+ *
+ * @line must have come from mem_alloc(), with @size the size that was
+ * asked for.
  */
 void
 buffer_init_from(struct buffer_t *buf, char *line, size_t size)
@@ -139,6 +70,8 @@ buffer_init_from(struct buffer_t *buf, char *line, size_t size)
         buf->s = line;
         buf->size = size;
         buf->p = 0;
+        if (line)
+                memstat_alloc(MS_BUFFER, size);
 }
 
 /**
@@ -149,15 +82,7 @@ buffer_init_from(struct buffer_t *buf, char *line, size_t size)
 void
 buffer_init(struct buffer_t *buf)
 {
-        struct buffer_t *old = buffer_from_graveyard();
-        if (old) {
-                buf->s    = old->s;
-                buf->size = old->size;
-                buf->p = 0;
-                buffer_init_(old);
-        } else {
-                buffer_init_(buf);
-        }
+        buffer_init_(buf);
 }
 
 /**
@@ -169,7 +94,10 @@ buffer_init(struct buffer_t *buf)
 void
 buffer_free(struct buffer_t *buf)
 {
-        buffer_to_graveyard(buf);
+        if (buf->s) {
+                memstat_free(MS_BUFFER, buf->size);
+                mem_free(buf->s, buf->size);
+        }
         buffer_init_(buf);
 }
 
@@ -178,13 +106,17 @@ buffer_maybe_realloc(struct buffer_t *buf, size_t amt)
 {
         enum { BLKLEN = 128 };
         size_t needsize = buf->p + amt;
-        while (needsize >= buf->size) {
-                char *tmp = realloc(buf->s, buf->size + BLKLEN);
-                if (!tmp)
-                        fail("realloc failed");
-
-                buf->s = tmp;
-                buf->size += BLKLEN;
+        if (needsize >= buf->size) {
+                /* next multiple of BLKLEN, or the rest of its class */
+                size_t newsize = (needsize + BLKLEN) & ~(size_t)(BLKLEN - 1);
+
+                newsize = mem_class_size(newsize);
+                if (buf->s)
+                        memstat_resize(MS_BUFFER, buf->size, newsize);
+                else
+                        memstat_alloc(MS_BUFFER, newsize);
+                buf->s = mem_realloc(buf->s, buf->size, newsize);
+                buf->size = newsize;
         }
 }
 
@@ -234,18 +166,17 @@ buffer_puts(struct buffer_t *buf, const char *s)
 void
 buffer_nputs(struct buffer_t *buf, const char *s, size_t amt)
 {
-        int c;
-        const char *end;
-
         if (!s)
                 return;
-        end = s + amt;
 
-        while (s < end && (c = *s++) != '\0')
-                buffer_putc(buf, c);
+        /* Don't allow placing nulchars, same as buffer_putc */
+        amt = strnlen(s, amt);
 
-        /* same reason as in buffer_putc */
-        buffer_putc(buf, '\0');
+        /* +1 for the nulchar termination */
+        buffer_maybe_realloc(buf, amt + 1);
+        memcpy(&buf->s[buf->p], s, amt);
+        buf->p += amt;
+        buf->s[buf->p] = '\0';
 }
 
 /**
@@ -93,6 +93,7 @@ static const struct inittbl_t gblinit[] = {
         TOFTBL("exit",   do_exit,   0, -1),
         TOOTBL("_math",  bi_math_inittbl__),
         TOOTBL("_io",    bi_io_inittbl__),
+        TOOTBL("_sys",   bi_sys_inittbl__),
         { .name = NULL },
 };
 
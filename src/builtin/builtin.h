@@ -53,4 +53,7 @@ extern const struct inittbl_t bi_io_inittbl__[];
 /* math.c */
 extern const struct inittbl_t bi_math_inittbl__[];
 
+/* sys.c */
+extern const struct inittbl_t bi_sys_inittbl__[];
+
 #endif /* EGQ_BUILTIN_H */
@@ -27,6 +27,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <sys/stat.h>
 
 /**
  * struct file_handle_t - Handle to a file, private data to an
@@ -35,12 +36,15 @@
  * @nref:       Number of variables with access to this same open file
  * @fp:         File pointer
  * @err:        errno value that was set on last error
+ * @may_block:  True if reading could wait on something else, like
+ *              a pipe or terminal, rather than just on the disk
  */
 struct file_handle_t {
         enum { FILE_HANDLE_MAGIC = 0x8716245 } magic;
         int nref;
         FILE *fp;
         int err;
+        bool may_block;
 };
 
 static struct file_handle_t *
@@ -109,6 +113,10 @@ do_readline(struct var_t *ret)
 
         bug_on(ret->magic != TYPE_EMPTY);
 
+        /* we might be waiting for more work, see mem_idle() */
+        if (fh->may_block)
+                mem_idle();
+
         errno = 0;
         string_init_from_file(ret, fp, '\n', false);
         if (errno)
@@ -232,6 +240,7 @@ static struct file_handle_t *
 file_new(const char *path, const char *mode)
 {
         struct file_handle_t *h;
+        struct stat st;
         FILE *fp = fopen(path, mode);
         if (!fp)
                 return NULL;
@@ -240,6 +249,7 @@ file_new(const char *path, const char *mode)
         h->magic = FILE_HANDLE_MAGIC;
         h->fp = fp;
         h->err = 0;
+        h->may_block = fstat(fileno(fp), &st) < 0 || !S_ISREG(st.st_mode);
         return h;
 }
 
@@ -0,0 +1,177 @@
+/*
+ * builtin/sys.c - Implementation of the __gbl__._sys built-in object
+ *
+ * _sys.trim()
+ *      Give memory the interpreter isn't using back to the OS.
+ *      Return the number of bytes given back.
+ *
+ * _sys.settrim(policy, kbytes)
+ *      Set when memory is given back without calling trim().  policy
+ *      is a string, one of:
+ *
+ *      "explicit"      Never, only when trim() is called
+ *      "idle"          Also when reading a line from a pipe or terminal
+ *      "threshold"     Also whenever more than kbytes KiB of memory
+ *                      for objects of the same size are unused
+ *
+ *      kbytes is only needed for "threshold".  The default is
+ *      "threshold" with 1024 KiB.
+ *
+ * _sys.gc()
+ *      Free dictionaries, lists, and functions that are only kept
+ *      alive by referring to each other.  Return how many were freed.
+ *      This also happens automatically as more of them are made.
+ *
+ * _sys.gcstats()
+ *      Return a dictionary with the cycle collector's counters:
+ *      "collections", "freed", "tracked", and "usec".
+ *
+ * _sys.memstats()
+ *      Return a dictionary of memory counters, see memstat.c.  For
+ *      each kind of thing counted, "var", "dict", "list", "function",
+ *      "string", "bucket", "buffer", "frame", "executable", and
+ *      "literal", there's a dictionary of:
+ *
+ *      "live"          How many there are now
+ *      "total"         How many were ever made
+ *      "peak"          The most there have been at once
+ *      "bytes"         Bytes the live ones use
+ *      "peak_bytes"    The most bytes they've used at once
+ *      "cached"        How many are kept on a free list for reuse
+ *
+ *      "pool" is a dictionary of the size-class allocator's totals:
+ *      "bytes" in use, "slabs", "spare" chunks in those slabs, and
+ *      "recent" chunks freed and kept aside for the next allocation.
+ *      "rss" and "rss_peak" are the process's resident size now and
+ *      at its highest, in bytes, or 0 where the OS won't say.
+ */
+#include "builtin.h"
+#include <string.h>
+
+static void
+do_trim(struct var_t *ret)
+{
+        integer_init(ret, (long long)mem_trim());
+}
+
+static void
+do_settrim(struct var_t *ret)
+{
+        struct var_t *vpolicy = frame_get_arg(0);
+        struct var_t *vkbytes = frame_get_arg(1);
+        long long kbytes = 0;
+        char *s;
+        int policy;
+
+        arg_type_check(vpolicy, TYPE_STRING);
+        s = string_get_cstring(vpolicy);
+        if (!s)
+                s = "";
+        if (!strcmp(s, "explicit")) {
+                policy = MEM_TRIM_EXPLICIT;
+        } else if (!strcmp(s, "idle")) {
+                policy = MEM_TRIM_IDLE;
+        } else if (!strcmp(s, "threshold")) {
+                policy = MEM_TRIM_THRESHOLD;
+                if (!vkbytes)
+                        syntax("Expected: threshold in KiB");
+                arg_type_check(vkbytes, TYPE_INT);
+                kbytes = vkbytes->i;
+                if (kbytes < 0)
+                        syntax("Threshold may not be negative");
+        } else {
+                syntax("Expected: 'explicit', 'idle', or 'threshold'");
+                return;
+        }
+        mem_set_trim(policy, (size_t)kbytes * 1024);
+}
+
+static void
+do_gc(struct var_t *ret)
+{
+        integer_init(ret, (long long)gc_collect());
+}
+
+static void
+stats_add(struct var_t *ret, const char *name, long long value)
+{
+        struct var_t *child = var_new();
+        integer_init(child, value);
+        object_add_child(ret, child, literal_put(name));
+        VAR_DECR_REF(child);
+}
+
+static void
+do_gcstats(struct var_t *ret)
+{
+        struct gc_stats_t stats;
+
+        gc_stats(&stats);
+        object_init(ret);
+        stats_add(ret, "collections", stats.n_collections);
+        stats_add(ret, "freed", stats.n_freed);
+        stats_add(ret, "tracked", stats.n_tracked);
+        stats_add(ret, "usec", stats.usec);
+}
+
+/* new empty dictionary named @name in @ret */
+static struct var_t *
+stats_add_dict(struct var_t *ret, const char *name)
+{
+        struct var_t *child = var_new();
+        object_init(child);
+        object_add_child(ret, child, literal_put(name));
+        VAR_DECR_REF(child);
+        return child;
+}
+
+static void
+do_memstats(struct var_t *ret)
+{
+        struct memstat_t stats[MS_N];
+        struct mem_stats_t cls[MEM_N_STATS];
+        long long pool_bytes = 0, n_slabs = 0, n_spare = 0, n_recent = 0;
+        size_t rss, rss_peak;
+        struct var_t *d;
+        int i;
+
+        /* before making the dictionary, so it isn't counted */
+        memstat_get(stats);
+        mem_stats(cls);
+        memstat_rss(&rss, &rss_peak);
+
+        object_init(ret);
+        for (i = 0; i < MS_N; i++) {
+                d = stats_add_dict(ret, memstat_name(i));
+                stats_add(d, "live", stats[i].n_alloc - stats[i].n_free);
+                stats_add(d, "total", stats[i].n_alloc);
+                stats_add(d, "peak", stats[i].peak);
+                stats_add(d, "bytes", stats[i].bytes);
+                stats_add(d, "peak_bytes", stats[i].peak_bytes);
+                stats_add(d, "cached", stats[i].n_cached);
+        }
+
+        for (i = 0; i < MEM_N_STATS; i++) {
+                pool_bytes += cls[i].in_use * cls[i].size;
+                n_slabs += cls[i].n_slabs;
+                n_spare += cls[i].n_spare;
+                n_recent += cls[i].n_recent;
+        }
+        d = stats_add_dict(ret, "pool");
+        stats_add(d, "bytes", pool_bytes);
+        stats_add(d, "slabs", n_slabs);
+        stats_add(d, "spare", n_spare);
+        stats_add(d, "recent", n_recent);
+
+        stats_add(ret, "rss", rss);
+        stats_add(ret, "rss_peak", rss_peak);
+}
+
+const struct inittbl_t bi_sys_inittbl__[] = {
+        TOFTBL("trim",     do_trim,     0, 0),
+        TOFTBL("settrim",  do_settrim,  1, 2),
+        TOFTBL("gc",       do_gc,       0, 0),
+        TOFTBL("gcstats",  do_gcstats,  0, 0),
+        TOFTBL("memstats", do_memstats, 0, 0),
+        TBLEND,
+};
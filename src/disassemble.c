@@ -9,6 +9,7 @@
 
 #define IARG(x)   [IARG_##x]  = #x
 #define IARGP(x)  [IARG_PTR_##x]  = #x
+#define IARGJ(x)  [IARG_JT_##x]  = #x
 
 static const char *INSTR_NAMES[N_INSTR] = {
 #include "disassemble_gen.c.h"
@@ -42,6 +43,11 @@ static const char *CMP_NAMES[] = {
         IARG(GT)
 };
 
+static const char *JT_NAMES[] = {
+        IARGJ(DENSE),
+        IARGJ(HASH),
+};
+
 /* note, i evaluated twice */
 #define SAFE_NAME(arr, i) \
         (i >= ARRAY_SIZE(arr##_NAMES) ? undefstr : arr##_NAMES[i])
@@ -125,9 +131,43 @@ disassemble_start(FILE *fp, const char *sourcefile_name)
         fprintf(fp, "# enumerations for PUSH_PTR arg1\n");
         ADD_DEFINES(PTR_NAMES);
         putc('\n', fp);
+        fprintf(fp, "# enumerations for JUMP_TABLE arg1\n");
+        ADD_DEFINES(JT_NAMES);
+        putc('\n', fp);
         putc('\n', fp);
 }
 
+/* list a switch's cases below its JUMP_TABLE instruction */
+static void
+dump_jump_table(FILE *fp, struct executable_t *ex,
+                unsigned int i, instruction_t *ii)
+{
+        struct jump_table_t *jt;
+        int j;
+
+        if (ii->arg2 >= ex->n_jtabs) {
+                fprintf(fp, "%24s# %s\n", "", undefstr);
+                return;
+        }
+        jt = &ex->jtabs[ii->arg2];
+        for (j = 0; j < jt->n; j++) {
+                /* holes point at default, don't list them */
+                if (ii->arg1 == IARG_JT_DENSE && jt->offs[j] == jt->dflt)
+                        continue;
+                fprintf(fp, "%24s# case ", "");
+                if (ii->arg1 == IARG_JT_DENSE)
+                        fprintf(fp, "%lld", jt->min + j);
+                else if (jt->keys[j]->magic == TYPE_INT)
+                        fprintf(fp, "%lld", jt->keys[j]->i);
+                else
+                        print_escapestr(fp, jt->keys[j]->strptr, '"');
+                fprintf(fp, ": label %d\n",
+                        line_to_label(i + jt->offs[j] + 1, ex));
+        }
+        fprintf(fp, "%24s# default: label %d\n", "",
+                line_to_label(i + jt->dflt + 1, ex));
+}
+
 static void
 disinstr(FILE *fp, struct executable_t *ex, unsigned int i)
 {
@@ -177,6 +217,12 @@ disinstr(FILE *fp, struct executable_t *ex, unsigned int i)
                         line_to_label(i + ii->arg2 + 1, ex));
                 break;
 
+        case INSTR_JUMP_TABLE:
+                fprintf(fp, "%s, %hd\n",
+                        SAFE_NAME(JT, ii->arg1), ii->arg2);
+                dump_jump_table(fp, ex, i, ii);
+                break;
+
         case INSTR_SYMTAB:
                 len = fprintf(fp, "%d, %hd", ii->arg1, ii->arg2);
                 if (len < 16)
@@ -208,3 +254,42 @@ disassemble(FILE *fp, struct executable_t *ex)
         fprintf(fp, ".end \"%s\"\n\n\n", what);
 }
 
+#ifdef NDEBUG
+
+int
+disassemble_script(const char *outfile, const char *sourcefile_name,
+                   struct executable_t *top)
+{
+        warning("Disassembly unavailable in release mode");
+        return 0;
+}
+
+#else
+
+/**
+ * disassemble_script - Disassemble everything assembled from a script
+ * @outfile:            File to write the disassembly to
+ * @sourcefile_name:    Name of the script
+ * @top:                The script's top-level executable, from
+ *                      assemble()
+ *
+ * Return: 0 if successful, -1 if @outfile could not be opened
+ */
+int
+disassemble_script(const char *outfile, const char *sourcefile_name,
+                   struct executable_t *top)
+{
+        struct list_t *li;
+        FILE *fp = fopen(outfile, "w");
+        if (!fp)
+                return -1;
+
+        disassemble_start(fp, sourcefile_name);
+        disassemble(fp, top);
+        list_foreach(li, &top->list)
+                disassemble(fp, container_of(li, struct executable_t, list));
+        fclose(fp);
+        return 0;
+}
+
+#endif /* !NDEBUG */
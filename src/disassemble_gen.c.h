@@ -0,0 +1,61 @@
+/*
+ * Auto-generated code, do not edit
+ * used by disassemble.c
+ * (see tools/gen.c, tools/instructions)
+ */
+        "NOP",
+        "LOAD",
+        "PUSH_LOCAL",
+        "PUSH_CONST",
+        "PUSH_PTR",
+        "POP",
+        "UNWIND",
+        "PUSH_BLOCK",
+        "POP_BLOCK",
+        "BREAK",
+        "ASSIGN",
+        "ASSIGN_ADD",
+        "ASSIGN_SUB",
+        "ASSIGN_MUL",
+        "ASSIGN_DIV",
+        "ASSIGN_MOD",
+        "ASSIGN_XOR",
+        "ASSIGN_LS",
+        "ASSIGN_RS",
+        "ASSIGN_OR",
+        "ASSIGN_AND",
+        "SYMTAB",
+        "PUSH_ZERO",
+        "RETURN_VALUE",
+        "CALL_FUNC",
+        "DEFFUNC",
+        "ADD_CLOSURE",
+        "ADD_DEFAULT",
+        "DEFLIST",
+        "LIST_APPEND",
+        "DEFDICT",
+        "ADDATTR",
+        "GETATTR",
+        "SETATTR",
+        "B_IF",
+        "B",
+        "JUMP_TABLE",
+        "BITWISE_NOT",
+        "NEGATE",
+        "LOGICAL_NOT",
+        "MUL",
+        "DIV",
+        "MOD",
+        "ADD",
+        "SUB",
+        "LSHIFT",
+        "RSHIFT",
+        "CMP",
+        "BINARY_AND",
+        "BINARY_OR",
+        "BINARY_XOR",
+        "LOGICAL_OR",
+        "LOGICAL_AND",
+        "INCR",
+        "DECR",
+        "END",
@@ -0,0 +1,435 @@
+/*
+ * emit_c.c - Code that handles the --emit-c option, translate a script
+ *            into a C program, and the run-time support for the
+ *            programs it writes.
+ *
+ * The script is assembled as usual, and its byte-code image--the same
+ * thing serialize.c writes to the cache--is written out as a byte
+ * array, so that everything the VM needs besides the instructions
+ * (constants, switch tables, line numbers for error messages) is there
+ * in exactly the form it would be for a cached script.  Then each
+ * executable becomes a C function, one block of code per instruction,
+ * the same way jit.c translates it into machine code:
+ *
+ * - Most instructions become a direct call to the VM's handler for
+ *   that instruction, with the instruction as a constant argument.
+ * - B becomes a goto, B_IF a call to the VM's branch helper and a
+ *   conditional goto, and a CMP followed by a B_IF is fused.
+ * - PUSH_PTR of an argument or local, and POP, are written inline.
+ *
+ * So the frame, stack, and reference counting are exactly what they'd
+ * be when interpreting, and the script behaves the same way, errors
+ * and all.  The functions return to the VM's loop whenever the current
+ * frame changes, and get called again, starting wherever the frame's
+ * ppii points, when the frame becomes current again.  Those are the
+ * only places code can start from besides the top: after a CALL_FUNC,
+ * and wherever a JUMP_TABLE might land.
+ *
+ * The program is built by linking it against libevilcandy.a, which is
+ * everything except main.c:
+ *
+ *      evilcandy --emit-c foo.egq > foo.c
+ *      cc -O2 -Iinc foo.c libevilcandy.a -lm -pthread -o foo
+ *
+ * It only works with the libevilcandy.a from the same build, since the
+ * image and the handler numbers are not portable.  emit_c_run() at
+ * least refuses an image that evcc_load_image() wouldn't take.
+ */
+#include <instructions.h>
+#include <evilcandy.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+static const char *INSTR_NAMES[N_INSTR] = {
+#include "disassemble_gen.c.h"
+};
+
+/* Return: true if every branch and switch in @ex lands inside @ex */
+static bool
+emit_check_targets(struct executable_t *ex)
+{
+        int i, j;
+        for (i = 0; i < ex->n_instr; i++) {
+                instruction_t ii = ex->instr[i];
+                int target = i + 1 + ii.arg2;
+
+                if (ii.code >= N_INSTR)
+                        return false;
+                if ((ii.code == INSTR_B || ii.code == INSTR_B_IF)
+                    && (target < 0 || target >= ex->n_instr)) {
+                        return false;
+                }
+                if (ii.code != INSTR_JUMP_TABLE)
+                        continue;
+                if (ii.arg2 < 0 || ii.arg2 >= ex->n_jtabs)
+                        return false;
+                for (j = -1; j < ex->jtabs[ii.arg2].n; j++) {
+                        struct jump_table_t *jt = &ex->jtabs[ii.arg2];
+                        target = i + 1 + (j < 0 ? jt->dflt : jt->offs[j]);
+                        if (target < 0 || target >= ex->n_instr)
+                                return false;
+                }
+        }
+        return true;
+}
+
+/*
+ * Find which instructions need a label, set @label[i] to 1 if it's
+ * only jumped to, 2 if the function can also be entered there.
+ */
+static void
+emit_find_labels(struct executable_t *ex, char *label)
+{
+        int i, j;
+
+        memset(label, 0, ex->n_instr + 1);
+        label[0] = 2;
+        for (i = 0; i < ex->n_instr; i++) {
+                instruction_t ii = ex->instr[i];
+                struct jump_table_t *jt;
+
+                switch (ii.code) {
+                case INSTR_B:
+                case INSTR_B_IF:
+                        if (!label[i + 1 + ii.arg2])
+                                label[i + 1 + ii.arg2] = 1;
+                        break;
+                case INSTR_CMP:
+                        /* see emit_instr() */
+                        if (i + 1 < ex->n_instr
+                            && ex->instr[i + 1].code == INSTR_B_IF
+                            && !label[i + 2]) {
+                                label[i + 2] = 1;
+                        }
+                        break;
+                case INSTR_CALL_FUNC:
+                        label[i + 1] = 2;
+                        break;
+                case INSTR_JUMP_TABLE:
+                        jt = &ex->jtabs[ii.arg2];
+                        label[i + 1 + jt->dflt] = 2;
+                        for (j = 0; j < jt->n; j++)
+                                label[i + 1 + jt->offs[j]] = 2;
+                        break;
+                }
+        }
+}
+
+static void
+emit_ii(FILE *fp, instruction_t ii)
+{
+        fprintf(fp, "(instruction_t){ INSTR_%s, %u, %d }",
+                INSTR_NAMES[ii.code], ii.arg1, ii.arg2);
+}
+
+/* fr->ppii = &ex->instr[i], as if the interpreter had just fetched i-1 */
+static void
+emit_set_ppii(FILE *fp, int i)
+{
+        fprintf(fp, "\tfr->ppii = pc + %d;\n", i);
+}
+
+static void
+emit_call(FILE *fp, instruction_t ii)
+{
+        fprintf(fp, "\th[INSTR_%s](fr, ", INSTR_NAMES[ii.code]);
+        emit_ii(fp, ii);
+        fprintf(fp, ");\n");
+}
+
+/* Write the code for instruction @i of @ex */
+static void
+emit_instr(FILE *fp, struct executable_t *ex, int i)
+{
+        instruction_t ii = ex->instr[i];
+        instruction_t bif;
+
+        switch (ii.code) {
+        case INSTR_B:
+                fprintf(fp, "\tgoto L%d;\n", i + 1 + ii.arg2);
+                break;
+
+        case INSTR_B_IF:
+                emit_set_ppii(fp, i + 1);
+                fprintf(fp, "\tif (H->branch(fr, ");
+                emit_ii(fp, ii);
+                fprintf(fp, "))\n\t\tgoto L%d;\n", i + 1 + ii.arg2);
+                break;
+
+        case INSTR_CMP:
+                if (i + 1 >= ex->n_instr
+                    || ex->instr[i + 1].code != INSTR_B_IF) {
+                        goto generic;
+                }
+                /*
+                 * The B_IF still gets its own code after this, for
+                 * anything that branches to it.
+                 */
+                bif = ex->instr[i + 1];
+                emit_set_ppii(fp, i + 1);
+                fprintf(fp, "\tif (H->cmp_branch(fr, ");
+                emit_ii(fp, ii);
+                fprintf(fp, ", ");
+                emit_ii(fp, bif);
+                fprintf(fp, "))\n\t\tgoto L%d;\n\tgoto L%d;\n",
+                        i + 2 + bif.arg2, i + 2);
+                break;
+
+        case INSTR_PUSH_PTR:
+                if (ii.arg1 == IARG_PTR_AP) {
+                        fprintf(fp, "\tv = fr->stack[fr->ap + %d];\n",
+                                ii.arg2);
+                } else if (ii.arg1 == IARG_PTR_FP) {
+                        fprintf(fp, "\tv = fr->stack[%d];\n", ii.arg2);
+                } else {
+                        goto generic;
+                }
+                fprintf(fp, "\tVAR_INCR_REF(v);\n\t*fr->stackptr++ = v;\n");
+                break;
+
+        case INSTR_POP:
+                fprintf(fp, "\tv = *--fr->stackptr;\n\tVAR_DECR_REF(v);\n");
+                break;
+
+        case INSTR_END:
+                emit_set_ppii(fp, i + 1);
+                fprintf(fp, "\treturn JIT_END;\n");
+                break;
+
+        case INSTR_CALL_FUNC:
+        case INSTR_RETURN_VALUE:
+                emit_set_ppii(fp, i + 1);
+                emit_call(fp, ii);
+                fprintf(fp, "\tif (*H->frame != fr)\n\t\treturn JIT_LEAVE;\n");
+                break;
+
+        case INSTR_JUMP_TABLE:
+                emit_set_ppii(fp, i + 1);
+                emit_call(fp, ii);
+                fprintf(fp, "\tgoto resume;\n");
+                break;
+
+        default:
+        generic:
+                emit_set_ppii(fp, i + 1);
+                emit_call(fp, ii);
+                break;
+        }
+}
+
+/*
+ * Write @ex as function number @idx.
+ * Return: true if it was written, false if it has to be interpreted
+ */
+static bool
+emit_exec(FILE *fp, struct executable_t *ex, int idx)
+{
+        char *label;
+        bool has_jtab = false;
+        int i;
+
+        if (ex->n_instr <= 0 || !emit_check_targets(ex))
+                return false;
+
+        label = ecalloc(ex->n_instr + 1);
+        emit_find_labels(ex, label);
+        for (i = 0; i < ex->n_instr; i++) {
+                if (ex->instr[i].code == INSTR_JUMP_TABLE)
+                        has_jtab = true;
+        }
+
+        fprintf(fp, "\n/* %s line %d */\n", ex->file_name, ex->file_line);
+        fprintf(fp, "static int\nx%d(struct vmframe_t *fr)\n{\n", idx);
+        fprintf(fp, "\tvoid (*const *h)(struct vmframe_t *, instruction_t)"
+                    " = H->handlers;\n");
+        fprintf(fp, "\tinstruction_t *const pc = fr->ex->instr;\n");
+        fprintf(fp, "\tstruct var_t *v;\n\n");
+        fprintf(fp, "\t(void)h;\n\t(void)v;\n");
+        if (has_jtab)
+                fprintf(fp, "resume:\n");
+        fprintf(fp, "\tswitch (fr->ppii - pc) {\n");
+        for (i = 0; i < ex->n_instr; i++) {
+                if (label[i] == 2)
+                        fprintf(fp, "\tcase %d:\n\t\tgoto L%d;\n", i, i);
+        }
+        fprintf(fp, "\t}\n\tbug();\n\treturn JIT_END;\n");
+
+        for (i = 0; i < ex->n_instr; i++) {
+                if (label[i])
+                        fprintf(fp, "L%d:\n", i);
+                fprintf(fp, "\t/* %s */\n", INSTR_NAMES[ex->instr[i].code]);
+                emit_instr(fp, ex, i);
+        }
+        /* shouldn't get here, the last instruction is END or a return */
+        if (label[ex->n_instr])
+                fprintf(fp, "L%d:\n", ex->n_instr);
+        fprintf(fp, "\treturn JIT_LEAVE;\n}\n");
+        free(label);
+        return true;
+}
+
+/* write @s as a C string literal */
+static void
+emit_string(FILE *fp, const char *s)
+{
+        putc('"', fp);
+        for (; *s != '\0'; s++) {
+                unsigned char c = *s;
+                if (c == '"' || c == '\\')
+                        fprintf(fp, "\\%c", c);
+                else if (c < ' ' || c >= 0x7f)
+                        fprintf(fp, "\\%03o", c);
+                else
+                        putc(c, fp);
+        }
+        putc('"', fp);
+}
+
+/**
+ * emit_c - Translate a script into C, for the --emit-c option
+ * @infile:     Script to translate
+ *
+ * The C code is written to stdout.  The script is not executed, and
+ * neither are any files it loads; those will be loaded and interpreted
+ * as usual when the program runs.
+ *
+ * Return: 0, suitable for returning from main().  Errors are fatal.
+ */
+int
+emit_c(const char *infile)
+{
+        struct executable_t *top, *ex;
+        struct lexer_t *lex;
+        struct list_t *li;
+        struct buffer_t b;
+        struct stat st;
+        FILE *fp, *out = stdout;
+        ssize_t i;
+        int n, n_fns;
+        bool *ok;
+
+        fp = fopen(infile, "r");
+        if (!fp)
+                fail("Could not open '%s'", infile);
+        if (fstat(fileno(fp), &st) < 0)
+                fail("Could not stat '%s'", infile);
+        lex = lex_open(fp, notdir(infile));
+        fclose(fp);
+        if (!lex)
+                fail("'%s' is empty", infile);
+        top = assemble(lex, infile, false);
+        lex_close(lex);
+
+        buffer_init(&b);
+        if (!evcc_image(&b, infile, &st, top))
+                fail("Could not make an image of '%s'", infile);
+
+        /*
+         * Translate the executables as they'll be when the program
+         * loads them, so that they're numbered the same way.
+         */
+        top = evcc_load_image(b.s, b.p, infile);
+        bug_on(!top);
+
+        fprintf(out, "/*\n * Generated by evilcandy --emit-c from %s,"
+                     " do not edit.\n */\n", notdir(infile));
+        /*
+         * Some structs, like struct vmframe_t, are laid out differently
+         * without NDEBUG, so the program has to see the headers the
+         * same way libevilcandy.a did, whatever cc flags it gets.
+         */
+#ifdef NDEBUG
+        fprintf(out, "#ifndef NDEBUG\n# define NDEBUG\n#endif\n");
+#else
+        fprintf(out, "#undef NDEBUG\n");
+#endif
+        fprintf(out, "#include <instructions.h>\n#include <evilcandy.h>\n\n");
+        fprintf(out, "static const struct jit_hooks_t *H;\n\n");
+
+        fprintf(out, "static const unsigned char image[%zd]"
+                     " __attribute__((aligned(8))) = {", b.p);
+        for (i = 0; i < b.p; i++) {
+                if (i % 12 == 0)
+                        fprintf(out, "\n\t");
+                else
+                        putc(' ', out);
+                fprintf(out, "0x%02x,", (unsigned char)b.s[i]);
+        }
+        fprintf(out, "\n};\n");
+
+        n_fns = 1;
+        list_foreach(li, &top->list)
+                n_fns++;
+        ok = ecalloc(n_fns * sizeof(*ok));
+
+        ex = top;
+        li = &top->list;
+        for (n = 0; n < n_fns; n++) {
+                ok[n] = emit_exec(out, ex, n);
+                li = li->next;
+                ex = container_of(li, struct executable_t, list);
+        }
+
+        fprintf(out, "\nstatic int (*const fns[%d])(struct vmframe_t *) = {\n",
+                n_fns);
+        for (n = 0; n < n_fns; n++) {
+                if (ok[n])
+                        fprintf(out, "\tx%d,\n", n);
+                else
+                        fprintf(out, "\tNULL,\n");
+        }
+        fprintf(out, "};\n\nint\nmain(void)\n{\n\tH = vm_jit_hooks();\n");
+        fprintf(out, "\treturn emit_c_run(image, sizeof(image), ");
+        emit_string(out, infile);
+        fprintf(out, ",\n\t\t\t  fns, %d);\n}\n", n_fns);
+
+        free(ok);
+        /* @top and the image stay, we're about to exit anyway */
+        return 0;
+}
+
+/**
+ * emit_c_run - Run a program written by emit_c()
+ * @image:      The script's byte-code image
+ * @size:       Size of @image
+ * @file_name:  Name of the script, for error messages
+ * @fns:        C function for each executable in @image, in the same
+ *              order, or NULL for any that should be interpreted
+ * @n_fns:      Number of @fns
+ *
+ * This is the program's whole main(), and it only returns when the
+ * script is done.
+ *
+ * Return: 0, suitable for returning from main().  Errors are fatal.
+ */
+int
+emit_c_run(const void *image, size_t size, const char *file_name,
+           int (*const *fns)(struct vmframe_t *), int n_fns)
+{
+        struct executable_t *top, *ex;
+        struct list_t *li;
+        int n;
+
+        init_lib();
+
+        top = evcc_load_image(image, size, file_name);
+        if (!top)
+                fail("'%s' was translated by a different build", file_name);
+
+        ex = top;
+        li = &top->list;
+        for (n = 0; n < n_fns; n++) {
+                ex->native = fns[n];
+                li = li->next;
+                ex = container_of(li, struct executable_t, list);
+                if (ex == top)
+                        break;
+        }
+        if (n != n_fns - 1 || ex != top)
+                fail("'%s' doesn't match its image", file_name);
+
+        vm_execute(top);
+        return 0;
+}
@@ -3,9 +3,13 @@
 #include <stdarg.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <setjmp.h>
 #include <string.h>
 #include <stdio.h>
 
+/* see err_catch() */
+static __thread jmp_buf *err_catcher = NULL;
+
 #define CSI "\033["
 #define COLOR_RED CSI "31m"
 #define COLOR_GRN CSI "32m"
@@ -49,9 +53,44 @@ syntax_msg__(const char *msg, const char *what, va_list ap)
         if (!file_name)
                 file_name = "(null)";
 
+        /* keep other threads' messages out of the middle of ours */
+        flockfile(stderr);
         fprintf(stderr, "[EvilCandy] %s in file %s line %u: ", what, file_name, line);
         vfprintf(stderr, msg, ap);
         fputc('\n', stderr);
+        funlockfile(stderr);
+}
+
+/**
+ * err_catch - Catch syntax errors in the calling thread
+ * @env: Where syntax() should longjmp() to, with ERR_THROWN, after it
+ *       prints its message, instead of exiting the program.  NULL to
+ *       go back to exiting.
+ *
+ * Return: The previous catcher, which the caller must restore when
+ * it's done.
+ */
+jmp_buf *
+err_catch(jmp_buf *env)
+{
+        jmp_buf *old = err_catcher;
+        err_catcher = env;
+        return old;
+}
+
+/**
+ * err_throw - Give up on whatever we're doing, after an error message
+ *             has already been printed
+ *
+ * This goes to the innermost err_catch() of the calling thread, or
+ * exits the program if there is none.
+ */
+void
+err_throw(void)
+{
+        if (err_catcher)
+                longjmp(*err_catcher, ERR_THROWN);
+        exit(1);
 }
 
 /**
@@ -106,6 +145,6 @@ syntax(const char *msg, ...)
         va_start(ap, msg);
         syntax_msg__(msg, COLOR(RED, "ERROR"), ap);
         va_end(ap);
-        exit(1);
+        err_throw();
 }
 
@@ -0,0 +1,240 @@
+/*
+ * gc.c - Backup collector for reference cycles
+ *
+ * Reference counting frees almost everything as soon as it's unused,
+ * but not a dictionary that holds itself, or two lists that hold each
+ * other, or a function whose closure holds the dictionary the function
+ * is stored in.  Each of those keeps the others' counts above zero
+ * forever.  This finds them by trial deletion, the way Python does:
+ *
+ * 1. Every container handle--dictionary, list, and function--is on
+ *    one list, with a struct gc_head_t at its start.  Copy each one's
+ *    reference count into @gc_refs.
+ *
+ * 2. Subtract every reference that comes from inside a container.
+ *    This has two steps, because containers hold variables, and
+ *    variables hold handles.  First take one off each variable's
+ *    reference count for each container holding it.  A variable left
+ *    at zero is held by nothing but containers, so its own reference
+ *    to a handle is an inside one too, and comes off that handle's
+ *    @gc_refs.
+ *
+ * 3. Anything left with @gc_refs above zero is held by something
+ *    outside of all containers--the stack, a C function, the global
+ *    object--so it's in use.  So is anything it holds, and anything
+ *    that holds, and so on.
+ *
+ * 4. Put the variables' reference counts back the way they were.
+ *
+ * 5. Whatever wasn't reached in step 3 is garbage.  Empty all of those
+ *    containers, which drops the references that were keeping each
+ *    other alive, and reference counting takes care of the rest.
+ *
+ * Reaching something that's really in use through a reference nobody
+ * counted, like a pointer a C function keeps without VAR_INCR_REF,
+ * would mean freeing something still in use.  So gc_collect() is only
+ * called from places where that can't happen: the start of an
+ * instruction that makes a new container, or a script calling
+ * __gbl__._sys.gc().  A reference a container holds but doesn't tell
+ * us about through its @traverse callback is the safe kind of mistake;
+ * it just looks like a reference from outside.
+ */
+#include <evilcandy.h>
+#include "types/var.h"
+#include <stdlib.h>
+#include <time.h>
+
+/* fewest new containers between automatic collections */
+#define GC_THRESHOLD_MIN 10000
+
+static struct list_t gc_list = LIST_INIT(&gc_list);
+static struct gc_stats_t gc_counters;
+
+/* see gc_maybe_collect() */
+unsigned long gc_new_since;
+unsigned long gc_threshold = GC_THRESHOLD_MIN;
+
+/* marks a handle reached in step 3 */
+#define GC_REACHABLE (-1)
+
+#define list2gc(li) container_of(li, struct gc_head_t, list)
+
+/**
+ * gc_track - Add a new container handle to the cycle collector's list
+ * @gc:         The handle's gc_head_t, which must be its first member
+ * @ops:        How to look inside it
+ */
+void
+gc_track(struct gc_head_t *gc, const struct gc_ops_t *ops)
+{
+        gc->ops = ops;
+        gc->gc_refs = 0;
+        list_init(&gc->list);
+        list_add_tail(&gc->list, &gc_list);
+        gc_counters.n_tracked++;
+        gc_new_since++;
+}
+
+/**
+ * gc_untrack - Take a handle off the list, from its destructor
+ */
+void
+gc_untrack(struct gc_head_t *gc)
+{
+        list_remove(&gc->list);
+        gc_counters.n_tracked--;
+}
+
+/* the container handle @v holds, if any */
+static struct gc_head_t *
+var2gc(struct var_t *v)
+{
+        switch (v->magic) {
+        case TYPE_DICT:
+        case TYPE_FUNCTION:
+        case TYPE_LIST:
+                /* gc_head_t is first, see struct gc_ops_t */
+                return (struct gc_head_t *)v->o;
+        default:
+                return NULL;
+        }
+}
+
+static inline int
+gc_nref(struct gc_head_t *gc)
+{
+        return TYPE_HANDLE_PREHEADER(gc)->nref;
+}
+
+static void
+visit_subtract(struct var_t *v, void *unused)
+{
+        v->refcount--;
+}
+
+static void
+visit_inside(struct var_t *v, void *unused)
+{
+        struct gc_head_t *gc;
+
+        /* only once per variable, however many containers hold it */
+        if (v->refcount != 0)
+                return;
+        v->refcount = -1;
+        if ((gc = var2gc(v)) != NULL)
+                gc->gc_refs--;
+}
+
+static void
+visit_restore(struct var_t *v, void *unused)
+{
+        if (v->refcount < 0)
+                v->refcount = 0;
+        v->refcount++;
+}
+
+struct reach_t {
+        struct gc_head_t **work;
+        unsigned long n;
+};
+
+static void
+visit_reach(struct var_t *v, void *arg)
+{
+        struct reach_t *r = arg;
+        struct gc_head_t *gc = var2gc(v);
+
+        if (gc && gc->gc_refs != GC_REACHABLE) {
+                gc->gc_refs = GC_REACHABLE;
+                r->work[r->n++] = gc;
+        }
+}
+
+static void
+traverse(struct gc_head_t *gc, void (*visit)(struct var_t *, void *),
+         void *arg)
+{
+        gc->ops->traverse((void *)gc, visit, arg);
+}
+
+/**
+ * gc_collect - Find and free containers that only hold each other
+ *
+ * Return: Number of containers freed
+ */
+unsigned long
+gc_collect(void)
+{
+        struct list_t *li;
+        struct gc_head_t **garbage;
+        struct reach_t r;
+        struct timespec t0, t1;
+        unsigned long i, n_garbage = 0;
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        r.work = emalloc((gc_counters.n_tracked + 1) * sizeof(*r.work));
+        r.n = 0;
+
+        /* steps 1 and 2 */
+        list_foreach(li, &gc_list)
+                list2gc(li)->gc_refs = gc_nref(list2gc(li));
+        list_foreach(li, &gc_list)
+                traverse(list2gc(li), visit_subtract, NULL);
+        list_foreach(li, &gc_list)
+                traverse(list2gc(li), visit_inside, NULL);
+
+        /* step 3 */
+        list_foreach(li, &gc_list) {
+                struct gc_head_t *gc = list2gc(li);
+                if (gc->gc_refs > 0) {
+                        gc->gc_refs = GC_REACHABLE;
+                        r.work[r.n++] = gc;
+                }
+        }
+        while (r.n > 0)
+                traverse(r.work[--r.n], visit_reach, &r);
+
+        /* step 4 */
+        list_foreach(li, &gc_list)
+                traverse(list2gc(li), visit_restore, NULL);
+
+        /*
+         * Step 5.  Hold on to each of them while they're being emptied,
+         * or one could be destroyed while another is still being
+         * emptied of it.  Reuse r.work for the list of them, since
+         * emptying them takes them off gc_list.
+         */
+        garbage = r.work;
+        list_foreach(li, &gc_list) {
+                struct gc_head_t *gc = list2gc(li);
+                if (gc->gc_refs != GC_REACHABLE) {
+                        TYPE_HANDLE_INCR_REF(gc);
+                        garbage[n_garbage++] = gc;
+                }
+        }
+        for (i = 0; i < n_garbage; i++)
+                garbage[i]->ops->clear((void *)garbage[i]);
+        for (i = 0; i < n_garbage; i++)
+                TYPE_HANDLE_DECR_REF(garbage[i]);
+        free(garbage);
+
+        gc_new_since = 0;
+        gc_threshold = gc_counters.n_tracked > GC_THRESHOLD_MIN
+                       ? gc_counters.n_tracked : GC_THRESHOLD_MIN;
+
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        gc_counters.n_collections++;
+        gc_counters.n_freed += n_garbage;
+        gc_counters.usec += (t1.tv_sec - t0.tv_sec) * 1000000LL
+                            + (t1.tv_nsec - t0.tv_nsec) / 1000;
+        return n_garbage;
+}
+
+/**
+ * gc_stats - Get the cycle collector's counters
+ */
+void
+gc_stats(struct gc_stats_t *stats)
+{
+        *stats = gc_counters;
+}
@@ -13,20 +13,23 @@
  */
 enum { INIT_SIZE = 16 };
 
-static struct mempool_t *bucket_mempool = NULL;
-
+/*
+ * mem_alloc()'s pools are per thread, so different threads can use
+ * different tables without locking.  A table must be destroyed by the
+ * thread that filled it.
+ */
 static struct bucket_t *
 bucket_alloc(void)
 {
-        if (!bucket_mempool)
-                bucket_mempool = mempool_new(sizeof(struct bucket_t));
-        return mempool_alloc(bucket_mempool);
+        memstat_alloc(MS_BUCKET, sizeof(struct bucket_t));
+        return mem_alloc(sizeof(struct bucket_t));
 }
 
 static void
 bucket_free(struct bucket_t *b)
 {
-        mempool_free(bucket_mempool, b);
+        memstat_free(MS_BUCKET, sizeof(*b));
+        mem_free(b, sizeof(*b));
 }
 
 static inline int
@@ -43,13 +46,18 @@ seek_helper(struct hashtable_t *htbl, const void *key,
         unsigned int i = bucketi(htbl, hash);
         struct bucket_t *b;
         unsigned long perturb = hash;
+        int dead = -1;
         /* this won't spinlock because we ensure table has
          * enough room.  See comment in literal.c about
          * why the perturbation algo won't spinlock.
          */
         while ((b = htbl->bucket[i]) != NULL) {
-                if (b != BUCKET_DEAD && htbl->key_match(b->key, key))
+                if (b == BUCKET_DEAD) {
+                        if (dead < 0)
+                                dead = i;
+                } else if (htbl->key_match(b->key, key)) {
                         break;
+                }
                 /*
                  * Collision or dead entry.
                  * See big comment in seek_helper in literal.c
@@ -58,6 +66,15 @@ seek_helper(struct hashtable_t *htbl, const void *key,
                 perturb >>= 5;
                 i = bucketi(htbl, i * 5 + perturb + 1);
         }
+        /*
+         * Not found, so reuse the first dead slot for a new entry.
+         * Otherwise a dictionary whose keys come and go, and whose
+         * keys are freed and then allocated at the same address, as
+         * literal_put_ref() names are, would probe a longer and longer
+         * trail of dead slots until the table is resized.
+         */
+        if (!b && dead >= 0)
+                i = dead;
         *idx = i;
         return b;
 }
@@ -135,12 +152,14 @@ hashtable_put(struct hashtable_t *htbl, void *key, void *data)
         if (b)
                 return -1;
 
+        /* @count already includes a dead slot */
+        if (htbl->bucket[i] == NULL)
+                htbl->count++;
         b = bucket_alloc();
         b->key = key;
         b->data = data;
         b->hash = hash;
         htbl->bucket[i] = b;
-        htbl->count++;
         htbl->used++;
         maybe_grow_table(htbl);
         return 0;
@@ -187,6 +206,8 @@ hashtable_init(struct hashtable_t *htbl,
         htbl->calc_hash = calc_hash;
         htbl->key_match = key_match;
         htbl->delete_data = delete_data;
+        /* the caller may set this, see object_init() */
+        htbl->delete_key = NULL;
 }
 
 static void
@@ -198,6 +219,8 @@ hashtable_clear_entries_(struct hashtable_t *htbl)
                 if (htbl->bucket[i] == BUCKET_DEAD) {
                         htbl->bucket[i] = NULL;
                 } else if (htbl->bucket[i] != NULL) {
+                        if (htbl->delete_key)
+                                htbl->delete_key(htbl->bucket[i]->key);
                         htbl->delete_data(htbl->bucket[i]->data);
                         bucket_free(htbl->bucket[i]);
                         htbl->bucket[i] = NULL;
@@ -296,8 +296,12 @@ assert_array_pos(int idx, void **arr,
         new_alloc = *alloc_bytes;
         while (new_alloc < need_size) {
                 new_alloc <<= 2;
-                if (new_alloc > MAX_ALLOC)
-                        return -1;
+                if (new_alloc > MAX_ALLOC) {
+                        /* don't let the x4 step overshoot a fitting size */
+                        if (need_size > MAX_ALLOC)
+                                return -1;
+                        new_alloc = MAX_ALLOC;
+                }
         }
         if (new_alloc == *alloc_bytes)
                 return 0; /* didn't need to do anything */
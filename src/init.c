@@ -0,0 +1,33 @@
+/*
+ * init.c - Global data and start-up code, shared by the interpreter's
+ *          main() and by programs built from the output of --emit-c,
+ *          which link against libevilcandy.a instead of main.c.
+ */
+#include <evilcandy.h>
+
+struct global_t q_;
+
+/**
+ * init_lib - Initialize all the modules, before doing anything else
+ */
+void
+init_lib(void)
+{
+        static const struct initfn_tbl_t {
+                void (*initfn)(void);
+        } INITFNS[] = {
+                /* Note: the order of this table matters */
+                { .initfn = moduleinit_memstat },
+                { .initfn = moduleinit_keyword },
+                { .initfn = moduleinit_literal },
+                { .initfn = moduleinit_var },
+                { .initfn = moduleinit_builtin },
+                { .initfn = moduleinit_lex },
+                { .initfn = moduleinit_vm },
+                { .initfn = NULL },
+        };
+        const struct initfn_tbl_t *t;
+
+        for (t = INITFNS; t->initfn != NULL; t++)
+                t->initfn();
+}
@@ -0,0 +1,610 @@
+/*
+ * jit.c - Baseline template JIT, enabled by the -j option
+ *
+ * When an executable gets hot--the VM counts calls to it and backward
+ * branches taken in it, see jit_tick() in vm.c--its instructions are
+ * translated into x86-64 machine code, one template per instruction:
+ *
+ * - Most instructions become a direct call to the same do_* handler
+ *   the interpreter would have called, with the instruction as an
+ *   immediate argument.  That saves the fetch and the indirect jump
+ *   through JUMP_TABLE, and it lets the CPU predict every call.
+ * - B becomes a jump, B_IF a call to a helper that pops and tests the
+ *   condition followed by a conditional jump, and a CMP followed by
+ *   a B_IF is fused into one helper call that doesn't allocate a
+ *   variable for the result when comparing two integers.
+ * - PUSH_PTR of an argument or local, and POP, are inlined.
+ *
+ * The VM's stack, frame, and reference counting are exactly the same
+ * as when interpreting, so the interpreter can take over or hand off
+ * at any instruction.  The machine code returns to the interpreter's
+ * loop whenever the current frame changes, ie. after a user function
+ * call or a return, and the loop carries on in the new frame with
+ * its own machine code, if it has any, or by interpreting it.
+ *
+ * Register use in the generated code: %rbx holds the frame, which is
+ * callee-saved so it survives the handler calls.  Nothing else is
+ * kept in registers across instructions, since the handlers read and
+ * write the frame's stack pointer.
+ *
+ * If EVILCANDY_PERF_MAP is set in the environment, the location of
+ * each executable's code is written to /tmp/perf-PID.map, so that
+ * perf(1) can name them.
+ *
+ * On other architectures jit_compile() always fails, and everything
+ * is interpreted.
+ */
+#include <instructions.h>
+#include <evilcandy.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) && defined(__linux__)
+
+#include <sys/mman.h>
+
+/*
+ * Upper bound on machine code for one instruction.  The biggest ones,
+ * CALL_FUNC and a fused CMP + B_IF, are under 60 bytes.
+ */
+#define JIT_MAX_TEMPLATE        96
+/* prologue and the exit stubs */
+#define JIT_MAX_STUBS           64
+
+/**
+ * struct jit_code_t - Machine code for an executable
+ * @mem:        mmap'd code, read and execute only
+ * @size:       Size of @mem
+ * @entry:      Address in @mem of each instruction's code
+ */
+struct jit_code_t {
+        unsigned char *mem;
+        size_t size;
+        unsigned char **entry;
+};
+
+/* jump or call whose rel32 must be filled in after everything's placed */
+struct jit_fixup_t {
+        size_t pos;
+        int target;
+};
+
+/**
+ * struct jit_buf_t - State while generating code
+ * @p:          Where the code is being written
+ * @pos:        Current offset into @p
+ * @size:       Allocated size of @p
+ * @entry:      Offset of each instruction's code, and of the exit
+ *              stubs after them, see jit_compile()
+ * @fix:        Jumps to patch when all of @entry is known
+ * @n_fix:      Number of @fix
+ * @fix_alloc:  Bytes allocated for @fix
+ */
+struct jit_buf_t {
+        unsigned char *p;
+        size_t pos;
+        size_t size;
+        size_t *entry;
+        struct jit_fixup_t *fix;
+        int n_fix;
+        size_t fix_alloc;
+};
+
+/* perf map, or NULL if EVILCANDY_PERF_MAP is not set */
+static FILE *perf_map = NULL;
+static bool perf_map_checked = false;
+
+static void
+e8(struct jit_buf_t *b, unsigned int x)
+{
+        bug_on(b->pos >= b->size);
+        b->p[b->pos++] = x;
+}
+
+static void
+e32(struct jit_buf_t *b, uint32_t x)
+{
+        bug_on(b->pos + 4 > b->size);
+        memcpy(&b->p[b->pos], &x, 4);
+        b->pos += 4;
+}
+
+static void
+e64(struct jit_buf_t *b, uint64_t x)
+{
+        bug_on(b->pos + 8 > b->size);
+        memcpy(&b->p[b->pos], &x, 8);
+        b->pos += 8;
+}
+
+static uint32_t
+instr_bits(instruction_t ii)
+{
+        uint32_t x;
+        memcpy(&x, &ii, sizeof(x));
+        return x;
+}
+
+/* movabs $x, %rax */
+static void
+emit_mov_rax(struct jit_buf_t *b, const void *x)
+{
+        e8(b, 0x48);
+        e8(b, 0xb8);
+        e64(b, (uintptr_t)x);
+}
+
+/* rel32 for jumps to instruction @target, see jit_resolve() */
+static void
+emit_rel32(struct jit_buf_t *b, int target)
+{
+        if (assert_array_pos(b->n_fix, (void **)&b->fix,
+                             &b->fix_alloc, sizeof(*b->fix)) < 0) {
+                fail("Out of memory");
+        }
+        b->fix[b->n_fix].pos = b->pos;
+        b->fix[b->n_fix].target = target;
+        b->n_fix++;
+        e32(b, 0);
+}
+
+/* jmp @target */
+static void
+emit_jmp(struct jit_buf_t *b, int target)
+{
+        e8(b, 0xe9);
+        emit_rel32(b, target);
+}
+
+/* jcc @target, @cc is the low nibble of the 0x0f 0x8X opcode */
+static void
+emit_jcc(struct jit_buf_t *b, unsigned int cc, int target)
+{
+        e8(b, 0x0f);
+        e8(b, 0x80 | cc);
+        emit_rel32(b, target);
+}
+
+enum {
+        CC_NE = 0x5,
+};
+
+/* fr->ppii = &ex->instr[i], as if the interpreter had just fetched i-1 */
+static void
+emit_set_ppii(struct jit_buf_t *b, struct executable_t *ex, int i)
+{
+        emit_mov_rax(b, &ex->instr[i]);
+        /* mov %rax, disp32(%rbx) */
+        e8(b, 0x48);
+        e8(b, 0x89);
+        e8(b, 0x83);
+        e32(b, offsetof(struct vmframe_t, ppii));
+}
+
+/* fn(fr, ii [, ii2]) */
+static void
+emit_call(struct jit_buf_t *b, const void *fn,
+          instruction_t ii, const instruction_t *ii2)
+{
+        /* mov %rbx, %rdi */
+        e8(b, 0x48);
+        e8(b, 0x89);
+        e8(b, 0xdf);
+        /* mov $ii, %esi */
+        e8(b, 0xbe);
+        e32(b, instr_bits(ii));
+        if (ii2) {
+                /* mov $ii2, %edx */
+                e8(b, 0xba);
+                e32(b, instr_bits(*ii2));
+        }
+        emit_mov_rax(b, fn);
+        /* call *%rax */
+        e8(b, 0xff);
+        e8(b, 0xd0);
+}
+
+/* leave if the handler we just called changed the current frame */
+static void
+emit_frame_check(struct jit_buf_t *b, const struct jit_hooks_t *hooks,
+                 int leave)
+{
+        emit_mov_rax(b, hooks->frame);
+        /* cmp %rbx, (%rax) */
+        e8(b, 0x48);
+        e8(b, 0x39);
+        e8(b, 0x18);
+        emit_jcc(b, CC_NE, leave);
+}
+
+/* push fr->stack[arg2], or fr->stack[fr->ap + arg2] if @ap */
+static void
+emit_push_ptr(struct jit_buf_t *b, instruction_t ii, bool ap)
+{
+        long disp = offsetof(struct vmframe_t, stack)
+                    + sizeof(struct var_t *) * ii.arg2;
+
+        if (ap) {
+                /* movslq disp32(%rbx), %rax */
+                e8(b, 0x48);
+                e8(b, 0x63);
+                e8(b, 0x83);
+                e32(b, offsetof(struct vmframe_t, ap));
+                /* mov disp32(%rbx,%rax,8), %rax */
+                e8(b, 0x48);
+                e8(b, 0x8b);
+                e8(b, 0x84);
+                e8(b, 0xc3);
+                e32(b, disp);
+        } else {
+                /* mov disp32(%rbx), %rax */
+                e8(b, 0x48);
+                e8(b, 0x8b);
+                e8(b, 0x83);
+                e32(b, disp);
+        }
+        /* incw disp8(%rax): VAR_INCR_REF */
+        e8(b, 0x66);
+        e8(b, 0xff);
+        e8(b, 0x40);
+        e8(b, offsetof(struct var_t, refcount));
+        /* mov disp32(%rbx), %rcx */
+        e8(b, 0x48);
+        e8(b, 0x8b);
+        e8(b, 0x8b);
+        e32(b, offsetof(struct vmframe_t, stackptr));
+        /* mov %rax, (%rcx) */
+        e8(b, 0x48);
+        e8(b, 0x89);
+        e8(b, 0x01);
+        /* add $8, %rcx */
+        e8(b, 0x48);
+        e8(b, 0x83);
+        e8(b, 0xc1);
+        e8(b, sizeof(struct var_t *));
+        /* mov %rcx, disp32(%rbx) */
+        e8(b, 0x48);
+        e8(b, 0x89);
+        e8(b, 0x8b);
+        e32(b, offsetof(struct vmframe_t, stackptr));
+}
+
+/* VAR_DECR_REF(pop(fr)) */
+static void
+emit_pop(struct jit_buf_t *b)
+{
+        size_t skip;
+
+        /* mov disp32(%rbx), %rcx */
+        e8(b, 0x48);
+        e8(b, 0x8b);
+        e8(b, 0x8b);
+        e32(b, offsetof(struct vmframe_t, stackptr));
+        /* sub $8, %rcx */
+        e8(b, 0x48);
+        e8(b, 0x83);
+        e8(b, 0xe9);
+        e8(b, sizeof(struct var_t *));
+        /* mov %rcx, disp32(%rbx) */
+        e8(b, 0x48);
+        e8(b, 0x89);
+        e8(b, 0x8b);
+        e32(b, offsetof(struct vmframe_t, stackptr));
+        /* mov (%rcx), %rdi */
+        e8(b, 0x48);
+        e8(b, 0x8b);
+        e8(b, 0x39);
+        /* decw disp8(%rdi) */
+        e8(b, 0x66);
+        e8(b, 0xff);
+        e8(b, 0x4f);
+        e8(b, offsetof(struct var_t, refcount));
+        /* jg over the call */
+        e8(b, 0x7f);
+        skip = b->pos;
+        e8(b, 0);
+        emit_mov_rax(b, var_delete__);
+        /* call *%rax */
+        e8(b, 0xff);
+        e8(b, 0xd0);
+        b->p[skip] = b->pos - skip - 1;
+}
+
+/* return @code to jit_run() */
+static void
+emit_return(struct jit_buf_t *b, int code)
+{
+        if (code == 0) {
+                /* xor %eax, %eax */
+                e8(b, 0x31);
+                e8(b, 0xc0);
+        } else {
+                /* mov $code, %eax */
+                e8(b, 0xb8);
+                e32(b, code);
+        }
+        /* pop %rbx; ret */
+        e8(b, 0x5b);
+        e8(b, 0xc3);
+}
+
+/* fill in the jumps, now that we know where everything is */
+static void
+jit_resolve(struct jit_buf_t *b)
+{
+        int i;
+        for (i = 0; i < b->n_fix; i++) {
+                struct jit_fixup_t *f = &b->fix[i];
+                int32_t rel = b->entry[f->target] - (f->pos + 4);
+                memcpy(&b->p[f->pos], &rel, 4);
+        }
+}
+
+/* Return: true if every branch in @ex lands inside @ex */
+static bool
+jit_check_targets(struct executable_t *ex)
+{
+        int i;
+        for (i = 0; i < ex->n_instr; i++) {
+                instruction_t ii = ex->instr[i];
+                int target = i + 1 + ii.arg2;
+                if ((ii.code == INSTR_B || ii.code == INSTR_B_IF)
+                    && (target < 0 || target >= ex->n_instr)) {
+                        return false;
+                }
+                if (ii.code >= N_INSTR)
+                        return false;
+        }
+        return true;
+}
+
+static void
+perf_map_add(struct executable_t *ex, void *code, size_t len)
+{
+        if (!perf_map_checked) {
+                perf_map_checked = true;
+                if (getenv("EVILCANDY_PERF_MAP") != NULL) {
+                        char path[64];
+                        sprintf(path, "/tmp/perf-%d.map", (int)getpid());
+                        perf_map = fopen(path, "a");
+                }
+        }
+        if (!perf_map)
+                return;
+        fprintf(perf_map, "%lx %zx evc:%s:%d\n", (unsigned long)code,
+                len, notdir(ex->file_name), ex->file_line);
+        fflush(perf_map);
+}
+
+/**
+ * jit_compile - Translate an executable into machine code
+ * @ex:         Executable to translate.  If successful, @ex->jit will
+ *              be set, and the VM will use it the next time it gets
+ *              to an instruction in @ex.
+ * @hooks:      Handlers and such from vm.c
+ *
+ * Return: true if @ex was translated, false if not, in which case it
+ * will just keep getting interpreted.
+ */
+bool
+jit_compile(struct executable_t *ex, const struct jit_hooks_t *hooks)
+{
+        struct jit_buf_t b;
+        struct jit_code_t *jit;
+        int i, n, leave, dispatch;
+        size_t size;
+
+        if (ex->jit || ex->lazy || ex->n_instr <= 0 || !jit_check_targets(ex))
+                return false;
+
+        n = ex->n_instr;
+        size = JIT_MAX_STUBS + (size_t)n * JIT_MAX_TEMPLATE;
+        size = (size + getpagesize() - 1) & ~((size_t)getpagesize() - 1);
+
+        memset(&b, 0, sizeof(b));
+        b.p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (b.p == MAP_FAILED)
+                return false;
+        b.size = size;
+        /* entry[n] and entry[n + 1] are the exit stubs */
+        leave = n;
+        dispatch = n + 1;
+        b.entry = emalloc(sizeof(*b.entry) * (n + 2));
+
+        /*
+         * int enter(struct vmframe_t *fr, void *at):
+         *      push %rbx; mov %rdi, %rbx; jmp *%rsi
+         * This leaves the stack 16-byte aligned for the handler calls.
+         */
+        e8(&b, 0x53);
+        e8(&b, 0x48);
+        e8(&b, 0x89);
+        e8(&b, 0xfb);
+        e8(&b, 0xff);
+        e8(&b, 0xe6);
+
+        for (i = 0; i < n; i++) {
+                instruction_t ii = ex->instr[i];
+
+                b.entry[i] = b.pos;
+                switch (ii.code) {
+                case INSTR_B:
+                        emit_jmp(&b, i + 1 + ii.arg2);
+                        break;
+
+                case INSTR_B_IF:
+                        emit_set_ppii(&b, ex, i + 1);
+                        emit_call(&b, hooks->branch, ii, NULL);
+                        /* test %eax, %eax */
+                        e8(&b, 0x85);
+                        e8(&b, 0xc0);
+                        emit_jcc(&b, CC_NE, i + 1 + ii.arg2);
+                        break;
+
+                case INSTR_CMP:
+                        if (i + 1 < n && ex->instr[i + 1].code == INSTR_B_IF) {
+                                instruction_t bif = ex->instr[i + 1];
+                                emit_set_ppii(&b, ex, i + 1);
+                                emit_call(&b, hooks->cmp_branch, ii, &bif);
+                                e8(&b, 0x85);
+                                e8(&b, 0xc0);
+                                emit_jcc(&b, CC_NE, i + 2 + bif.arg2);
+                                emit_jmp(&b, i + 2);
+                                /*
+                                 * The B_IF still gets its own code
+                                 * below, in case something enters
+                                 * there.
+                                 */
+                                break;
+                        }
+                        goto generic;
+
+                case INSTR_PUSH_PTR:
+                        if (ii.arg1 == IARG_PTR_AP || ii.arg1 == IARG_PTR_FP) {
+                                emit_push_ptr(&b, ii, ii.arg1 == IARG_PTR_AP);
+                                break;
+                        }
+                        goto generic;
+
+                case INSTR_POP:
+                        emit_pop(&b);
+                        break;
+
+                case INSTR_END:
+                        emit_set_ppii(&b, ex, i + 1);
+                        emit_return(&b, JIT_END);
+                        break;
+
+                case INSTR_CALL_FUNC:
+                case INSTR_RETURN_VALUE:
+                        emit_set_ppii(&b, ex, i + 1);
+                        emit_call(&b, hooks->handlers[ii.code], ii, NULL);
+                        emit_frame_check(&b, hooks, leave);
+                        break;
+
+                case INSTR_JUMP_TABLE:
+                        emit_set_ppii(&b, ex, i + 1);
+                        emit_call(&b, hooks->handlers[ii.code], ii, NULL);
+                        emit_jmp(&b, dispatch);
+                        break;
+
+                default:
+                generic:
+                        emit_set_ppii(&b, ex, i + 1);
+                        emit_call(&b, hooks->handlers[ii.code], ii, NULL);
+                        break;
+                }
+        }
+        /* shouldn't get here, the last instruction is END or a return */
+        b.entry[leave] = b.pos;
+        emit_return(&b, JIT_LEAVE);
+
+        /* carry on from wherever fr->ppii points */
+        b.entry[dispatch] = b.pos;
+        /* mov disp32(%rbx), %rax */
+        e8(&b, 0x48);
+        e8(&b, 0x8b);
+        e8(&b, 0x83);
+        e32(&b, offsetof(struct vmframe_t, ppii));
+        /* movabs $instr, %rcx; sub %rcx, %rax; shr $2, %rax */
+        e8(&b, 0x48);
+        e8(&b, 0xb9);
+        e64(&b, (uintptr_t)ex->instr);
+        e8(&b, 0x48);
+        e8(&b, 0x29);
+        e8(&b, 0xc8);
+        e8(&b, 0x48);
+        e8(&b, 0xc1);
+        e8(&b, 0xe8);
+        e8(&b, 2);
+        /* movabs $entry, %rcx; jmp *(%rcx,%rax,8) */
+        jit = emalloc(sizeof(*jit));
+        jit->entry = emalloc(sizeof(*jit->entry) * n);
+        e8(&b, 0x48);
+        e8(&b, 0xb9);
+        e64(&b, (uintptr_t)jit->entry);
+        e8(&b, 0xff);
+        e8(&b, 0x24);
+        e8(&b, 0xc1);
+
+        jit_resolve(&b);
+
+        if (mprotect(b.p, size, PROT_READ | PROT_EXEC) < 0) {
+                munmap(b.p, size);
+                free(jit->entry);
+                free(jit);
+                free(b.entry);
+                free(b.fix);
+                return false;
+        }
+
+        jit->mem = b.p;
+        jit->size = size;
+        for (i = 0; i < n; i++)
+                jit->entry[i] = b.p + b.entry[i];
+        free(b.entry);
+        free(b.fix);
+
+        perf_map_add(ex, b.p, b.pos);
+        ex->jit = jit;
+        return true;
+}
+
+/**
+ * jit_run - Run the current frame's machine code
+ * @fr: Current frame, whose executable has been through jit_compile()
+ *
+ * This starts at @fr->ppii and keeps going until the current frame
+ * changes.
+ *
+ * Return: JIT_END if INSTR_END was reached, JIT_LEAVE otherwise
+ */
+int
+jit_run(struct vmframe_t *fr)
+{
+        struct jit_code_t *jit = fr->ex->jit;
+        int (*enter)(struct vmframe_t *, void *);
+        long idx = fr->ppii - fr->ex->instr;
+
+        bug_on(idx < 0 || idx >= fr->ex->n_instr);
+        enter = (int (*)(struct vmframe_t *, void *))jit->mem;
+        return enter(fr, jit->entry[idx]);
+}
+
+/**
+ * jit_free - Free the machine code for an executable
+ */
+void
+jit_free(struct jit_code_t *jit)
+{
+        munmap(jit->mem, jit->size);
+        free(jit->entry);
+        free(jit);
+}
+
+#else /* !x86-64 */
+
+bool
+jit_compile(struct executable_t *ex, const struct jit_hooks_t *hooks)
+{
+        return false;
+}
+
+int
+jit_run(struct vmframe_t *fr)
+{
+        bug();
+        return JIT_END;
+}
+
+void
+jit_free(struct jit_code_t *jit)
+{
+        bug();
+}
+
+#endif /* !x86-64 */
@@ -1,28 +1,34 @@
 #include <evilcandy.h>
 #include "token.h"
+#include <string.h>
 
 /*
- * Brute-force, dumbest-but-fastest version of a trie.  The only RAM
- * optimizations are 1) since all keywords have just lower-case alphabet
- * characters, we can reduce the per-trie array to 26 pointers; and
- * 2) there aren't that many keywords.  At a point when there were eleven
- * keywords, this was measured to consume ~9.7KB, as opposed to a bitwise
- * trie, which consumed only ~1KB.  I can live with that.  Computers are
- * no longer made of wood and sails.
+ * Perfect hash of our keywords.  The hash only looks at the first
+ * character, the last character, and the length, which is enough to
+ * tell all of our keywords apart.  KW_SEED is a multiplier that makes
+ * none of them collide, so a lookup costs one hash and at most one
+ * strcmp().  If a new keyword makes two of them collide, a debug
+ * build's moduleinit_keyword() says which seed to use instead.  If no
+ * seed works, enlarge KW_HTBL_SIZE.
  */
-struct kwtrie_t {
-        int value;
-        struct kwtrie_t *ptrs[26];
+enum {
+        KW_HTBL_SIZE    = 64,
+        KW_MINLEN       = 2,
+        KW_MAXLEN       = 8,
+        KW_SEED         = 4,
 };
 
-static struct kwtrie_t *kw_trie;
+static struct kw_hent_t {
+        const char *name;
+        int v;
+} kw_htbl[KW_HTBL_SIZE];
 
-static struct kwtrie_t *
-new_kwtrie(void)
+static inline unsigned int
+kw_hash(const char *key, size_t len, unsigned int seed)
 {
-        struct kwtrie_t *ret = ecalloc(sizeof(*ret));
-        ret->value = -1;
-        return ret;
+        unsigned int c0 = (unsigned char)key[0];
+        unsigned int cn = (unsigned char)key[len - 1];
+        return (c0 * seed + cn + len) & (KW_HTBL_SIZE - 1);
 }
 
 /**
@@ -35,45 +41,46 @@ new_kwtrie(void)
 int
 keyword_seek(const char *key)
 {
-        struct kwtrie_t *trie = kw_trie;
-        while (*key) {
-                int c = *key - 'a';
-                if (c < 0 || c > 25)
-                        return -1;
-                trie = trie->ptrs[c];
-                if (!trie)
-                        return -1;
-                key++;
-        }
-        return trie->value;
+        struct kw_hent_t *ent;
+        size_t len = strlen(key);
+
+        if (len < KW_MINLEN || len > KW_MAXLEN)
+                return -1;
+
+        ent = &kw_htbl[kw_hash(key, len, KW_SEED)];
+        if (!ent->name || strcmp(ent->name, key) != 0)
+                return -1;
+        return ent->v;
 }
 
-static void
-keyword_insert(const char *key, int value)
+/*
+ * Fill kw_htbl with @keywords using @seed.
+ *
+ * Return: 0 if OK, -1 if two of them collide
+ */
+static int
+kw_fill(const struct kw_hent_t *keywords, unsigned int seed)
 {
-        struct kwtrie_t *trie = kw_trie;
-        while (*key) {
-                struct kwtrie_t *child;
-                int c = *key - 'a';
-                bug_on(c < 0 || c > 25);
-                child = trie->ptrs[c];
-                if (!child) {
-                        trie->ptrs[c] = new_kwtrie();
-                        child = trie->ptrs[c];
-                }
-                trie = child;
-                key++;
+        const struct kw_hent_t *tkw;
+
+        memset(kw_htbl, 0, sizeof(kw_htbl));
+        for (tkw = keywords; tkw->name != NULL; tkw++) {
+                size_t len = strlen(tkw->name);
+                struct kw_hent_t *ent;
+
+                bug_on(len < KW_MINLEN || len > KW_MAXLEN);
+                ent = &kw_htbl[kw_hash(tkw->name, len, seed)];
+                if (ent->name)
+                        return -1;
+                *ent = *tkw;
         }
-        trie->value = value;
+        return 0;
 }
 
 void
 moduleinit_keyword(void)
 {
-        static const struct kw_tbl_t {
-                const char *name;
-                int v;
-        } KEYWORDS[] = {
+        static const struct kw_hent_t KEYWORDS[] = {
                 { "function",   OC_FUNC },
                 { "let",        OC_LET },
                 { "return",     OC_RETURN },
@@ -90,11 +97,23 @@ moduleinit_keyword(void)
                 { "true",       OC_TRUE },
                 { "false",      OC_FALSE },
                 { "null",       OC_NULL },
+                { "switch",     OC_SWITCH },
+                { "case",       OC_CASE },
+                { "default",    OC_DEFAULT },
                 { NULL, 0 }
         };
-        const struct kw_tbl_t *tkw;
-        kw_trie = new_kwtrie();
-        for (tkw = KEYWORDS; tkw->name != NULL; tkw++)
-                keyword_insert(tkw->name, tkw->v);
-}
+#ifndef NDEBUG
+        unsigned int seed;
+#endif
 
+        if (kw_fill(KEYWORDS, KW_SEED) == 0)
+                return;
+
+#ifndef NDEBUG
+        for (seed = 1; seed < 256; seed++) {
+                if (kw_fill(KEYWORDS, seed) == 0)
+                        fail("Keywords collide, set KW_SEED to %u", seed);
+        }
+#endif
+        fail("Keywords collide, KW_SEED needs changing");
+}
@@ -1,4 +1,4 @@
-/* lex.c - Tokenizer and prescan code */
+/* lex.c - Tokenizer code */
 #include <evilcandy.h>
 #include "token.h"
 #include <ctype.h>
@@ -12,29 +12,36 @@ enum {
         QIDENT = 0x02,
         QIDENT1 = 0x04,
         QDDELIM = 0x08,
+        QSPACE = 0x10,
+        QDIGIT = 0x20,
 };
 
-/* we do not recurse here, so just let it be a static struct */
-static struct {
+/**
+ * struct lexer_t - State of one input being tokenized
+ * @lineno:     Current line number in @filename
+ * @tok:        Text of the token being scanned
+ * @s:          Current position in @text
+ * @text:       The whole input, nulchar-terminated
+ * @filename:   Name of the input, for error messages
+ *
+ * Nothing else in this file changes after moduleinit_lex(), so any
+ * number of these may be tokenizing at once, even in different threads.
+ */
+struct lexer_t {
         int lineno;
         struct buffer_t tok;
         char *s;
-        size_t _slen; /* for getline calls */
-        char *line;   /* ditto */
-        FILE *fp;
+        char *text;
         char *filename;
-        /* look up tables */
-        unsigned char charmap[128];
-} lexer = {
-        .lineno = 0,
-        .s = NULL,
 };
 
-static inline bool q_isascii(int c) { return c && c == (c & 0x7fu); }
+/* look up table, filled in by moduleinit_lex() */
+static unsigned char charmap[256];
+
 static inline bool
 q_isflags(int c, unsigned char flags)
 {
-        return q_isascii(c) && (lexer.charmap[c] & flags) == flags;
+        return (charmap[(unsigned char)c] & flags) == flags;
 }
 
 static inline bool q_isdelim(int c) { return q_isflags(c, QDELIM); }
@@ -42,39 +49,78 @@ static inline bool q_isdelim(int c) { return q_isflags(c, QDELIM); }
 static inline bool q_isident(int c) { return q_isflags(c, QIDENT); }
 /* may be 1st char of identifier */
 static inline bool q_isident1(int c) { return q_isflags(c, QIDENT1); }
+static inline bool q_isspace(int c) { return q_isflags(c, QSPACE); }
+static inline bool q_isdigit(int c) { return q_isflags(c, QDIGIT); }
 
-static int
-lexer_next_line(void)
+/*
+ * Call when stepping over the newline at @pc.  Like the line count
+ * of getline(), a newline at the very end of the file does not start
+ * a new line.
+ */
+static inline void
+lexer_newline(struct lexer_t *lex, const char *pc)
 {
-        int res = getline(&lexer.line, &lexer._slen, lexer.fp);
-        if (res != -1) {
-                lexer.s = lexer.line;
-                lexer.lineno++;
-        } else {
-                lexer.s = NULL;
-        }
-        return res;
+        if (pc[1] != '\0')
+                lex->lineno++;
 }
 
-/* because this is @#$%!-ing tedious to type */
-#define cur_pc lexer.s
+/*
+ * Read all of @fp into lex->text in one go, so the scanners below can
+ * run through the whole file without stopping at every line.
+ *
+ * Return: Number of bytes read
+ */
+static size_t
+lexer_slurp(struct lexer_t *lex, FILE *fp)
+{
+        struct stat st;
+        size_t n, alloc;
+        char *text;
+
+        /*
+         * One more than we expect, so a regular file is read with a
+         * single short fread().
+         */
+        if (fstat(fileno(fp), &st) == 0 && S_ISREG(st.st_mode))
+                alloc = st.st_size + 2;
+        else
+                alloc = 4096;
+
+        text = emalloc(alloc);
+        n = 0;
+        for (;;) {
+                n += fread(&text[n], 1, alloc - n - 1, fp);
+                if (n < alloc - 1)
+                        break;
+                alloc *= 2;
+                text = realloc(text, alloc);
+                if (!text)
+                        fail("realloc failed");
+        }
+        if (ferror(fp))
+                fail("Could not read '%s'", lex->filename);
+
+        text[n] = '\0';
+        lex->text = text;
+        return n;
+}
 
 /* if at '\0' after this, then end of namespace */
 static void
-qslide(void)
+qslide(struct lexer_t *lex)
 {
-        char *s;
-        do {
-                s = lexer.s;
-                while (*s != '\0' && isspace((int)(*s)))
-                        ++s;
-        } while (*s == '\0' && lexer_next_line() != -1);
-        lexer.s = s;
+        char *s = lex->s;
+        while (q_isspace(*s)) {
+                if (*s == '\n')
+                        lexer_newline(lex, s);
+                ++s;
+        }
+        lex->s = s;
 }
 
 /* parse the usual backslash suspects */
 static bool
-bksl_char(char **src, int *c, int q)
+bksl_char(struct lexer_t *lex, char **src, int *c, int q)
 {
         char *p = *src;
         switch (*p) {
@@ -113,10 +159,13 @@ bksl_char(char **src, int *c, int q)
                 break;
         case '\r':
                 *c = 0;
-                if (p[1] == '\n')
+                if (p[1] == '\n') {
+                        lexer_newline(lex, &p[1]);
                         *src += 1;
+                }
                 break;
         case '\n':
+                lexer_newline(lex, p);
                 /*
                  * \<eol> means "string is wrapped for readability
                  * but <eol> not part of this string literal."
@@ -238,21 +287,38 @@ bksl_utf8(char **src, int *c, struct buffer_t *tok)
 
 /* pc points at quote */
 static bool
-qlex_string(void)
+qlex_string(struct lexer_t *lex)
 {
-        struct buffer_t *tok = &lexer.tok;
-        char *pc = lexer.s;
+        struct buffer_t *tok = &lex->tok;
+        char *pc = lex->s;
+        const char *stops;
         int c, q = *pc++;
         if (!isquote(q))
                 return false;
 
-retry:
-        while ((c = *pc++) != q && c != '\0') {
-                if (c == '\\') {
+        /* characters which end a run of plain string-literal chars */
+        stops = q == '"' ? "\"\\\n" : "'\\\n";
+
+        for (;;) {
+                size_t run = strcspn(pc, stops);
+                if (run) {
+                        buffer_nputs(tok, pc, run);
+                        pc += run;
+                }
+
+                c = *pc++;
+                if (c == q)
+                        break;
+                if (c == '\0')
+                        syntax("Unterminated quote");
+                if (c == '\n') {
+                        lexer_newline(lex, pc - 1);
+                } else {
+                        /* backslash */
                         do {
                                 if (bksl_utf8(&pc, &c, tok))
                                         break;
-                                if (bksl_char(&pc, &c, q))
+                                if (bksl_char(lex, &pc, &c, q))
                                         break;
                                 if (bksl_octal(&pc, &c))
                                         break;
@@ -266,20 +332,14 @@ retry:
                 buffer_putc(tok, c);
         }
 
-        if (c == '\0') {
-                if (lexer_next_line() == -1)
-                        syntax("Unterminated quote");
-                goto retry;
-        }
-
-        lexer.s = pc;
+        lex->s = pc;
         return true;
 }
 
 static bool
-qlex_comment(void)
+qlex_comment(struct lexer_t *lex)
 {
-        char *pc = lexer.s;
+        char *pc = lex->s;
         if (*pc == '#')
                 goto oneline;
 
@@ -291,49 +351,52 @@ qlex_comment(void)
 
         if (*pc == '*') {
                 /* block comment */
-                do {
+                ++pc;
+                for (;;) {
+                        pc += strcspn(pc, "*\n");
+                        if (*pc == '\0')
+                                syntax("Unterminated comment");
+                        if (*pc == '\n')
+                                lexer_newline(lex, pc);
+                        else if (pc[1] == '/')
+                                break;
                         ++pc;
-                        if (*pc == '\0') {
-                                if (lexer_next_line() == -1)
-                                        syntax("Unterminated comment");
-                                pc = lexer.s;
-                        }
-                } while (!(pc[0] == '*' && pc[1] == '/'));
-                lexer.s = pc + 2;
+                }
+                lex->s = pc + 2;
                 return true;
         }
         return false;
 
 oneline:
-        /* single-line comment */
-        while (*pc != '\n' && *pc != '\0')
-                ++pc;
-        lexer.s = pc;
+        /* single-line comment, leave the newline for qslide */
+        pc += strcspn(pc, "\n");
+        lex->s = pc;
         return true;
 }
 
 static bool
-qlex_identifier(void)
+qlex_identifier(struct lexer_t *lex)
 {
-        struct buffer_t *tok = &lexer.tok;
-        char *pc = lexer.s;
+        struct buffer_t *tok = &lex->tok;
+        char *pc = lex->s;
         if (!q_isident1(*pc))
                 return false;
         while (q_isident(*pc))
-                buffer_putc(tok, *pc++);
+                pc++;
+        buffer_nputs(tok, lex->s, pc - lex->s);
         if (!q_isdelim(*pc))
                 syntax("invalid chars in identifier or keyword");
-        lexer.s = pc;
+        lex->s = pc;
         return true;
 }
 
 /* parse hex/binary int if '0x' or '0b' */
 static bool
-qlex_int_hdr(void)
+qlex_int_hdr(struct lexer_t *lex)
 {
-        struct buffer_t *tok = &lexer.tok;
+        struct buffer_t *tok = &lex->tok;
         int count = 0;
-        char *pc = lexer.s;
+        char *pc = lex->s;
 
         if (pc[0] != '0')
                 return false;
@@ -374,7 +437,7 @@ qlex_int_hdr(void)
         if (!q_isdelim(*pc))
                 goto e_malformed;
 
-        lexer.s = pc;
+        lex->s = pc;
         return true;
 
 e_toobig:
@@ -385,17 +448,17 @@ e_malformed:
 }
 
 static int
-qlex_number(void)
+qlex_number(struct lexer_t *lex)
 {
         char *pc, *start;
         int ret;
 
-        if (qlex_int_hdr())
+        if (qlex_int_hdr(lex))
                 return 'i';
 
-        pc = start = lexer.s;
+        pc = start = lex->s;
 
-        while (isdigit((int)*pc))
+        while (q_isdigit(*pc))
                 ++pc;
 
         if (pc == start)
@@ -406,7 +469,7 @@ qlex_number(void)
                 ret = 'f';
                 if (*pc == '.')
                         ++pc;
-                while (isdigit(*pc))
+                while (q_isdigit(*pc))
                         ++pc;
                 if (*pc == 'e' || *pc == 'E') {
                         char *e = pc;
@@ -415,7 +478,7 @@ qlex_number(void)
                                 ++e;
                                 ++pc;
                         }
-                        while (isdigit(*pc))
+                        while (q_isdigit(*pc))
                                 ++pc;
                         if (pc == e)
                                 goto malformed;
@@ -426,9 +489,8 @@ qlex_number(void)
         if (!q_isdelim(*pc))
                 goto malformed;
 
-        while (start < pc)
-                buffer_putc(&lexer.tok, *start++);
-        lexer.s = pc;
+        buffer_nputs(&lex->tok, start, pc - start);
+        lex->s = pc;
         return ret;
 
 malformed:
@@ -437,9 +499,9 @@ malformed:
 }
 
 static int
-qlex_delim_helper(int *ret)
+qlex_delim_helper(struct lexer_t *lex, int *ret)
 {
-        char *s = lexer.s;
+        char *s = lex->s;
 
         switch (*s++) {
         case '+':
@@ -604,29 +666,25 @@ qlex_delim_helper(int *ret)
 }
 
 static bool
-qlex_delim(int *ret)
+qlex_delim(struct lexer_t *lex, int *ret)
 {
-        int count = qlex_delim_helper(ret);
+        int count = qlex_delim_helper(lex, ret);
         if (count) {
-                char *s = lexer.s;
-                lexer.s += count;
-                while (s < lexer.s) {
-                        buffer_putc(&lexer.tok, *s);
-                        s++;
-                }
+                buffer_nputs(&lex->tok, lex->s, count);
+                lex->s += count;
                 return true;
         }
         return false;
 }
 
 static int
-qlex_slide(void)
+qlex_slide(struct lexer_t *lex)
 {
         do {
-                qslide();
-                if (*lexer.s == '\0')
+                qslide(lex);
+                if (*lex->s == '\0')
                         return EOF;
-        } while (qlex_comment());
+        } while (qlex_comment(lex));
         return 0;
 }
 
@@ -641,27 +699,27 @@ qlex_slide(void)
  * EOF if end of file
  */
 static int
-tokenize_helper(void)
+tokenize_helper(struct lexer_t *lex)
 {
-        struct buffer_t *tok = &lexer.tok;
+        struct buffer_t *tok = &lex->tok;
         int ret;
 
         buffer_reset(tok);
 
-        if ((ret = qlex_slide()) == EOF)
+        if ((ret = qlex_slide(lex)) == EOF)
                 return ret;
 
-        if (qlex_delim(&ret)) {
+        if (qlex_delim(lex, &ret)) {
                 return ret;
-        } else if (qlex_string()) {
+        } else if (qlex_string(lex)) {
                 do {
-                        ret = qlex_slide();
-                } while (ret != EOF && qlex_string());
+                        ret = qlex_slide(lex);
+                } while (ret != EOF && qlex_string(lex));
                 return 'q';
-        } else if (qlex_identifier()) {
+        } else if (qlex_identifier(lex)) {
                 int k = keyword_seek(tok->s);
                 return k >= 0 ? k : 'u';
-        } else if ((ret = qlex_number()) != 0) {
+        } else if ((ret = qlex_number(lex)) != 0) {
                 return ret;
         }
 
@@ -669,22 +727,35 @@ tokenize_helper(void)
         return 0;
 }
 
+static unsigned int
+lexer_get_location(const char **file_name, void *data)
+{
+        struct lexer_t *lex = data;
+        if (file_name)
+                *file_name = lex->filename;
+        return lex->lineno;
+}
+
 /**
- * tokenize - Get the next token from the current
- *            input file.
+ * tokenize - Get the next token from @lex
+ * @lex: Lexer returned by lex_open() or lex_open_str()
  * @oc: where to store the result
  *
  * Return: Same value as oc->t
  *
- * XXX: not ready for extern linkage yet, need to do the getloc
- * thing from parent (currently prescan), then we'll add this as
- * the function as_lex calls in assembler.c, so we can have
- * interactive mode.
+ * Once EOF has been returned, don't call this again.
  */
 int
-tokenize(struct token_t *oc)
+tokenize(struct lexer_t *lex, struct token_t *oc)
 {
-        int ret = tokenize_helper();
+        int ret;
+
+        bug_on(!lex->text);
+
+        getloc_push(lexer_get_location, lex);
+        ret = tokenize_helper(lex);
+        getloc_pop();
+
         if (ret == EOF) {
                 static const struct token_t eofoc = {
                         .t = EOF,
@@ -695,8 +766,8 @@ tokenize(struct token_t *oc)
                 memcpy(oc, &eofoc, sizeof(*oc));
         } else {
                 oc->t = ret;
-                oc->line = lexer.lineno;
-                oc->s = literal_put(lexer.tok.s);
+                oc->line = lex->lineno;
+                oc->s = literal_put(lex->tok.s);
                 bug_on(oc->s == NULL);
                 if (oc->t == 'f') {
                         double f = strtod(oc->s, NULL);
@@ -711,56 +782,84 @@ tokenize(struct token_t *oc)
         return ret;
 }
 
-static void
-buffer_putcode(struct buffer_t *buf, struct token_t *oc)
+static struct lexer_t *
+lexer_new(const char *filename, int lineno)
 {
-        buffer_putd(buf, oc, sizeof(*oc));
-}
+        struct lexer_t *lex = ecalloc(sizeof(*lex));
 
-static unsigned int
-lexer_get_location(const char **file_name, void *unused)
-{
-        if (file_name)
-                *file_name = lexer.filename;
-        return lexer.lineno;
+        bug_on(!filename);
+        buffer_init(&lex->tok);
+        lex->filename = literal_put(filename);
+        lex->lineno = lineno;
+        return lex;
 }
 
-/*
- * XXX REVISIT: cf. assembler.c, ``as_lex'' and ``as_unlex''.  Instead of
- * prescanning the whole file, this could be done a token at a time.  It
- * saves some steps and makes it easier to transition the project into a
- * VM that can run in interactive mode.
+/**
+ * lex_open - Start tokenizing a file
+ * @fp:         Handle to the open file.  It is read all at once, so the
+ *              caller may close it as soon as this returns.
+ * @filename:   Name of the file, for error reporting
+ *
+ * Tokens are then read one at a time with tokenize().
+ *
+ * Return: New lexer, to be freed with lex_close(), or NULL if the file
+ * is empty.
  */
-struct token_t *
-prescan(FILE *fp, const char *filename)
+struct lexer_t *
+lex_open(FILE *fp, const char *filename)
 {
-        struct token_t oc;
-        int t;
-        struct buffer_t pgm;
+        struct lexer_t *lex = lexer_new(filename, 1);
 
-        bug_on(!filename);
-        lexer.filename = literal_put(filename);
-        lexer.fp = fp;
-        lexer.lineno = 0;
-        if (lexer_next_line() == -1) {
-                pgm.s = NULL;
-                goto done;
+        if (lexer_slurp(lex, fp) == 0) {
+                lex_close(lex);
+                return NULL;
         }
+        lex->s = lex->text;
+        return lex;
+}
 
-        getloc_push(lexer_get_location, NULL);
+/**
+ * lex_open_str - Like lex_open(), but tokenize a string instead of a
+ *                file
+ * @text:       Nulchar-terminated text to tokenize.  The lexer takes
+ *              ownership of this; it will be freed by lex_close().
+ * @filename:   Name of the file @text came from, for error reporting
+ * @lineno:     Line number in @filename where @text starts
+ *
+ * Return: New lexer, to be freed with lex_close()
+ */
+struct lexer_t *
+lex_open_str(char *text, const char *filename, int lineno)
+{
+        struct lexer_t *lex = lexer_new(filename, lineno);
 
-        buffer_init(&pgm);
-        do {
-                t = tokenize(&oc);
-                /* yes, also stuff the EOF version */
-                buffer_putcode(&pgm, &oc);
-        } while (t != EOF);
+        lex->text = text;
+        lex->s = text;
+        return lex;
+}
 
-        getloc_pop();
+/**
+ * lex_pos - Get the lexer's position in its input text
+ *
+ * Return: Pointer to the character just after the last token read by
+ * tokenize().  This is only valid until lex_close().
+ */
+const char *
+lex_pos(struct lexer_t *lex)
+{
+        return lex->s;
+}
 
-done:
-        lexer.fp = 0;
-        return (struct token_t *)pgm.s;
+/**
+ * lex_close - Free a lexer returned by lex_open() or lex_open_str()
+ */
+void
+lex_close(struct lexer_t *lex)
+{
+        if (lex->text)
+                free(lex->text);
+        buffer_free(&lex->tok);
+        free(lex);
 }
 
 void
@@ -772,34 +871,33 @@ moduleinit_lex(void)
          */
         static const char *const DELIMS = "+-<>=&|.!;,/*%^()[]{}:~ \t\n";
         static const char *const DELIMDBL = "+-<>=&|";
+        static const char *const SPACES = " \t\n\v\f\r";
         const char *s;
         int i;
 
-        buffer_init(&lexer.tok);
-
-        lexer.line = NULL;
-        lexer._slen = 0;
-        lexer.s = NULL;
-
-        /* Set up lexer.charmap */
+        /* Set up charmap */
         /* delimiter */
         for (s = DELIMS; *s != '\0'; s++)
-                lexer.charmap[(int)*s] |= QDELIM;
+                charmap[(int)*s] |= QDELIM;
         /* double-delimeters */
         for (s = DELIMDBL; *s != '\0'; s++)
-                lexer.charmap[(int)*s] |= QDDELIM;
+                charmap[(int)*s] |= QDDELIM;
 
         /* special case */
-        lexer.charmap[(int)'`'] |= (QDELIM | QDDELIM);
-        lexer.charmap[0] |= QDELIM;
+        charmap[(int)'`'] |= (QDELIM | QDDELIM);
+        charmap[0] |= QDELIM;
+
+        /* whitespace */
+        for (s = SPACES; *s != '\0'; s++)
+                charmap[(int)*s] |= QSPACE;
 
         /* permitted identifier chars */
-        for (i = 'a'; i < 'z'; i++)
-                lexer.charmap[i] |= QIDENT | QIDENT1;
-        for (i = 'A'; i < 'Z'; i++)
-                lexer.charmap[i] |= QIDENT | QIDENT1;
-        for (i = '0'; i < '9'; i++)
-                lexer.charmap[i] |= QIDENT;
-        lexer.charmap['_'] |= QIDENT | QIDENT1;
+        for (i = 'a'; i <= 'z'; i++)
+                charmap[i] |= QIDENT | QIDENT1;
+        for (i = 'A'; i <= 'Z'; i++)
+                charmap[i] |= QIDENT | QIDENT1;
+        for (i = '0'; i <= '9'; i++)
+                charmap[i] |= QIDENT | QDIGIT;
+        charmap['_'] |= QIDENT | QIDENT1;
 }
 
@@ -7,10 +7,12 @@
  *                      returns the pointer stored in the hash table.
  * literal(s)           gets the stored copy of @s, or NULL if it isn't
  *                      found.
+ * literal_put_ref(s)   like literal_put(), but for a string made at
+ *                      run time, see below.
  *
  * This serves a few purposes:
  * 1. A script is likely going to repeat a lot of tokens (such as
- *    identifiers or literal expressions).  At prescan time, we save
+ *    identifiers or literal expressions).  At tokenize time, we save
  *    all of these tokens, but we don't want to fill up memory with
  *    duplicates.  So instead of calling strdup for every such token,
  *    we let literal_put() wrap that call, preventing the buildup of
@@ -26,8 +28,18 @@
  *    in persistent memory but they don't get duplicated and zombified
  *    all over the place.
  *
+ * The exception is names made up while the script runs, like the key
+ * in a dictionary's .setattr(key, value).  A script that does that
+ * with keys it reads from input would fill up memory with them.  So
+ * literal_put_ref() returns the copy with a reference held by the
+ * caller, which it must drop with literal_decr_ref().  Each dictionary
+ * entry holds a reference to its name, see object_add_child(), and the
+ * copy is freed along with the last one.  A string that's also been
+ * given to literal_put() stays forever, and the reference calls do
+ * nothing to it.
+ *
  * Notes:
- * 1. When parsing prescanned byte code, do not call literal() for
+ * 1. When parsing tokens, do not call literal() for
  *    "cur_oc->s".  That is already a return value of literal(), so calling
  *    it again will be a redundant waste of compute cycles; you already got
  *    your answer.
@@ -37,8 +49,9 @@
  *
  * 3. When building built-in attachments to the global object at init
  *    time, use literal_put() when setting variable names.  This should
- *    be the only time besides prescan() time when literal_put() is used
- *    instead of just literal().
+ *    be the only time besides tokenize() time when literal_put() is used
+ *    instead of just literal().  A name that comes from the user at run
+ *    time gets literal_put_ref() instead.
  *
  * 4. Corrollary to note 1:
  *    Don't call literal() when searching for the 'that' of
@@ -61,33 +74,93 @@
  *    not even allow such a thing, but I do.)
  */
 #include <evilcandy.h>
+#include <pthread.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 
-/* For literal(), key is its own value */
+/* @nref for a literal_put() string, which is never freed */
+#define LITERAL_IMMORTAL (-1)
+
+/* entry removed by literal_decr_ref(), keep probing past it */
+#define LBUCKET_DEAD ((struct lbucket_t *)-1)
+
+/*
+ * For literal(), key is its own value.  @nref is the number of
+ * literal_put_ref() references, or LITERAL_IMMORTAL.
+ */
 struct lbucket_t {
-        char *key;
         unsigned long hash;
+        int nref;
+        char key[];
 };
 
 /**
  * struct oai_hashtable_t -     "oai" stands for "open addressing,
- *                              insertion-only"
+ *                              insertion-only"--mostly.  Only
+ *                              literal_decr_ref() removes anything.
  * @size:       Array length of @bucket.  Always a power of 2
- * @count:      Current number of entries in the table
+ * @count:      Current number of entries in the table, including
+ *              removed ones still taking up a slot
+ * @used:       Number of entries not removed
  * @bucket:     Array of entries
  * @grow_size:  Value of @count at which the table should grow
  */
 struct oai_hashtable_t {
         size_t size;
         size_t count;
+        size_t used;
         struct lbucket_t **bucket;
         size_t grow_size;
 };
 
 static struct  oai_hashtable_t *htab;
 
+/*
+ * The one table is shared by every thread, since its whole point is
+ * that equal strings have equal pointers.  Threads only exist while
+ * precompile.c's workers are running, so the lock is only taken
+ * between literal_set_threaded(true) and literal_set_threaded(false).
+ * The rest of the time, lookups on the run-time path don't pay for
+ * it.
+ */
+static pthread_mutex_t htab_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool htab_threaded;
+
+static inline void
+htab_lock_(void)
+{
+        if (htab_threaded)
+                pthread_mutex_lock(&htab_lock);
+}
+
+static inline void
+htab_unlock_(void)
+{
+        if (htab_threaded)
+                pthread_mutex_unlock(&htab_lock);
+}
+
+/**
+ * literal_set_threaded - Say whether other threads may use the table
+ * @threaded:   true before starting threads that use it, false after
+ *              they've all been joined
+ *
+ * pthread_create() and pthread_join() make the change visible to the
+ * other threads, so the flag itself needs no lock.
+ */
+void
+literal_set_threaded(bool threaded)
+{
+        htab_threaded = threaded;
+}
+
+/*
+ * Not in memstats[], since an entry made by one thread can be freed
+ * by another.  Protected by htab_lock, see literal_stats().
+ */
+static struct memstat_t lit_stats;
+
 static inline unsigned int
 bucketi(unsigned long hash)
 {
@@ -102,7 +175,16 @@ oai_grow(void)
         int i, j;
 
         htab->count++;
-        while (htab->count > htab->grow_size) {
+        htab->used++;
+        if (htab->count <= htab->grow_size)
+                return;
+
+        /*
+         * Removed entries don't get copied, so if enough of them are
+         * taking up slots, rebuilding the table at the same size is
+         * enough.
+         */
+        while (htab->used * 2 > htab->grow_size) {
                 /*
                  * XXX REVISIT: Arbitrary division done here.
                  * (x*3)>>2 is quicker, but alpha=75% is getting close
@@ -117,16 +199,14 @@ oai_grow(void)
                 htab->grow_size = (htab->size << 1) / 3;
         }
 
-        if (htab->size == old_size)
-                return;
-
-        /* resized, need new bucket array */
+        /* need new bucket array */
         b_old = htab->bucket;
         htab->bucket = b_new = ecalloc(sizeof(void *) * htab->size);
+        htab->count = htab->used;
         for (i = 0; i < old_size; i++) {
                 unsigned long perturb;
                 struct lbucket_t *b = b_old[i];
-                if (!b)
+                if (!b || b == LBUCKET_DEAD)
                         continue;
                 perturb = b->hash;
                 j = bucketi(b->hash);
@@ -149,8 +229,12 @@ seek_helper(const char *key, unsigned long hash, unsigned int *idx)
         unsigned int i = bucketi(hash);
         struct lbucket_t *b;
         unsigned long perturb = hash;
+        int dead = -1;
         while ((b = htab->bucket[i]) != NULL) {
-                if (b->hash == hash && !strcmp(b->key, key)) {
+                if (b == LBUCKET_DEAD) {
+                        if (dead < 0)
+                                dead = i;
+                } else if (b->hash == hash && !strcmp(b->key, key)) {
                         *idx = i;
                         return b;
                 }
@@ -182,50 +266,177 @@ seek_helper(const char *key, unsigned long hash, unsigned int *idx)
                 perturb >>= 5;
                 i = bucketi(i * 5 + perturb + 1);
         }
-        *idx = i;
+        /* not found, a new entry may as well reuse a dead slot */
+        *idx = dead >= 0 ? dead : i;
         return NULL;
 }
 
+static inline struct lbucket_t *
+key2bucket(const char *key)
+{
+        return container_of(key, struct lbucket_t, key);
+}
+
+/* seek @key, or add it with @nref if it isn't there.  Call locked. */
+static struct lbucket_t *
+seek_or_insert(const char *key, int nref)
+{
+        unsigned int i;
+        unsigned long hash = fnv_hash(key);
+        size_t len;
+        struct lbucket_t *b;
+
+        b = seek_helper(key, hash, &i);
+        /* if match, don't insert, return that */
+        if (!b) {
+                /* no match, insert */
+                len = strlen(key) + 1;
+                b = emalloc(sizeof(*b) + len);
+                lit_stats.n_alloc++;
+                memstat_add_bytes(&lit_stats, sizeof(*b) + len);
+                if (lit_stats.n_alloc - lit_stats.n_free > lit_stats.peak)
+                        lit_stats.peak = lit_stats.n_alloc - lit_stats.n_free;
+                b->hash = hash;
+                b->nref = nref;
+                memcpy(b->key, key, len);
+                if (htab->bucket[i] == LBUCKET_DEAD) {
+                        htab->bucket[i] = b;
+                        htab->used++;
+                } else {
+                        htab->bucket[i] = b;
+                        oai_grow();
+                }
+        }
+        return b;
+}
+
 /**
  * literal_put - Store key if it isn't stored already
  * @key: Text to store
  *
+ * The copy is never freed, even if it was first stored by
+ * literal_put_ref().
+ *
  * Return: copied version of key
  */
 char *
 literal_put(const char *key)
 {
-        unsigned int i;
-        unsigned long hash = fnv_hash(key);
-        struct lbucket_t *b = seek_helper(key, hash, &i);
-        /* if match, don't insert, return that */
-        if (!b) {
-                /* no match, insert */
-                b = emalloc(sizeof(*b));
-                b->hash = hash;
-                b->key = strdup(key);
-                htab->bucket[i] = b;
-                oai_grow();
-        }
+        struct lbucket_t *b;
+
+        htab_lock_();
+        b = seek_or_insert(key, LITERAL_IMMORTAL);
+        b->nref = LITERAL_IMMORTAL;
+        htab_unlock_();
+
+        return b->key;
+}
+
+/**
+ * literal_put_ref - Store key if it isn't stored already, and hold
+ *                   a reference to it
+ * @key: Text to store
+ *
+ * Return: copied version of key.  The caller must literal_decr_ref()
+ * it when it's done.
+ */
+char *
+literal_put_ref(const char *key)
+{
+        struct lbucket_t *b;
+
+        htab_lock_();
+        b = seek_or_insert(key, 0);
+        if (b->nref != LITERAL_IMMORTAL)
+                b->nref++;
+        htab_unlock_();
 
         return b->key;
 }
 
+/*
+ * These are called for every dictionary entry, and nearly every key
+ * is a token from a script, so check for that before locking.  It's
+ * safe because a string never stops being immortal once it is.
+ */
+
+/**
+ * literal_incr_ref - Hold another reference to @key
+ * @key: Return value of literal(), literal_put(), or literal_put_ref()
+ */
+void
+literal_incr_ref(const char *key)
+{
+        struct lbucket_t *b = key2bucket(key);
+
+        if (b->nref == LITERAL_IMMORTAL)
+                return;
+        htab_lock_();
+        if (b->nref != LITERAL_IMMORTAL)
+                b->nref++;
+        htab_unlock_();
+}
+
+/**
+ * literal_decr_ref - Drop a reference to @key, and free it if it was
+ *                    the last one
+ * @key: Return value of literal_put_ref(), or anything passed to
+ *       literal_incr_ref()
+ */
+void
+literal_decr_ref(const char *key)
+{
+        struct lbucket_t *b = key2bucket(key);
+        unsigned int i;
+
+        if (b->nref == LITERAL_IMMORTAL)
+                return;
+        htab_lock_();
+        if (b->nref != LITERAL_IMMORTAL && --b->nref <= 0) {
+                seek_helper(key, b->hash, &i);
+                bug_on(htab->bucket[i] != b);
+                htab->bucket[i] = LBUCKET_DEAD;
+                htab->used--;
+                lit_stats.n_free++;
+                lit_stats.bytes -= sizeof(*b) + strlen(b->key) + 1;
+                free(b);
+        }
+        htab_unlock_();
+}
+
 char *
 literal(const char *key)
 {
         unsigned int dummy;
         unsigned long hash = fnv_hash(key);
-        struct lbucket_t *b = seek_helper(key, hash, &dummy);
+        struct lbucket_t *b;
+
+        htab_lock_();
+        b = seek_helper(key, hash, &dummy);
+        htab_unlock_();
         return b ? b->key : NULL;
 }
 
+/**
+ * literal_stats - Get the counters for the literal table
+ *
+ * This doesn't take the lock, so it's safe from a signal handler,
+ * see memstat.c.  The worst that can happen is counters that are a
+ * moment out of date.
+ */
+void
+literal_stats(struct memstat_t *stats)
+{
+        *stats = lit_stats;
+}
+
 void
 moduleinit_literal(void)
 {
         htab = emalloc(sizeof(*htab));
         htab->grow_size = 0;
         htab->count = 0;
+        htab->used = 0;
         htab->size = 2;
         htab->bucket = ecalloc(sizeof(void *) * htab->size);
 }
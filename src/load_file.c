@@ -1,18 +1,55 @@
 /*
- * FIXME: The path resolution in this file is naive.  We need need some
- * way to know that we aren't cyclically loading the same files back and
- * forth.
+ * load_file.c - Code that loads a script, either the one from the
+ *               command line or one named by a ``load'' statement.
+ *
+ * Every file is loaded at most once.  The same file can be named by a
+ * lot of different paths, so the registry of loaded files is keyed by
+ * device and inode number, not by name.
  */
 #include <evilcandy.h>
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include <sys/stat.h>
 
 #define MAX_LOADS RECURSION_MAX
 
+/**
+ * struct module_t - Registry entry for a file that has been loaded
+ * @dev:        Device of the file
+ * @ino:        Inode of the file
+ * @loading:    True while the file's top-level code is still running.
+ *              A load of the file during this time means a cycle.
+ * @loaded:     True once the file is done loading
+ */
+struct module_t {
+        dev_t dev;
+        ino_t ino;
+        bool loading;
+        bool loaded;
+};
+
 static const char *paths[MAX_LOADS];
 static int path_sp = 0;
 
+/* struct module_t's, keyed by themselves */
+static struct hashtable_t modules;
+static bool modules_init = false;
+
+static hash_t
+module_hash(const void *key)
+{
+        const struct module_t *m = key;
+        return ((hash_t)m->dev << 32) ^ (hash_t)m->ino;
+}
+
+static bool
+module_match(const void *k1, const void *k2)
+{
+        const struct module_t *m1 = k1, *m2 = k2;
+        return m1->dev == m2->dev && m1->ino == m2->ino;
+}
+
 static const char *
 current_path(void)
 {
@@ -51,31 +88,120 @@ push_path(const char *filename)
         return fp;
 }
 
+/*
+ * Helper to load_file, get the executable for the script in @fp,
+ * either from the byte-code cache or by lexing and assembling it.
+ * The cache is checked first, so that a hit never reads the source.
+ * Return: the executable, or NULL if the file is empty.
+ */
+static struct executable_t *
+load_executable(FILE *fp, const char *filename)
+{
+        char path[PATH_MAX];
+        char full[PATH_MAX];
+        struct executable_t *ex = NULL;
+        struct lexer_t *lex;
+        struct stat st;
+        bool cache = false;
+
+        if (q_.opt.cache && fstat(fileno(fp), &st) == 0
+            && S_ISREG(st.st_mode)) {
+                int n = snprintf(path, sizeof(path), "%s/%s",
+                                 current_path(), notdir(filename));
+                cache = n > 0 && n < sizeof(path) && realpath(path, full);
+        }
+
+        if (cache && (ex = evcc_load(full, filename, &st)) != NULL) {
+                fclose(fp);
+                return ex;
+        }
+
+        lex = lex_open(fp, notdir(filename));
+        fclose(fp);
+        if (!lex)
+                return NULL;
+        ex = assemble(lex, filename, q_.opt.lazy);
+        lex_close(lex);
+
+        if (q_.opt.disassemble
+            && disassemble_script(q_.opt.disassemble_outfile,
+                                  filename, ex) < 0) {
+                warning("Could not disassemble %s", filename);
+        }
+
+        if (cache)
+                evcc_save(full, &st, ex);
+        return ex;
+}
+
+/*
+ * Helper to load_file, look up the file @fp in the module registry,
+ * adding it if it isn't there yet.
+ * Return: The registry entry, or NULL if @fp can't be identified
+ */
+static struct module_t *
+module_get(FILE *fp, const char *filename)
+{
+        struct module_t key, *mod;
+        struct stat st;
+
+        if (fstat(fileno(fp), &st) < 0)
+                return NULL;
+
+        if (!modules_init) {
+                hashtable_init(&modules, module_hash, module_match, free);
+                modules_init = true;
+        }
+
+        key.dev = st.st_dev;
+        key.ino = st.st_ino;
+        mod = hashtable_get(&modules, &key);
+        if (mod)
+                return mod;
+
+        mod = emalloc(sizeof(*mod));
+        *mod = key;
+        mod->loading = false;
+        mod->loaded = false;
+        if (hashtable_put(&modules, mod, mod) < 0)
+                fail("Could not register '%s'", filename);
+        return mod;
+}
+
 /**
  * load_file - Read in a file, tokenize it, assemble it, execute it.
  * @filename:   Path to file as written after the "load" keyword or on
  *              the command line.
+ *
+ * If the file was already loaded, however it was named, this does
+ * nothing.  If it's still being loaded, ie. it loaded a file that
+ * loaded it back, that's an error.
  */
 void
 load_file(const char *filename)
 {
         FILE *fp = push_path(filename);
-        do {
-                struct token_t *oc;
-                struct executable_t *ex;
-                oc = prescan(fp, notdir(filename));
-                fclose(fp);
-                if (!oc)
-                        break;
+        struct module_t *mod = module_get(fp, filename);
+        struct executable_t *ex;
 
-                if ((ex = assemble(filename, oc)) == NULL)
-                        syntax("Failed to assemble");
-
-                if (q_.opt.disassemble_only)
-                        break;
+        if (mod && mod->loading)
+                syntax("Cyclic load of '%s'", filename);
+        if (mod && mod->loaded) {
+                fclose(fp);
+                pop_path();
+                return;
+        }
 
-                if (ex)
-                        vm_execute(ex);
-        } while (0);
+        if (mod)
+                mod->loading = true;
+        ex = load_executable(fp, filename);
+        if (ex && !q_.opt.disassemble_only)
+                vm_execute(ex);
+        else if (ex)
+                EXECUTABLE_RELEASE(ex);
+        if (mod) {
+                mod->loading = false;
+                mod->loaded = true;
+        }
         pop_path();
 }
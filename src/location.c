@@ -34,14 +34,15 @@
 
 typedef unsigned int (*getloc_t)(const char **, void *);
 
-static struct getloc_t {
+/* per thread, since different threads could be assembling at once */
+static __thread struct getloc_t {
         getloc_t getloc;
         void *data;
 } getloc_stack[GETLOC_STACK_DEPTH];
-static unsigned int getloc_stackptr = 0;
+static __thread unsigned int getloc_stackptr = 0;
 
-static getloc_t cur_getloc = NULL;
-static void *cur_locdata = NULL;
+static __thread getloc_t cur_getloc = NULL;
+static __thread void *cur_locdata = NULL;
 
 /**
  * getloc_push - Push handle to get location
@@ -74,6 +75,33 @@ getloc_pop(void)
 {
         bug_on(getloc_stackptr <= 0);
         getloc_stackptr--;
+
+        cur_getloc = getloc_stack[getloc_stackptr].getloc;
+        cur_locdata = getloc_stack[getloc_stackptr].data;
+}
+
+/**
+ * getloc_depth - Get the current depth of the stack, to pass to
+ *                getloc_unwind() later
+ */
+unsigned int
+getloc_depth(void)
+{
+        return getloc_stackptr;
+}
+
+/**
+ * getloc_unwind - Pop back down to a depth returned by getloc_depth()
+ *
+ * This is for cleaning up after a longjmp() from an error, which
+ * skips the getloc_pop() calls of everything it jumped out of.
+ */
+void
+getloc_unwind(unsigned int depth)
+{
+        bug_on(depth > getloc_stackptr);
+        while (getloc_stackptr > depth)
+                getloc_pop();
 }
 
 /**
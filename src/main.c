@@ -3,29 +3,7 @@
 #include <ctype.h>
 #include <stdio.h>
 #include <getopt.h>
-
-struct global_t q_;
-
-static void
-init_lib(void)
-{
-        static const struct initfn_tbl_t {
-                void (*initfn)(void);
-        } INITFNS[] = {
-                /* Note: the order of this table matters */
-                { .initfn = moduleinit_keyword },
-                { .initfn = moduleinit_literal },
-                { .initfn = moduleinit_var },
-                { .initfn = moduleinit_builtin },
-                { .initfn = moduleinit_lex },
-                { .initfn = moduleinit_vm },
-                { .initfn = NULL },
-        };
-        const struct initfn_tbl_t *t;
-
-        for (t = INITFNS; t->initfn != NULL; t++)
-                t->initfn();
-}
+#include <stdlib.h>
 
 static int
 parse_args(int argc, char **argv)
@@ -51,6 +29,55 @@ parse_args(int argc, char **argv)
                                 if (*s != '\0')
                                         goto er;
                                 continue;
+                        case 'c':
+                                /* use the byte-code cache */
+                                q_.opt.cache = true;
+                                if (*s != '\0')
+                                        goto er;
+                                continue;
+                        case 'j':
+                                /* translate hot code to machine code */
+                                q_.opt.jit = true;
+                                if (*s != '\0')
+                                        goto er;
+                                continue;
+                        case 't':
+                                /* run hot loops from recorded traces */
+                                q_.opt.trace = true;
+                                if (*s != '\0')
+                                        goto er;
+                                continue;
+                        case 'm':
+                                /* print memory statistics at exit */
+                                q_.opt.memstats = true;
+                                if (*s != '\0')
+                                        goto er;
+                                continue;
+                        case 'P':
+                                /* -P alloc: see allocprof.c */
+                                if (*s != '\0' || ++argi >= argc
+                                    || strcmp(argv[argi], "alloc") != 0) {
+                                        goto er;
+                                }
+                                q_.opt.prof_alloc = true;
+                                continue;
+                        case 'L':
+                                /* compile function bodies on first call */
+                                q_.opt.lazy = true;
+                                if (*s != '\0')
+                                        goto er;
+                                continue;
+                        case '-':
+                                /* --emit-c: translate INFILE to C, see emit_c.c */
+                                if (!strcmp(s, "emit-c")) {
+                                        q_.opt.emit_c = true;
+                                        continue;
+                                }
+                                /* --compile DIR: fill the cache, see precompile.c */
+                                if (strcmp(s, "compile") != 0 || ++argi >= argc)
+                                        goto er;
+                                q_.opt.compile_dir = argv[argi];
+                                continue;
                         default:
                                 goto er;
                         }
@@ -69,14 +96,38 @@ parse_args(int argc, char **argv)
                         q_.opt.infile = s;
                 }
         }
+        if (q_.opt.compile_dir) {
+                if (q_.opt.infile || q_.opt.disassemble
+                    || q_.opt.prof_alloc) {
+                        fprintf(stderr, "--compile takes no other options\n");
+                        goto er;
+                }
+                return 0;
+        }
         if (!q_.opt.infile) {
                 fprintf(stderr, "Input file not specified");
                 goto er;
         }
+        if (q_.opt.emit_c && q_.opt.disassemble) {
+                fprintf(stderr, "--emit-c and -d/-D options must be exclusive\n");
+                goto er;
+        }
+        /* disassembly and --emit-c want to see all of the code */
+        if (q_.opt.disassemble || q_.opt.emit_c) {
+                q_.opt.lazy = false;
+                q_.opt.cache = false;
+        }
+        /* -P alloc needs every frame's location kept up to date */
+        if (q_.opt.prof_alloc) {
+                q_.opt.jit = false;
+                q_.opt.trace = false;
+        }
         return 0;
 
 er:
         fprintf(stderr, "Expected: '%s [OPTIONS] INFILE'\n", argv[0]);
+        fprintf(stderr, "      or: '%s --compile DIR'\n", argv[0]);
+        fprintf(stderr, "      or: '%s --emit-c INFILE > OUTFILE.c'\n", argv[0]);
         return -1;
 }
 
@@ -91,6 +142,16 @@ main(int argc, char **argv)
         if (parse_args(argc, argv) < 0)
                 return -1;
 
+        if (q_.opt.memstats)
+                atexit(memstat_report_at_exit);
+        if (q_.opt.prof_alloc)
+                allocprof_init();
+
+        if (q_.opt.compile_dir)
+                return precompile_dir(q_.opt.compile_dir);
+        if (q_.opt.emit_c)
+                return emit_c(q_.opt.infile);
+
         load_file(q_.opt.infile);
 
         return 0;
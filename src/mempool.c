@@ -7,136 +7,504 @@
  * 3. You'll be constantly allocating and freeing during the runtime
  *
  * See stack.c and buffer.c for allocating in different scenarios
+ *
+ * Chunks are carved out of slabs of MEMPOOL_SLAB_SIZE bytes, each
+ * aligned to its own size, with a struct mempool_slab_t at the start.
+ * So mempool_free() finds a chunk's slab by masking off the low bits
+ * of its address, and both alloc and free take the same time no matter
+ * how many chunks are in use.
+ *
+ * Each slab keeps its own list of freed chunks.  Chunks which have
+ * never been handed out aren't on that list; they're taken in order
+ * from @bump, so a new slab doesn't need to be threaded up front.
+ * Slabs with at least one free chunk are on their pool's @partial
+ * list, and full slabs are on no list at all until something in them
+ * is freed.
+ *
+ * On top of that, mem_alloc() and mem_free() keep one pool per size
+ * class, so variables, type handles, hash table buckets, and buffer
+ * data all come from the same place, and anything up to MEM_MAX_CLASS
+ * bytes is allocated and freed in constant time.  Anything bigger goes
+ * to malloc().  Each size class also keeps a short list of its most
+ * recently freed chunks, which is the first place mem_alloc() looks.
+ * Variables are allocated and freed so often that going to the slab
+ * header every time--a different cache line from the chunk, and
+ * usually a different slab than last time--would cost more than the
+ * rest of the allocator put together.  That's also why that part of
+ * mem_alloc() and mem_free() is inline, in evilcandy.h.
+ *
+ * Slabs come straight from mmap(), so a slab with nothing in it can be
+ * given back to the OS with munmap() instead of sitting in malloc()'s
+ * free lists.  When that happens depends on the trim policy, see
+ * mem_set_trim(): a pool may keep a few empty slabs around, since
+ * handing one back and mapping it again right away is slower than
+ * just keeping it.
+ *
+ * The size classes are per thread, like everything else in here, so
+ * there are no locks.  A chunk freed by a different thread than the
+ * one that allocated it goes in the freeing thread's recent list, but
+ * if that's full it goes back to the slab it came from, so the usual
+ * rule still applies: don't free in one thread what's still being
+ * allocated from in another.
  */
 #include <evilcandy.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-
-#define NDATA_PER_BLK  64
-
-#if 0
-#define mempool_ctz(v) \
-        (sizeof(v) == 4 \
-         ? ctz32(v) \
-         : (sizeof(v) == 8 \
-            ? ctz64(v) : ({ bug(); 0; })))
-#else
-# define mempool_ctz(v) __builtin_ctz(v)
+#include <sys/mman.h>
+#ifdef __GLIBC__
+# include <malloc.h>
 #endif
 
-struct mempool_blk_t {
-        uint64_t used;
-        void *data;
+/* a few pages, and a power of two */
+#define MEMPOOL_SLAB_SIZE       (16 * 1024)
+/* alignment of each chunk, enough for any of our structs */
+#define MEMPOOL_ALIGN           (sizeof(void *) * 2)
+/**
+ * struct mempool_slab_t - Header at the start of each slab
+ * @list:       Link in the pool's @partial list, if not full
+ * @pool:       Pool this slab belongs to
+ * @free:       Freed chunks, each of which holds a pointer to the next
+ * @bump:       First chunk which has never been handed out
+ * @n_used:     Number of chunks allocated
+ */
+struct mempool_slab_t {
+        struct list_t list;
+        struct mempool_t *pool;
+        void *free;
+        char *bump;
+        int n_used;
 };
 
+/**
+ * struct mempool_t - A pool of same-sized chunks
+ * @datalen:    Size of each chunk, rounded up to MEMPOOL_ALIGN
+ * @per_slab:   Number of chunks that fit in a slab
+ * @partial:    Slabs which have free chunks
+ * @n_empty:    Number of slabs in @partial with no chunks in use
+ * @stats:      Counters for mempool_stats()
+ */
 struct mempool_t {
-        size_t datalen; /* size of each data chunk */
-        size_t size;    /* number of @blks */
-        struct mempool_blk_t *blks;
+        size_t datalen;
+        int per_slab;
+        struct list_t partial;
+        int n_empty;
+        struct mem_stats_t stats;
 };
 
-static void
-mempool_more(struct mempool_t *pool)
+/* see mem_set_trim() */
+static struct {
+        int policy;
+        size_t threshold;
+} mem_trim_cfg = {
+        .policy = MEM_TRIM_THRESHOLD,
+        .threshold = MEM_TRIM_DEFAULT,
+};
+
+/* offset of the first chunk from the start of its slab */
+static inline size_t
+slab_hdr_size(void)
 {
-        enum { NBLKS = 16 };
+        return (sizeof(struct mempool_slab_t) + MEMPOOL_ALIGN - 1)
+               & ~(MEMPOOL_ALIGN - 1);
+}
 
-        struct mempool_blk_t *new_blks;
-        void *new_data;
-        size_t newsize;
-        size_t per_blk_datalen = pool->datalen * NDATA_PER_BLK;
-        void *p;
-        int i;
+static inline struct mempool_slab_t *
+chunk2slab(void *data)
+{
+        return (struct mempool_slab_t *)
+                ((uintptr_t)data & ~(uintptr_t)(MEMPOOL_SLAB_SIZE - 1));
+}
 
-        newsize = pool->size + NBLKS;
-        new_blks = realloc(pool->blks, sizeof(*new_blks) * newsize);
-        if (!new_blks)
-                fail("realloc failed");
-
-        /*
-         * I'm assuming I won't need a "mempool_less"
-         * routine, since checking the malloc borders
-         * of which pool->blks should be freed.
-         */
-        new_data = emalloc(per_blk_datalen * NBLKS);
-
-        pool->blks = new_blks;
-        p = new_data;
-        for (i = pool->size; i < newsize; i++) {
-                pool->blks[i].used = 0;
-                pool->blks[i].data = p;
-                p += per_blk_datalen;
+/*
+ * Slabs are mapped MEMPOOL_SLAB_BATCH at a time, since a system call
+ * per slab is noticeable when a script builds something big.  Each
+ * slab can still be unmapped on its own, and pages of the batch that
+ * haven't been touched yet don't take up any memory.
+ */
+#define MEMPOOL_SLAB_BATCH      16
+static __thread char *slab_next;
+static __thread int slab_left;
+
+/*
+ * mmap() only promises page alignment, so map an extra slab's worth
+ * and unmap whatever's on either side of the aligned batch.
+ */
+static char *
+slab_map(void)
+{
+        enum { BATCH = MEMPOOL_SLAB_BATCH * MEMPOOL_SLAB_SIZE };
+        char *p, *batch;
+        size_t head;
+
+        if (!slab_left) {
+                p = mmap(NULL, BATCH + MEMPOOL_SLAB_SIZE,
+                         PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (p == MAP_FAILED)
+                        fail("mmap failed");
+
+                batch = (char *)(((uintptr_t)p + MEMPOOL_SLAB_SIZE - 1)
+                                 & ~(uintptr_t)(MEMPOOL_SLAB_SIZE - 1));
+                head = batch - p;
+                if (head)
+                        munmap(p, head);
+                munmap(batch + BATCH, MEMPOOL_SLAB_SIZE - head);
+                slab_next = batch;
+                slab_left = MEMPOOL_SLAB_BATCH;
         }
-        pool->size = newsize;
+        p = slab_next;
+        slab_next += MEMPOOL_SLAB_SIZE;
+        slab_left--;
+        return p;
 }
 
-static inline bool
-pool_blk_full(struct mempool_blk_t *blk)
+/* give an empty slab back to the OS */
+static void
+slab_release(struct mempool_t *pool, struct mempool_slab_t *slab)
 {
-        return blk->used == (unsigned int)(~0u);
+        bug_on(slab->n_used != 0);
+        list_remove(&slab->list);
+        munmap(slab, MEMPOOL_SLAB_SIZE);
+        pool->n_empty--;
+        pool->stats.n_slabs--;
 }
 
-static struct mempool_blk_t *
-avail_blk(struct mempool_t *pool)
+static void
+mempool_more(struct mempool_t *pool)
 {
-        enum { BLK_SANITY = 1u << 12 };
-        int i = 0;
-        for (;;) {
-                /*
-                 * If script really needs this much, then it's a bug that
-                 * we cannot support it yet, I guess.  Otherwise it means
-                 * we're doing something wrong in this routine.
-                 */
-                bug_on(i >= BLK_SANITY);
+        struct mempool_slab_t *slab;
+        char *p;
 
-                for (; i < pool->size; i++) {
-                        if (!pool_blk_full(&pool->blks[i]))
-                                return &pool->blks[i];
-                }
-                mempool_more(pool);
-        }
+        p = slab_map();
+        slab = (struct mempool_slab_t *)p;
+        slab->pool = pool;
+        slab->free = NULL;
+        slab->bump = p + slab_hdr_size();
+        slab->n_used = 0;
+        list_init(&slab->list);
+        list_add_front(&slab->list, &pool->partial);
+        pool->n_empty++;
+        pool->stats.n_slabs++;
 }
 
 void *
 mempool_alloc(struct mempool_t *pool)
 {
-        struct mempool_blk_t *blk = avail_blk(pool);
-        if (!blk->used) {
-                blk->used |= 1;
-                return blk->data;
+        struct mempool_slab_t *slab;
+        void *ret;
+
+        if (list_is_empty(&pool->partial))
+                mempool_more(pool);
+        slab = container_of(pool->partial.next,
+                            struct mempool_slab_t, list);
+
+        if (slab->free) {
+                ret = slab->free;
+                slab->free = *(void **)ret;
         } else {
-                unsigned int bit, shift;
-                shift = mempool_ctz(~blk->used);
-                bug_on(shift >= 64);
-                bit = 1u << shift;
-                blk->used |= bit;
-                return blk->data + pool->datalen * shift;
+                ret = slab->bump;
+                slab->bump += pool->datalen;
         }
+
+        if (slab->n_used++ == 0)
+                pool->n_empty--;
+        if (slab->n_used == pool->per_slab)
+                list_remove(&slab->list);
+
+        pool->stats.n_alloc++;
+        if (++pool->stats.in_use > pool->stats.peak)
+                pool->stats.peak = pool->stats.in_use;
+        return ret;
 }
 
+/*
+ * @data always goes back to the slab it came from, so @pool is only
+ * used for sanity checks.  See mem_free__() for why it might not be
+ * the same pool.
+ */
 void
 mempool_free(struct mempool_t *pool, void *data)
 {
-        int i;
-        unsigned int shift;
-        size_t dbend = pool->datalen * NDATA_PER_BLK;
-        struct mempool_blk_t *blk = NULL;
-        for (i = 0, blk = pool->blks; i < pool->size; i++, blk++) {
-                if (data >= blk->data && data < (blk->data + dbend))
-                        break;
+        struct mempool_slab_t *slab = chunk2slab(data);
+
+        pool = slab->pool;
+        bug_on(((char *)data - (char *)slab - slab_hdr_size())
+               % pool->datalen != 0);
+        bug_on((char *)data >= slab->bump);
+        bug_on(slab->n_used <= 0);
+
+        /* it was full, so it's on no list */
+        if (slab->n_used-- == pool->per_slab)
+                list_add_front(&slab->list, &pool->partial);
+
+        *(void **)data = slab->free;
+        slab->free = data;
+
+        pool->stats.n_free++;
+        pool->stats.in_use--;
+
+        if (slab->n_used == 0) {
+                pool->n_empty++;
+                if (mem_trim_cfg.policy == MEM_TRIM_THRESHOLD
+                    && pool->n_empty * MEMPOOL_SLAB_SIZE
+                       > mem_trim_cfg.threshold) {
+                        slab_release(pool, slab);
+                }
         }
-        bug_on(i == pool->size);
+}
+
+/**
+ * mempool_trim - Give a pool's empty slabs back to the OS
+ * @pool:       Pool to trim
+ *
+ * Return: Number of bytes given back
+ */
+size_t
+mempool_trim(struct mempool_t *pool)
+{
+        struct list_t *li, *tmp;
+        size_t ret = 0;
 
-        shift = (data - blk->data) / pool->datalen;
-        bug_on(blk->data + shift * pool->datalen != data);
-        bug_on(!(blk->used & (1u << shift)));
+        list_foreach_safe(li, tmp, &pool->partial) {
+                struct mempool_slab_t *slab;
 
-        blk->used &= ~(1u << shift);
+                if (!pool->n_empty)
+                        break;
+                slab = container_of(li, struct mempool_slab_t, list);
+                if (slab->n_used == 0) {
+                        slab_release(pool, slab);
+                        ret += MEMPOOL_SLAB_SIZE;
+                }
+        }
+        return ret;
 }
 
 struct mempool_t *
 mempool_new(size_t datalen)
 {
         struct mempool_t *new = ecalloc(sizeof(*new));
+
+        if (datalen < sizeof(void *))
+                datalen = sizeof(void *);
+        datalen = (datalen + MEMPOOL_ALIGN - 1) & ~(MEMPOOL_ALIGN - 1);
+        bug_on(datalen > MEMPOOL_SLAB_SIZE - slab_hdr_size());
+
         new->datalen = datalen;
+        new->per_slab = (MEMPOOL_SLAB_SIZE - slab_hdr_size()) / datalen;
+        list_init(&new->partial);
+        new->stats.size = datalen;
+        return new;
+}
+
+/**
+ * mempool_stats - Get the counters for a pool
+ */
+void
+mempool_stats(struct mempool_t *pool, struct mem_stats_t *stats)
+{
+        *stats = pool->stats;
+        stats->n_spare = pool->stats.n_slabs * pool->per_slab
+                         - pool->stats.in_use;
+}
+
+/* **********************************************************************
+ *                      Size-class allocator
+ ***********************************************************************/
+
+__thread struct mem_class_t mem_classes[MEM_N_STATS];
+
+/* Return: size of class @idx */
+static size_t
+mem_class_size_(int idx)
+{
+        int k, shift;
+
+        if (idx < 8)
+                return (idx + 1) * 16;
+        k = idx - 8;
+        shift = 7 + k / 4;
+        return (1ul << shift) + (k % 4 + 1) * (1ul << (shift - 2));
+}
+
+static struct mempool_t *
+mem_pool(struct mem_class_t *c)
+{
+        if (!c->pool)
+                c->pool = mempool_new(mem_class_size_(c - mem_classes));
+        return c->pool;
+}
+
+/**
+ * mem_class_size - Get the size mem_alloc() would really allocate
+ * @size:       Size to ask for
+ *
+ * Callers which grow their data, like buffer.c, can use this to make
+ * use of all of it.
+ *
+ * Return: @size rounded up to its size class, or @size itself if it's
+ * bigger than MEM_MAX_CLASS
+ */
+size_t
+mem_class_size(size_t size)
+{
+        if (size > MEM_MAX_CLASS)
+                return size;
+        return mem_class_size_(mem_class(size));
+}
+
+/* mem_alloc() when it's too big, or its class's recent list is empty */
+void *
+mem_alloc__(size_t size)
+{
+        struct mem_class_t *c;
+
+        if (size > MEM_MAX_CLASS)
+                return emalloc(size);
+        c = &mem_classes[mem_class(size)];
+        c->n_alloc++;
+        return mempool_alloc(mem_pool(c));
+}
+
+/* mem_free() when it's too big, or its class's recent list is full */
+void
+mem_free__(void *p, size_t size)
+{
+        if (size > MEM_MAX_CLASS) {
+                free(p);
+                return;
+        }
+        mem_classes[mem_class(size)].n_free++;
+        mempool_free(NULL, p);
+}
+
+/**
+ * mem_realloc - Resize memory from mem_alloc()
+ * @p:          Pointer returned by mem_alloc() or mem_realloc(), or
+ *              NULL if @oldsize is zero
+ * @oldsize:    Size it was allocated with
+ * @newsize:    Size wanted
+ *
+ * Return: Pointer to the resized memory, which may be @p
+ */
+void *
+mem_realloc(void *p, size_t oldsize, size_t newsize)
+{
+        void *new;
+
+        if (!p)
+                return mem_alloc(newsize);
+        if (oldsize > MEM_MAX_CLASS && newsize > MEM_MAX_CLASS) {
+                new = realloc(p, newsize);
+                if (!new)
+                        fail("realloc failed");
+                return new;
+        }
+        if (mem_class_size(oldsize) == mem_class_size(newsize))
+                return p;
+
+        new = mem_alloc(newsize);
+        memcpy(new, p, oldsize < newsize ? oldsize : newsize);
+        mem_free(p, oldsize);
         return new;
 }
+
+/**
+ * mem_trim - Give the calling thread's unused memory back to the OS
+ *
+ * This empties the recent list of each size class, then gives back
+ * every slab with nothing left in it.  Pools are per thread, so slabs
+ * belonging to other threads are left alone.
+ *
+ * Return: Number of bytes given back.  Memory malloc() gives back for
+ * things bigger than MEM_MAX_CLASS isn't counted.
+ */
+size_t
+mem_trim(void)
+{
+        int i;
+        size_t ret = 0;
+
+        for (i = 0; i < MEM_N_STATS; i++) {
+                struct mem_class_t *c = &mem_classes[i];
+                void *p;
+
+                while ((p = c->recent) != NULL) {
+                        c->recent = *(void **)p;
+                        mempool_free(NULL, p);
+                }
+                c->n_recent = 0;
+                if (c->pool)
+                        ret += mempool_trim(c->pool);
+        }
+#ifdef __GLIBC__
+        malloc_trim(0);
+#endif
+        return ret;
+}
+
+/**
+ * mem_idle - Tell the allocator the program is about to wait for a while
+ *
+ * This is the time to trim if the policy is MEM_TRIM_IDLE, since
+ * nothing is going to be allocated for a while anyway.
+ */
+void
+mem_idle(void)
+{
+        if (mem_trim_cfg.policy == MEM_TRIM_IDLE)
+                mem_trim();
+}
+
+/**
+ * mem_set_trim - Set when unused memory is given back to the OS
+ * @policy:     One of the following:
+ *              MEM_TRIM_EXPLICIT  Only when mem_trim() is called
+ *              MEM_TRIM_IDLE      Also when mem_idle() is called
+ *              MEM_TRIM_THRESHOLD Also whenever a pool has more than
+ *                                 @threshold bytes of empty slabs
+ * @threshold:  See MEM_TRIM_THRESHOLD, ignored for the other policies
+ *
+ * The policy is for all threads.  The default is MEM_TRIM_THRESHOLD,
+ * with a threshold of MEM_TRIM_DEFAULT.
+ */
+void
+mem_set_trim(int policy, size_t threshold)
+{
+        bug_on(policy != MEM_TRIM_EXPLICIT && policy != MEM_TRIM_IDLE
+               && policy != MEM_TRIM_THRESHOLD);
+        mem_trim_cfg.policy = policy;
+        mem_trim_cfg.threshold = threshold;
+}
+
+/**
+ * mem_stats - Get the counters for each size class
+ * @stats:      Array to fill in, MEM_N_STATS long
+ *
+ * These are for the calling thread only.  @peak and @n_slabs are
+ * those of the class's slabs, where chunks on the recent list still
+ * count as being in use.
+ *
+ * Return: Number of entries filled in, MEM_N_STATS
+ */
+int
+mem_stats(struct mem_stats_t *stats)
+{
+        int i;
+
+        bug_on(mem_class(MEM_MAX_CLASS) != MEM_N_STATS - 1);
+        for (i = 0; i < MEM_N_STATS; i++) {
+                struct mem_class_t *c = &mem_classes[i];
+
+                if (c->pool)
+                        mempool_stats(c->pool, &stats[i]);
+                else
+                        memset(&stats[i], 0, sizeof(stats[i]));
+                stats[i].size = mem_class_size_(i);
+                stats[i].n_alloc = c->n_alloc;
+                stats[i].n_free = c->n_free;
+                stats[i].in_use = c->n_alloc - c->n_free;
+                stats[i].n_recent = c->n_recent;
+        }
+        return MEM_N_STATS;
+}
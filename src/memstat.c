@@ -0,0 +1,260 @@
+/*
+ * memstat.c - Counters for how much of everything there is
+ *
+ * Each kind of thing the interpreter makes a lot of--variables, the
+ * handles of dictionaries, lists, functions, and strings, hash table
+ * buckets, buffers, stack frames, executables, and names in the
+ * literal table--is counted with memstat_alloc() and memstat_free()
+ * where it's made and freed.  That's a few additions on paths that
+ * already call mem_alloc(), so it's always on, release builds too.
+ *
+ * There are three ways to see them:
+ *
+ *      __gbl__._sys.memstats() returns them as a dictionary, see
+ *      builtin/sys.c.
+ *
+ *      The -m option prints a report to stderr at exit.
+ *
+ *      Sending the process SIGUSR1 prints the same report while it's
+ *      running, without stopping it.
+ *
+ * The report is made without malloc() or stdio, so it's safe from a
+ * signal handler.  The counters are per thread, and the handler reads
+ * those of whichever thread the signal landed on, which is the main
+ * thread except during --compile.
+ */
+#include <evilcandy.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+__thread struct memstat_t memstats[MS_N];
+
+static const char *MEMSTAT_NAMES[MS_N] = {
+        [MS_VAR]        = "var",
+        [MS_DICT]       = "dict",
+        [MS_LIST]       = "list",
+        [MS_FUNCTION]   = "function",
+        [MS_STRING]     = "string",
+        [MS_BUCKET]     = "bucket",
+        [MS_BUFFER]     = "buffer",
+        [MS_FRAME]      = "frame",
+        [MS_EXECUTABLE] = "executable",
+        [MS_LITERAL]    = "literal",
+};
+
+/**
+ * memstat_name - Get the name of a kind of memstats[] entry
+ */
+const char *
+memstat_name(int kind)
+{
+        bug_on(kind < 0 || kind >= MS_N);
+        return MEMSTAT_NAMES[kind];
+}
+
+/**
+ * memstat_get - Get the counters for every kind
+ * @stats:      Array to fill in, MS_N long
+ */
+void
+memstat_get(struct memstat_t *stats)
+{
+        memcpy(stats, memstats, sizeof(memstats));
+        literal_stats(&stats[MS_LITERAL]);
+}
+
+/* value in bytes of "@key:   1234 kB" in @buf, or 0 if not there */
+static size_t
+status_field(const char *buf, const char *key)
+{
+        size_t keylen = strlen(key);
+        const char *s = buf;
+        size_t v = 0;
+
+        while (strncmp(s, key, keylen) != 0) {
+                s = strchr(s, '\n');
+                if (!s)
+                        return 0;
+                s++;
+        }
+        for (s += keylen; *s == ' ' || *s == '\t'; s++)
+                ;
+        while (*s >= '0' && *s <= '9')
+                v = v * 10 + *s++ - '0';
+        return v * 1024;
+}
+
+/**
+ * memstat_rss - Get the process's resident set size
+ * @rss:        Filled with bytes resident now
+ * @peak:       Filled with the most that ever were
+ *
+ * Both are zero if the OS won't say, which is everywhere but Linux.
+ */
+void
+memstat_rss(size_t *rss, size_t *peak)
+{
+        char buf[4096];
+        ssize_t n, len = 0;
+        int fd;
+
+        *rss = *peak = 0;
+        fd = open("/proc/self/status", O_RDONLY);
+        if (fd < 0)
+                return;
+        while (len < sizeof(buf) - 1
+               && (n = read(fd, buf + len, sizeof(buf) - 1 - len)) > 0) {
+                len += n;
+        }
+        close(fd);
+        buf[len] = '\0';
+        *rss = status_field(buf, "VmRSS:");
+        *peak = status_field(buf, "VmHWM:");
+}
+
+/*
+ * Report formatting.  Nothing here calls malloc() or stdio, see top
+ * of file.
+ */
+struct report_t {
+        char buf[2048];
+        size_t n;
+};
+
+static void
+rp_puts(struct report_t *rp, const char *s)
+{
+        while (*s && rp->n < sizeof(rp->buf))
+                rp->buf[rp->n++] = *s++;
+}
+
+/* @s padded with spaces to @width, on the right */
+static void
+rp_putsw(struct report_t *rp, const char *s, int width)
+{
+        int len = strlen(s);
+
+        rp_puts(rp, s);
+        while (len++ < width)
+                rp_puts(rp, " ");
+}
+
+/* @v padded with spaces to @width, on the left */
+static void
+rp_putnum(struct report_t *rp, unsigned long long v, int width)
+{
+        char tmp[24];
+        int i = sizeof(tmp) - 1;
+
+        tmp[i] = '\0';
+        do {
+                tmp[--i] = '0' + v % 10;
+                v /= 10;
+        } while (v != 0);
+        while (i > 0 && (int)sizeof(tmp) - 1 - i < width)
+                tmp[--i] = ' ';
+        rp_puts(rp, &tmp[i]);
+}
+
+/**
+ * memstat_report - Write a table of the counters to @fd
+ */
+void
+memstat_report(int fd)
+{
+        static const char *HDR[] = {
+                "live", "total", "peak", "bytes", "peak_bytes", "cached", NULL,
+        };
+        struct report_t rp;
+        struct memstat_t stats[MS_N];
+        struct mem_stats_t cls[MEM_N_STATS];
+        unsigned long long pool_bytes = 0;
+        unsigned long n_slabs = 0, n_spare = 0, n_recent = 0;
+        size_t rss, rss_peak;
+        const char **h;
+        int i;
+
+        rp.n = 0;
+        memstat_get(stats);
+        rp_puts(&rp, "[EvilCandy] memory statistics:\n");
+        rp_putsw(&rp, "kind", 12);
+        for (h = HDR; *h; h++) {
+                rp_puts(&rp, " ");
+                rp_putsw(&rp, "", 10 - strlen(*h));
+                rp_puts(&rp, *h);
+        }
+        rp_puts(&rp, "\n");
+        for (i = 0; i < MS_N; i++) {
+                rp_putsw(&rp, MEMSTAT_NAMES[i], 12);
+                rp_putnum(&rp, stats[i].n_alloc - stats[i].n_free, 11);
+                rp_putnum(&rp, stats[i].n_alloc, 11);
+                rp_putnum(&rp, stats[i].peak, 11);
+                rp_putnum(&rp, stats[i].bytes, 11);
+                rp_putnum(&rp, stats[i].peak_bytes, 11);
+                rp_putnum(&rp, stats[i].n_cached, 11);
+                rp_puts(&rp, "\n");
+        }
+
+        mem_stats(cls);
+        for (i = 0; i < MEM_N_STATS; i++) {
+                pool_bytes += (unsigned long long)cls[i].in_use
+                              * cls[i].size;
+                n_slabs += cls[i].n_slabs;
+                n_spare += cls[i].n_spare;
+                n_recent += cls[i].n_recent;
+        }
+        rp_puts(&rp, "size classes: ");
+        rp_putnum(&rp, pool_bytes, 0);
+        rp_puts(&rp, " bytes in use, ");
+        rp_putnum(&rp, n_slabs, 0);
+        rp_puts(&rp, " slabs, ");
+        rp_putnum(&rp, n_spare, 0);
+        rp_puts(&rp, " spare chunks, ");
+        rp_putnum(&rp, n_recent, 0);
+        rp_puts(&rp, " recently freed\n");
+
+        memstat_rss(&rss, &rss_peak);
+        rp_puts(&rp, "rss: ");
+        rp_putnum(&rp, rss / 1024, 0);
+        rp_puts(&rp, " KiB, peak ");
+        rp_putnum(&rp, rss_peak / 1024, 0);
+        rp_puts(&rp, " KiB\n");
+
+        /* best effort, nothing to be done if it fails */
+        if (write(fd, rp.buf, rp.n) < 0)
+                ;
+}
+
+/**
+ * memstat_report_at_exit - atexit() callback for the -m option
+ */
+void
+memstat_report_at_exit(void)
+{
+        memstat_report(STDERR_FILENO);
+}
+
+static void
+memstat_sigusr1(int signo)
+{
+        int save_errno = errno;
+
+        memstat_report(STDERR_FILENO);
+        errno = save_errno;
+}
+
+void
+moduleinit_memstat(void)
+{
+        struct sigaction sa;
+
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = memstat_sigusr1;
+        sigemptyset(&sa.sa_mask);
+        /* don't make the script's own reads and writes fail */
+        sa.sa_flags = SA_RESTART;
+        sigaction(SIGUSR1, &sa, NULL);
+}
@@ -0,0 +1,272 @@
+/*
+ * precompile.c - Code that handles the --compile option, assemble a
+ *                whole tree of scripts ahead of time and write their
+ *                byte-code cache images.
+ *
+ * The files are assembled by a pool of threads, one per CPU.  This
+ * works because the lexer and assembler keep all their state in the
+ * lexer_t and assemble_t structs, and the few things they share with
+ * each other--literal(), the allocators' free lists, the location
+ * stack for error messages--are either locked or per-thread.  The
+ * literal table is only locked while the pool is running, see
+ * literal_set_threaded().
+ *
+ * Nothing is executed, so nothing in the VM needs to be thread-safe.
+ * The cache images go wherever evcc_save() puts them, the same place
+ * the -c option looks for them.
+ */
+#include <evilcandy.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/**
+ * struct pc_job_t - One file to precompile
+ * @path:       Real path of the file
+ * @usec:       How long it took to lex, assemble, and save it
+ * @ok:         False if it had an error
+ */
+struct pc_job_t {
+        char *path;
+        long usec;
+        bool ok;
+};
+
+/**
+ * struct pc_state_t - State shared by all the worker threads
+ * @jobs:       Array of files, sorted by path
+ * @n_jobs:     Length of @jobs
+ * @next:       Index of the next job to hand out
+ * @lock:       Lock for @next
+ */
+struct pc_state_t {
+        struct pc_job_t *jobs;
+        int n_jobs;
+        int next;
+        pthread_mutex_t lock;
+};
+
+static bool
+is_script_name(const char *name)
+{
+        const char *ext = strrchr(name, '.');
+        return ext && ext != name
+               && (!strcmp(ext, ".egq") || !strcmp(ext, ".evc"));
+}
+
+/* recursively add all the scripts in @dir to @jobs */
+static void
+pc_walk(const char *dir, struct pc_job_t **jobs,
+        int *n_jobs, size_t *alloc)
+{
+        char path[PATH_MAX];
+        char full[PATH_MAX];
+        struct dirent *de;
+        DIR *dirp;
+
+        dirp = opendir(dir);
+        if (!dirp) {
+                warning("Cannot open directory %s", dir);
+                return;
+        }
+
+        while ((de = readdir(dirp)) != NULL) {
+                struct stat st;
+                int n;
+
+                /* skips ".", "..", and hidden files */
+                if (de->d_name[0] == '.')
+                        continue;
+                n = snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+                if (n < 0 || n >= sizeof(path) || lstat(path, &st) < 0)
+                        continue;
+
+                /* don't follow symlinked dirs, they could loop */
+                if (S_ISDIR(st.st_mode)) {
+                        pc_walk(path, jobs, n_jobs, alloc);
+                        continue;
+                }
+
+                if (!is_script_name(de->d_name) || !realpath(path, full)
+                    || stat(full, &st) < 0 || !S_ISREG(st.st_mode)) {
+                        continue;
+                }
+
+                if (assert_array_pos(*n_jobs, (void **)jobs,
+                                     alloc, sizeof(**jobs)) < 0) {
+                        fail("Too many files to compile");
+                }
+                (*jobs)[*n_jobs].path = estrdup(full);
+                (*jobs)[*n_jobs].usec = 0;
+                (*jobs)[*n_jobs].ok = false;
+                (*n_jobs)++;
+        }
+        closedir(dirp);
+}
+
+static int
+pc_job_cmp(const void *a, const void *b)
+{
+        return strcmp(((struct pc_job_t *)a)->path,
+                      ((struct pc_job_t *)b)->path);
+}
+
+static long
+usec_since(const struct timespec *t0)
+{
+        struct timespec t1;
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        return (t1.tv_sec - t0->tv_sec) * 1000000L
+               + (t1.tv_nsec - t0->tv_nsec) / 1000;
+}
+
+/* Return: true if @path compiled */
+static bool
+pc_compile(const char *path)
+{
+        struct executable_t *ex;
+        struct lexer_t *lex;
+        struct stat st;
+        jmp_buf env;
+        jmp_buf *old;
+        FILE *fp;
+
+        fp = fopen(path, "r");
+        if (!fp) {
+                warning("Cannot open %s", path);
+                return false;
+        }
+        if (fstat(fileno(fp), &st) < 0) {
+                fclose(fp);
+                return false;
+        }
+
+        lex = lex_open(fp, notdir(path));
+        fclose(fp);
+        /* empty file, nothing to do */
+        if (!lex)
+                return true;
+
+        old = err_catch(&env);
+        if (setjmp(env) != 0) {
+                /* syntax() already told the user why */
+                err_catch(old);
+                lex_close(lex);
+                return false;
+        }
+        ex = assemble(lex, path, false);
+        err_catch(old);
+        lex_close(lex);
+
+        evcc_save(path, &st, ex);
+        /* frees the functions' code along with it */
+        EXECUTABLE_RELEASE(ex);
+        return true;
+}
+
+static void *
+pc_worker(void *arg)
+{
+        struct pc_state_t *pc = arg;
+
+        for (;;) {
+                struct pc_job_t *job;
+                struct timespec t0;
+
+                pthread_mutex_lock(&pc->lock);
+                job = pc->next < pc->n_jobs ? &pc->jobs[pc->next++] : NULL;
+                pthread_mutex_unlock(&pc->lock);
+                if (!job)
+                        break;
+
+                clock_gettime(CLOCK_MONOTONIC, &t0);
+                job->ok = pc_compile(job->path);
+                job->usec = usec_since(&t0);
+        }
+        return NULL;
+}
+
+/**
+ * precompile_dir - Assemble every script under a directory and save
+ *                  their byte-code cache images
+ * @dir: Top directory to search.  Files ending in .egq or .evc are
+ *       assembled, subdirectories are searched recursively.
+ *
+ * Return: 0 if every file was compiled, 1 otherwise, suitable for
+ * returning from main().
+ */
+int
+precompile_dir(const char *dir)
+{
+        struct pc_state_t pc;
+        struct timespec t0;
+        pthread_t *threads;
+        size_t alloc = 0;
+        long ncpu;
+        int i, j, nthread, nerr;
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+
+        memset(&pc, 0, sizeof(pc));
+        pthread_mutex_init(&pc.lock, NULL);
+        pc_walk(dir, &pc.jobs, &pc.n_jobs, &alloc);
+        if (pc.n_jobs == 0) {
+                warning("No scripts found in %s", dir);
+                return 0;
+        }
+
+        /* hard links or symlinked files could name one file twice */
+        qsort(pc.jobs, pc.n_jobs, sizeof(*pc.jobs), pc_job_cmp);
+        for (i = j = 1; i < pc.n_jobs; i++) {
+                if (!strcmp(pc.jobs[i].path, pc.jobs[j - 1].path))
+                        free(pc.jobs[i].path);
+                else
+                        pc.jobs[j++] = pc.jobs[i];
+        }
+        pc.n_jobs = j;
+
+        ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        nthread = ncpu > 0 ? ncpu : 1;
+        if (nthread > pc.n_jobs)
+                nthread = pc.n_jobs;
+
+        threads = emalloc(sizeof(*threads) * nthread);
+        literal_set_threaded(true);
+        for (i = 0; i < nthread; i++) {
+                if (pthread_create(&threads[i], NULL, pc_worker, &pc) != 0)
+                        break;
+        }
+        /* if we couldn't start any, do it ourselves */
+        if (i == 0)
+                pc_worker(&pc);
+        nthread = i;
+        for (i = 0; i < nthread; i++)
+                pthread_join(threads[i], NULL);
+        literal_set_threaded(false);
+        free(threads);
+
+        nerr = 0;
+        for (i = 0; i < pc.n_jobs; i++) {
+                struct pc_job_t *job = &pc.jobs[i];
+                if (job->ok) {
+                        printf("%8ld us  %s\n", job->usec, job->path);
+                } else {
+                        printf("   ERROR     %s\n", job->path);
+                        nerr++;
+                }
+                free(job->path);
+        }
+        printf("Compiled %d of %d files with %d threads in %ld ms\n",
+               pc.n_jobs - nerr, pc.n_jobs, nthread > 0 ? nthread : 1,
+               usec_since(&t0) / 1000);
+
+        free(pc.jobs);
+        pthread_mutex_destroy(&pc.lock);
+        return nerr ? 1 : 0;
+}
@@ -0,0 +1,1065 @@
+/*
+ * serialize.c - Save assembled scripts in a byte-code cache, and load
+ *               them back in, so that a script which has not changed
+ *               since its last run needn't be lexed and assembled again.
+ *
+ * Cache files live in $EVILCANDY_CACHE if set, otherwise in
+ * $XDG_CACHE_HOME/evilcandy, otherwise in $HOME/.cache/evilcandy.  Each
+ * is named after a hash of the source file's full path, with a .evcc
+ * extension.  The header records the source path, its size and mtime.
+ * If any of those don't match, the cache file is ignored, and it will
+ * be written over after the script is assembled.
+ *
+ * A cache file is an image which is mmap'd read-only and executed in
+ * place, so that every process running the same script shares the same
+ * pages, and loading it costs about the same no matter how big the
+ * script is.  Nothing in the image is a pointer.  Executables, arrays,
+ * and strings are found by their byte offset from the start of the
+ * image, and every array starts on an 8-byte boundary:
+ *
+ *      struct evcc_header_t
+ *      source path
+ *      for each executable:
+ *              string constants
+ *              struct evcc_const_t[n_rodata]
+ *              instruction_t[n_instr]
+ *              struct location_t[n_locations]
+ *              for each switch table: int offs[n], uint32_t keys[n]
+ *              struct evcc_jtab_t[n_jtabs]
+ *      struct evcc_exec_t[n_exec]
+ *
+ * Executable number zero is the script's top level.
+ *
+ * Only the struct executable_t wrappers are allocated at load time.
+ * Their instructions, locations, and switch-table offsets point
+ * straight into the image.  Their rodata arrays start out empty, and
+ * each constant is built (strings interned with literal_put()) the
+ * first time the VM asks for it; see evcc_rodata().
+ *
+ * The format is not portable.  It's written in host byte order, and
+ * the header also records the sizes of the types that are used in
+ * place, so that a cache file from a different build is ignored too.
+ *
+ * The loader checks that everything in the image is where the image
+ * says it is, that the image still has the checksum it was written
+ * with, that every instruction's operands index something that's
+ * there (constants of the right kind, jump targets, switch tables), and
+ * runs each executable through the same stack check the assembler
+ * does, see assemble_verify(), since the VM doesn't check pushes and
+ * pops at run time.  If any of that fails, the cache file is ignored.
+ * Beyond that it trusts the code as much as if the assembler had just
+ * produced it.  Don't load cache files you didn't write.
+ *
+ * The same image, minus the cache file, is also what --emit-c compiles
+ * into a program, see emit_c.c, evcc_image() and evcc_load_image().
+ */
+#include <instructions.h>
+#include <evilcandy.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define EVCC_MAGIC      "EVCC"
+
+enum {
+        EVCC_VERSION    = 3,
+        EVCC_ENDIAN     = 0x01020304,
+        EVCC_ALIGN      = 8,
+};
+
+/* tags for rodata */
+enum {
+        EVCC_INT = 1,
+        EVCC_FLOAT,
+        EVCC_STRPTR,
+        EVCC_XPTR,
+};
+
+/**
+ * struct evcc_header_t - Start of a cache file
+ * @magic:      EVCC_MAGIC, not nulchar-terminated
+ * @version:    EVCC_VERSION
+ * @endian:     EVCC_ENDIAN, as written by this host
+ * @sizes:      Sizes of the types used in place, see evcc_sizes()
+ * @src_size:   Size of the source file
+ * @src_mtime:  Modification time of the source file, seconds part
+ * @src_mtime_ns: Modification time of the source file, nanoseconds part
+ * @image_size: Size of the whole file
+ * @path_len:   Length of the source path which follows this header,
+ *              counting its nulchar terminator
+ * @n_exec:     Number of executables
+ * @exec_off:   Offset of the struct evcc_exec_t array
+ * @checksum:   evcc_checksum() of everything after this header
+ */
+struct evcc_header_t {
+        char magic[4];
+        uint32_t version;
+        uint32_t endian;
+        uint32_t sizes;
+        uint64_t src_size;
+        int64_t src_mtime;
+        int64_t src_mtime_ns;
+        uint64_t image_size;
+        uint32_t path_len;
+        uint32_t n_exec;
+        uint64_t exec_off;
+        uint64_t checksum;
+};
+
+/**
+ * struct evcc_exec_t - An executable in the image
+ * @flags:      struct executable_t's @flags
+ * @file_line:  struct executable_t's @file_line
+ * @max_stack:  struct executable_t's @max_stack.  Not trusted; the
+ *              loader works it out again.
+ * @n_instr:    Number of instructions at @instr_off
+ * @n_rodata:   Number of struct evcc_const_t at @rodata_off
+ * @n_locations: Number of struct location_t at @locations_off
+ * @n_jtabs:    Number of struct evcc_jtab_t at @jtabs_off
+ * @n_args:     struct executable_t's @n_args
+ * @n_closures: struct executable_t's @n_closures
+ */
+struct evcc_exec_t {
+        uint32_t flags;
+        uint32_t file_line;
+        uint32_t max_stack;
+        uint32_t n_instr;
+        uint32_t n_rodata;
+        uint32_t n_locations;
+        uint32_t n_jtabs;
+        uint32_t n_args;
+        uint32_t n_closures;
+        uint32_t pad;
+        uint64_t instr_off;
+        uint64_t rodata_off;
+        uint64_t locations_off;
+        uint64_t jtabs_off;
+};
+
+/**
+ * struct evcc_const_t - A constant in the image
+ * @tag:        EVCC_INT, EVCC_FLOAT, EVCC_STRPTR, or EVCC_XPTR
+ * @len:        If EVCC_STRPTR, length of the string counting its
+ *              nulchar terminator
+ * @i:          Value if EVCC_INT
+ * @f:          Value if EVCC_FLOAT
+ * @off:        If EVCC_STRPTR, offset of the string from the start of
+ *              this struct.  This way evcc_rodata() needs nothing more
+ *              than a pointer to the constant to find it.
+ * @xidx:       If EVCC_XPTR, index of the executable it points to
+ */
+struct evcc_const_t {
+        uint32_t tag;
+        uint32_t len;
+        union {
+                int64_t i;
+                double f;
+                int64_t off;
+                uint64_t xidx;
+        };
+};
+
+/**
+ * struct evcc_jtab_t - A switch table in the image
+ * @dflt:       struct jump_table_t's @dflt
+ * @n:          struct jump_table_t's @n
+ * @min:        struct jump_table_t's @min
+ * @offs_off:   Offset of the int array of struct jump_table_t's @offs
+ * @keys_off:   Offset of a uint32_t array of rodata indexes for struct
+ *              jump_table_t's @keys, or zero if the table is dense
+ */
+struct evcc_jtab_t {
+        int32_t dflt;
+        uint32_t n;
+        int64_t min;
+        uint64_t offs_off;
+        uint64_t keys_off;
+};
+
+static uint32_t
+evcc_sizes(void)
+{
+        return sizeof(instruction_t)
+               | sizeof(struct location_t) << 8
+               | sizeof(int) << 16
+               | sizeof(struct evcc_exec_t) << 24;
+}
+
+/* FNV-1a, 64-bit version, for the cache file's name */
+static uint64_t
+evcc_hash(const char *s)
+{
+        uint64_t hash = 0xcbf29ce484222325ull;
+        while (*s != '\0') {
+                hash ^= (unsigned char)*s++;
+                hash *= 0x100000001b3ull;
+        }
+        return hash;
+}
+
+/*
+ * FNV-1a, but a word at a time, of the @size bytes of the image after
+ * its header.  Images are written in multiples of EVCC_ALIGN, so
+ * @size is too.  This is for catching a damaged file, not a forged one.
+ */
+static uint64_t
+evcc_checksum(const char *base, uint64_t size)
+{
+        const uint64_t *p = (const uint64_t *)
+                            (base + sizeof(struct evcc_header_t));
+        const uint64_t *end = (const uint64_t *)(base + size);
+        uint64_t hash = 0xcbf29ce484222325ull;
+
+        while (p < end)
+                hash = (hash ^ *p++) * 0x100000001b3ull;
+        return hash;
+}
+
+/* mkdir -p, more or less */
+static int
+evcc_mkdir(char *dir)
+{
+        char *s;
+
+        for (s = dir + 1; *s != '\0'; s++) {
+                if (*s != '/')
+                        continue;
+                *s = '\0';
+                mkdir(dir, 0700);
+                *s = '/';
+        }
+        if (mkdir(dir, 0700) < 0 && access(dir, W_OK) < 0)
+                return -1;
+        return 0;
+}
+
+/*
+ * Get the name of the cache file for @src_path, which must be a full
+ * path.  If @mkdir is true, create the directory if it isn't there.
+ * Return: Name of the cache file, which the caller must free, or NULL
+ *         if there's nowhere to put it.
+ */
+static char *
+evcc_path(const char *src_path, bool mkdir)
+{
+        char dir[PATH_MAX];
+        char *ret;
+        const char *env;
+        size_t len;
+        int n;
+
+        if ((env = getenv("EVILCANDY_CACHE")) != NULL)
+                n = snprintf(dir, sizeof(dir), "%s", env);
+        else if ((env = getenv("XDG_CACHE_HOME")) != NULL)
+                n = snprintf(dir, sizeof(dir), "%s/evilcandy", env);
+        else if ((env = getenv("HOME")) != NULL)
+                n = snprintf(dir, sizeof(dir), "%s/.cache/evilcandy", env);
+        else
+                return NULL;
+
+        if (n <= 0 || n >= sizeof(dir))
+                return NULL;
+        if (mkdir && evcc_mkdir(dir) < 0)
+                return NULL;
+
+        len = n + 24;
+        ret = emalloc(len);
+        snprintf(ret, len, "%s/%016llx.evcc", dir,
+                 (unsigned long long)evcc_hash(src_path));
+        return ret;
+}
+
+/* Fill in the header for a cache file, minus the image layout */
+static void
+evcc_header_init(struct evcc_header_t *hdr, const char *src_path,
+                 const struct stat *st)
+{
+        memset(hdr, 0, sizeof(*hdr));
+        memcpy(hdr->magic, EVCC_MAGIC, sizeof(hdr->magic));
+        hdr->version = EVCC_VERSION;
+        hdr->endian = EVCC_ENDIAN;
+        hdr->sizes = evcc_sizes();
+        hdr->src_size = st->st_size;
+        hdr->src_mtime = st->st_mtim.tv_sec;
+        hdr->src_mtime_ns = st->st_mtim.tv_nsec;
+        hdr->path_len = strlen(src_path) + 1;
+}
+
+/* **********************************************************************
+ *                              Saving
+ ***********************************************************************/
+
+/*
+ * Append @size bytes of @p to the image, or zeros if @p is NULL,
+ * starting at the next aligned offset.
+ * Return: Offset where it went
+ */
+static uint64_t
+img_put(struct buffer_t *b, const void *p, size_t size)
+{
+        static const char zeros[EVCC_ALIGN];
+        uint64_t off;
+
+        if (b->p % EVCC_ALIGN)
+                buffer_putd(b, zeros, EVCC_ALIGN - b->p % EVCC_ALIGN);
+        off = b->p;
+        while (!p && size > 0) {
+                size_t n = size < sizeof(zeros) ? size : sizeof(zeros);
+                buffer_putd(b, zeros, n);
+                size -= n;
+        }
+        if (size)
+                buffer_putd(b, p, size);
+        return off;
+}
+
+/* Get the index of @x in @xv, adding it if it's not there yet */
+static uint32_t
+evcc_exec_index(struct hashtable_t *idx, struct executable_t ***xv,
+                int *n, size_t *alloc, struct executable_t *x)
+{
+        void *p = hashtable_get(idx, x);
+        if (p)
+                return (uintptr_t)p - 1;
+
+        if (assert_array_pos(*n, (void **)xv, alloc, sizeof(**xv)) < 0)
+                fail("OOM");
+        (*xv)[*n] = x;
+        hashtable_put(idx, x, (void *)(uintptr_t)(*n + 1));
+        return (*n)++;
+}
+
+static uint32_t
+evcc_rodata_index(struct executable_t *x, struct var_t *v)
+{
+        int i;
+        for (i = 0; i < x->n_rodata; i++) {
+                if (x->rodata[i] == v)
+                        return i;
+        }
+        bug();
+        return 0;
+}
+
+static void
+evcc_write_jtabs(struct buffer_t *b, struct executable_t *x,
+                 struct evcc_exec_t *rec)
+{
+        struct evcc_jtab_t *jv;
+        int i, j;
+
+        if (!x->n_jtabs)
+                return;
+
+        jv = ecalloc(x->n_jtabs * sizeof(*jv));
+        for (i = 0; i < x->n_jtabs; i++) {
+                struct jump_table_t *jt = &x->jtabs[i];
+                jv[i].dflt = jt->dflt;
+                jv[i].n = jt->n;
+                jv[i].min = jt->min;
+                jv[i].offs_off = img_put(b, jt->offs,
+                                         jt->n * sizeof(*jt->offs));
+                if (!jt->htbl)
+                        continue;
+                jv[i].keys_off = img_put(b, NULL, 0);
+                for (j = 0; j < jt->n; j++) {
+                        uint32_t k = evcc_rodata_index(x, jt->keys[j]);
+                        buffer_putd(b, &k, sizeof(k));
+                }
+        }
+        rec->jtabs_off = img_put(b, jv, x->n_jtabs * sizeof(*jv));
+        free(jv);
+}
+
+static void
+evcc_write_exec(struct buffer_t *b, struct executable_t *x,
+                struct hashtable_t *idx, struct evcc_exec_t *rec)
+{
+        struct evcc_const_t *cv = NULL;
+        uint64_t *soff = NULL;
+        int i;
+
+        rec->flags = x->flags & ~FE_MAPPED;
+        rec->file_line = x->file_line;
+        rec->max_stack = x->max_stack;
+        rec->n_instr = x->n_instr;
+        rec->n_rodata = x->n_rodata;
+        rec->n_locations = x->n_locations;
+        rec->n_jtabs = x->n_jtabs;
+        rec->n_args = x->n_args;
+        rec->n_closures = x->n_closures;
+
+        if (x->n_rodata) {
+                cv = ecalloc(x->n_rodata * sizeof(*cv));
+                soff = ecalloc(x->n_rodata * sizeof(*soff));
+        }
+        /* strings first, so we know where they are */
+        for (i = 0; i < x->n_rodata; i++) {
+                struct var_t *v = x->rodata[i];
+                if (v->magic != TYPE_STRPTR)
+                        continue;
+                cv[i].len = strlen(v->strptr) + 1;
+                soff[i] = img_put(b, v->strptr, cv[i].len);
+        }
+        rec->rodata_off = img_put(b, NULL, 0);
+        for (i = 0; i < x->n_rodata; i++) {
+                struct var_t *v = x->rodata[i];
+                uint64_t here = rec->rodata_off + i * sizeof(*cv);
+                switch (v->magic) {
+                case TYPE_INT:
+                        cv[i].tag = EVCC_INT;
+                        cv[i].i = v->i;
+                        break;
+                case TYPE_FLOAT:
+                        cv[i].tag = EVCC_FLOAT;
+                        cv[i].f = v->f;
+                        break;
+                case TYPE_STRPTR:
+                        cv[i].tag = EVCC_STRPTR;
+                        cv[i].off = (int64_t)(soff[i] - here);
+                        break;
+                case TYPE_XPTR:
+                        cv[i].tag = EVCC_XPTR;
+                        cv[i].xidx = (uintptr_t)hashtable_get(idx,
+                                                        v->xptr) - 1;
+                        break;
+                default:
+                        bug();
+                }
+        }
+        img_put(b, cv, x->n_rodata * sizeof(*cv));
+        if (cv) {
+                free(cv);
+                free(soff);
+        }
+
+        rec->instr_off = img_put(b, x->instr,
+                                 x->n_instr * sizeof(*x->instr));
+        rec->locations_off = img_put(b, x->locations,
+                                 x->n_locations * sizeof(*x->locations));
+        evcc_write_jtabs(b, x, rec);
+}
+
+static void
+evcc_idx_delete(void *data)
+{
+}
+
+/* Write all of @b to @path, atomically */
+static void
+evcc_write_file(const char *path, struct buffer_t *b)
+{
+        char *tmp;
+        FILE *fp;
+        bool ok = false;
+
+        tmp = emalloc(strlen(path) + 24);
+        sprintf(tmp, "%s.%d.tmp", path, (int)getpid());
+
+        fp = fopen(tmp, "wb");
+        if (fp) {
+                ok = fwrite(b->s, 1, b->p, fp) == b->p;
+                if (fclose(fp) != 0)
+                        ok = false;
+                /*
+                 * rename so nobody ever maps half a file, and so
+                 * anyone who already mapped the old one keeps it.
+                 */
+                if (!ok || rename(tmp, path) < 0)
+                        unlink(tmp);
+        }
+        free(tmp);
+}
+
+/**
+ * evcc_image - Write an assembled script's image into a buffer
+ * @b:          Initialized buffer to append the image to.  It should
+ *              be empty, since offsets in the image are from the start
+ *              of @b.
+ * @src_path:   Path of the source file
+ * @st:         Result of fstat() on the source file
+ * @top:        The top-level executable returned by assemble()
+ *
+ * Executables are numbered in the image starting with @top, followed
+ * by the others in the order evcc_load_image() will link them into
+ * @top->list.
+ *
+ * Return: true if the image was written, false if @top can't be saved
+ * because some of it was never assembled (the -L option).
+ */
+bool
+evcc_image(struct buffer_t *b, const char *src_path,
+           const struct stat *st, struct executable_t *top)
+{
+        struct evcc_header_t hdr;
+        struct evcc_exec_t *recs;
+        struct executable_t **xv = NULL;
+        struct hashtable_t idx;
+        size_t alloc = 0;
+        bool ok = false;
+        int i, j, n = 0;
+
+        /* Gather up all the executables, and give them numbers */
+        hashtable_init(&idx, ptr_hash, ptr_key_match, evcc_idx_delete);
+        evcc_exec_index(&idx, &xv, &n, &alloc, top);
+        for (i = 0; i < n; i++) {
+                struct executable_t *x = xv[i];
+                /* -L skipped this one, can't save it */
+                if (x->lazy)
+                        goto out;
+                for (j = 0; j < x->n_rodata; j++) {
+                        if (x->rodata[j]->magic == TYPE_XPTR) {
+                                evcc_exec_index(&idx, &xv, &n, &alloc,
+                                                x->rodata[j]->xptr);
+                        }
+                }
+        }
+
+        evcc_header_init(&hdr, src_path, st);
+        hdr.n_exec = n;
+        img_put(b, &hdr, sizeof(hdr));
+        img_put(b, src_path, hdr.path_len);
+
+        recs = ecalloc(n * sizeof(*recs));
+        for (i = 0; i < n; i++)
+                evcc_write_exec(b, xv[i], &idx, &recs[i]);
+        hdr.exec_off = img_put(b, recs, n * sizeof(*recs));
+        hdr.image_size = b->p;
+        hdr.checksum = evcc_checksum(b->s, b->p);
+        memcpy(b->s, &hdr, sizeof(hdr));
+        free(recs);
+        ok = true;
+out:
+        hashtable_destroy(&idx);
+        if (xv)
+                free(xv);
+        return ok;
+}
+
+/**
+ * evcc_save - Save a freshly assembled script in the byte-code cache
+ * @src_path:   Full path of the source file
+ * @st:         Result of fstat() on the source file
+ * @top:        The top-level executable returned by assemble()
+ *
+ * Failure is silent, since all it means is that the next run will be
+ * a bit slower.
+ */
+void
+evcc_save(const char *src_path, const struct stat *st,
+          struct executable_t *top)
+{
+        struct buffer_t b;
+        char *path;
+
+        buffer_init(&b);
+        if (evcc_image(&b, src_path, st, top)
+            && (path = evcc_path(src_path, true)) != NULL) {
+                evcc_write_file(path, &b);
+                free(path);
+        }
+        buffer_free(&b);
+}
+
+/* **********************************************************************
+ *                              Loading
+ ***********************************************************************/
+
+/**
+ * evcc_rodata - Build a constant of an executable loaded from an image
+ * @ex:         Executable whose FE_MAPPED flag is set
+ * @idx:        Index of the constant, which must be less than
+ *              @ex->n_rodata
+ *
+ * This is called by the VM the first time it needs a constant which
+ * isn't there yet.
+ *
+ * Return: @ex->rodata[@idx], filled in
+ */
+struct var_t *
+evcc_rodata(struct executable_t *ex, int idx)
+{
+        const struct evcc_const_t *c;
+        struct var_t *v;
+
+        bug_on(!(ex->flags & FE_MAPPED));
+        bug_on(idx >= ex->n_rodata);
+
+        if ((v = ex->rodata[idx]) != NULL)
+                return v;
+
+        c = (const struct evcc_const_t *)ex->rodata_image + idx;
+        v = var_new();
+        switch (c->tag) {
+        case EVCC_INT:
+                integer_init(v, c->i);
+                break;
+        case EVCC_FLOAT:
+                float_init(v, c->f);
+                break;
+        case EVCC_STRPTR:
+                v->magic = TYPE_STRPTR;
+                v->strptr = literal_put((const char *)c + c->off);
+                break;
+        default:
+                /* XPTRs are filled in at load time */
+                bug();
+        }
+        ex->rodata[idx] = v;
+        return v;
+}
+
+/* cursor into a mapped image, for the sanity checks */
+struct evcc_image_t {
+        const char *base;
+        size_t size;
+        bool err;
+};
+
+/*
+ * Get a pointer to an array of @n items of @size bytes each at @off,
+ * or flag an error if it doesn't fit in the image or isn't aligned.
+ */
+static const void *
+img_get(struct evcc_image_t *img, uint64_t off, uint32_t n, size_t size)
+{
+        if (img->err || off % EVCC_ALIGN || off > img->size
+            || n > (img->size - off) / size) {
+                img->err = true;
+                return NULL;
+        }
+        return img->base + off;
+}
+
+static void
+evcc_map_jtabs(struct evcc_image_t *img, struct executable_t *x,
+               const struct evcc_exec_t *rec)
+{
+        const struct evcc_jtab_t *jv;
+        int i, j;
+
+        jv = img_get(img, rec->jtabs_off, rec->n_jtabs, sizeof(*jv));
+        if (img->err || !rec->n_jtabs)
+                return;
+
+        x->jtabs = ecalloc(rec->n_jtabs * sizeof(*x->jtabs));
+        for (i = 0; i < rec->n_jtabs && !img->err; i++) {
+                struct jump_table_t *jt = &x->jtabs[i];
+                const uint32_t *kv;
+
+                x->n_jtabs = i + 1;
+                jt->dflt = jv[i].dflt;
+                jt->min = jv[i].min;
+                jt->n = jv[i].n;
+                jt->offs = (int *)img_get(img, jv[i].offs_off,
+                                          jv[i].n, sizeof(int));
+                if (!jv[i].keys_off)
+                        continue;
+
+                /*
+                 * The hash table needs its keys up front.  Sparse
+                 * switches aren't common enough to care.
+                 */
+                kv = img_get(img, jv[i].keys_off, jv[i].n, sizeof(*kv));
+                if (img->err)
+                        break;
+                jt->keys = ecalloc(jt->n * sizeof(*jt->keys));
+                for (j = 0; j < jt->n; j++) {
+                        const struct evcc_const_t *c;
+                        if (kv[j] >= x->n_rodata) {
+                                img->err = true;
+                                break;
+                        }
+                        c = (const struct evcc_const_t *)x->rodata_image
+                            + kv[j];
+                        if (c->tag == EVCC_XPTR) {
+                                img->err = true;
+                                break;
+                        }
+                        jt->keys[j] = evcc_rodata(x, kv[j]);
+                }
+                if (!img->err && jump_table_hash_keys(jt) < 0)
+                        img->err = true;
+        }
+}
+
+/* tag of constant @idx of @x, or zero if there's no such constant */
+static uint32_t
+evcc_const_tag(struct executable_t *x, int idx)
+{
+        if (idx < 0 || idx >= x->n_rodata)
+                return 0;
+        return ((const struct evcc_const_t *)x->rodata_image)[idx].tag;
+}
+
+/* true if instruction @i of @x can branch by @off */
+static bool
+evcc_branch_ok(struct executable_t *x, int i, int off)
+{
+        int to = i + 1 + off;
+        return to >= 0 && to < x->n_instr;
+}
+
+/*
+ * Helper to evcc_map_exec: check that everything instruction @i of @x
+ * indexes with its operands is there and is the right kind of thing,
+ * since the VM only checks that in debug builds.  Stack depth is left
+ * to assemble_verify().
+ */
+static bool
+evcc_instr_ok(struct executable_t *x, int i)
+{
+        instruction_t *ii = &x->instr[i];
+        uint32_t tag = evcc_const_tag(x, ii->arg2);
+        struct jump_table_t *jt;
+        int j;
+
+        switch (ii->code) {
+        case INSTR_LOAD:
+        case INSTR_SYMTAB:
+        case INSTR_ADDATTR:
+                return tag == EVCC_STRPTR;
+        case INSTR_PUSH_CONST:
+                return tag != 0 && tag != EVCC_XPTR;
+        case INSTR_DEFFUNC:
+                return tag == EVCC_XPTR;
+        case INSTR_PUSH_PTR:
+                switch (ii->arg1) {
+                case IARG_PTR_AP:
+                        /* checked against the stack depth there */
+                        return true;
+                /* function_prep_frame() makes sure there are this many */
+                case IARG_PTR_FP:
+                        return ii->arg2 >= 0 && ii->arg2 < x->n_args;
+                case IARG_PTR_CP:
+                        return ii->arg2 >= 0 && ii->arg2 < x->n_closures;
+                case IARG_PTR_SEEK:
+                        return tag == EVCC_STRPTR;
+                case IARG_PTR_GBL:
+                case IARG_PTR_THIS:
+                        return true;
+                }
+                return false;
+        case INSTR_GETATTR:
+        case INSTR_SETATTR:
+                if (ii->arg1 == IARG_ATTR_STACK)
+                        return true;
+                return ii->arg1 == IARG_ATTR_CONST
+                       && tag != 0 && tag != EVCC_XPTR;
+        case INSTR_UNWIND:
+                return ii->arg2 >= 0;
+        case INSTR_CALL_FUNC:
+                return ii->arg2 >= 0 && (ii->arg1 == IARG_NO_PARENT
+                                         || ii->arg1 == IARG_WITH_PARENT);
+        case INSTR_ADD_DEFAULT:
+                return ii->arg2 >= 0 && ii->arg2 < FRAME_ARG_MAX;
+        case INSTR_PUSH_BLOCK:
+                return ii->arg1 == IARG_BLOCK || ii->arg1 == IARG_LOOP;
+        case INSTR_CMP:
+                return ii->arg1 <= IARG_GT;
+        case INSTR_B:
+        case INSTR_B_IF:
+                return evcc_branch_ok(x, i, ii->arg2);
+        case INSTR_JUMP_TABLE:
+                if (ii->arg2 < 0 || ii->arg2 >= x->n_jtabs)
+                        return false;
+                jt = &x->jtabs[ii->arg2];
+                if (ii->arg1 != (jt->keys ? IARG_JT_HASH : IARG_JT_DENSE)
+                    || !evcc_branch_ok(x, i, jt->dflt)) {
+                        return false;
+                }
+                for (j = 0; j < jt->n; j++) {
+                        if (!evcc_branch_ok(x, i, jt->offs[j]))
+                                return false;
+                }
+                return true;
+        default:
+                return ii->code < N_INSTR;
+        }
+}
+
+static void
+evcc_map_exec(struct evcc_image_t *img, struct executable_t *x,
+              const struct evcc_exec_t *rec,
+              struct executable_t **xv, uint32_t n_exec)
+{
+        const struct evcc_const_t *cv;
+        uint32_t i;
+        bool top;
+
+        x->flags = rec->flags | FE_MAPPED;
+        x->file_line = rec->file_line;
+        x->n_args = rec->n_args;
+        x->n_closures = rec->n_closures;
+        /* the top level isn't a function, so it has neither */
+        top = !!(x->flags & FE_TOP);
+        if (rec->n_args > (top ? 0 : FRAME_ARG_MAX)
+            || rec->n_closures > (top ? 0 : FRAME_CLOSURE_MAX)) {
+                img->err = true;
+                return;
+        }
+
+        /* These are never written to after assembly */
+        x->instr = (instruction_t *)img_get(img, rec->instr_off,
+                                rec->n_instr, sizeof(*x->instr));
+        x->locations = (struct location_t *)img_get(img,
+                                rec->locations_off, rec->n_locations,
+                                sizeof(*x->locations));
+        cv = img_get(img, rec->rodata_off, rec->n_rodata, sizeof(*cv));
+        if (img->err)
+                return;
+        x->n_instr = rec->n_instr;
+        x->n_locations = rec->n_locations;
+        x->rodata_image = cv;
+
+        if (rec->n_rodata)
+                x->rodata = ecalloc(rec->n_rodata * sizeof(*x->rodata));
+        x->n_rodata = rec->n_rodata;
+        for (i = 0; i < x->n_rodata; i++) {
+                const struct evcc_const_t *c = &cv[i];
+                uint64_t off;
+
+                switch (c->tag) {
+                case EVCC_INT:
+                case EVCC_FLOAT:
+                        break;
+                case EVCC_STRPTR:
+                        off = (const char *)c - img->base + c->off;
+                        if (c->len == 0 || off > img->size
+                            || c->len > img->size - off
+                            || img->base[off + c->len - 1] != '\0') {
+                                img->err = true;
+                                return;
+                        }
+                        break;
+                case EVCC_XPTR:
+                        if (c->xidx >= n_exec) {
+                                img->err = true;
+                                return;
+                        }
+                        /* cheap, and saves evcc_rodata() knowing @xv */
+                        x->rodata[i] = var_new();
+                        x->rodata[i]->magic = TYPE_XPTR;
+                        x->rodata[i]->xptr = xv[c->xidx];
+                        EXECUTABLE_CLAIM(xv[c->xidx]);
+                        break;
+                default:
+                        img->err = true;
+                        return;
+                }
+        }
+
+        evcc_map_jtabs(img, x, rec);
+
+        for (i = 0; i < x->n_instr && !img->err; i++) {
+                if (!evcc_instr_ok(x, i))
+                        img->err = true;
+        }
+        /* also sets @x->max_stack */
+        if (!img->err && assemble_verify(x) < 0)
+                img->err = true;
+}
+
+/* mmap all of @path read-only, set @*size to its length */
+static const char *
+evcc_map(const char *path, size_t *size)
+{
+        struct stat st;
+        void *p;
+        int fd;
+
+        fd = open(path, O_RDONLY);
+        if (fd < 0)
+                return NULL;
+        if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)
+            || st.st_size < sizeof(struct evcc_header_t)) {
+                close(fd);
+                return NULL;
+        }
+        p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED)
+                return NULL;
+        *size = st.st_size;
+        return p;
+}
+
+/**
+ * struct evcc_mapping_t - A cache file mapped by evcc_load()
+ * @base:       Start of the mapping
+ * @size:       Its length
+ * @nref:       Number of executables still pointing into it
+ */
+struct evcc_mapping_t {
+        const char *base;
+        size_t size;
+        int nref;
+};
+
+/**
+ * evcc_mapping_put - Drop an executable's hold on the cache file it
+ *                    was mapped from, see executable_free__()
+ */
+void
+evcc_mapping_put(struct evcc_mapping_t *map)
+{
+        if (--map->nref > 0)
+                return;
+        munmap((void *)map->base, map->size);
+        free(map);
+}
+
+/*
+ * Build the executables for an image whose header has been checked.
+ * If @map is not NULL, each executable holds a reference to it.
+ * Return: The top-level executable, or NULL if the image is bad.
+ */
+static struct executable_t *
+evcc_unpack(struct evcc_image_t *img, const struct evcc_header_t *hdr,
+            const char *file_name, struct evcc_mapping_t *map)
+{
+        const struct evcc_exec_t *recs;
+        struct executable_t **xv, *top;
+        uint32_t i;
+
+        recs = img_get(img, hdr->exec_off, hdr->n_exec, sizeof(*recs));
+        if (img->err)
+                return NULL;
+
+        xv = emalloc(hdr->n_exec * sizeof(*xv));
+        for (i = 0; i < hdr->n_exec; i++) {
+                xv[i] = ecalloc(sizeof(*xv[i]));
+                memstat_alloc(MS_EXECUTABLE, sizeof(*xv[i]));
+                list_init(&xv[i]->list);
+                xv[i]->file_name = file_name;
+        }
+        for (i = 0; i < hdr->n_exec && !img->err; i++)
+                evcc_map_exec(img, xv[i], &recs[i], xv, hdr->n_exec);
+
+        if (img->err || !(xv[0]->flags & FE_TOP)) {
+                for (i = 0; i < hdr->n_exec; i++)
+                        executable_disown__(xv[i]);
+                for (i = 0; i < hdr->n_exec; i++)
+                        executable_free__(xv[i]);
+                free(xv);
+                return NULL;
+        }
+
+        for (i = 0; i < hdr->n_exec; i++) {
+                if (map) {
+                        xv[i]->mapping = map;
+                        map->nref++;
+                }
+                if (i > 0)
+                        list_add_tail(&xv[i]->list, &xv[0]->list);
+        }
+        top = xv[0];
+        /* the caller's reference, as from assemble() */
+        EXECUTABLE_CLAIM(top);
+        free(xv);
+        return top;
+}
+
+/**
+ * evcc_load - Get a script from the byte-code cache
+ * @src_path:   Full path of the source file
+ * @file_name:  Name to give the executables' @file_name, the same thing
+ *              that would have been passed to assemble()
+ * @st:         Result of fstat() on the source file
+ *
+ * The image stays mapped until the last of its executables is freed.
+ *
+ * Return: The top-level executable, as assemble() would have returned
+ * it, or NULL if there's no cache file or it's out of date.
+ */
+struct executable_t *
+evcc_load(const char *src_path, const char *file_name,
+          const struct stat *st)
+{
+        const struct evcc_header_t *hdr;
+        struct evcc_header_t want;
+        struct evcc_image_t img;
+        struct evcc_mapping_t *map;
+        struct executable_t *top;
+        char *path;
+
+        if ((path = evcc_path(src_path, false)) == NULL)
+                return NULL;
+        img.base = evcc_map(path, &img.size);
+        img.err = false;
+        free(path);
+        if (!img.base)
+                return NULL;
+
+        hdr = (const struct evcc_header_t *)img.base;
+        evcc_header_init(&want, src_path, st);
+        if (memcmp(hdr->magic, want.magic, sizeof(hdr->magic))
+            || hdr->version != want.version
+            || hdr->endian != want.endian
+            || hdr->sizes != want.sizes
+            || hdr->src_size != want.src_size
+            || hdr->src_mtime != want.src_mtime
+            || hdr->src_mtime_ns != want.src_mtime_ns
+            || hdr->image_size != img.size
+            || hdr->path_len != want.path_len
+            || hdr->path_len > img.size - sizeof(*hdr)
+            || memcmp(hdr + 1, src_path, hdr->path_len)
+            || hdr->n_exec == 0
+            || img.size % EVCC_ALIGN
+            || hdr->checksum != evcc_checksum(img.base, img.size)) {
+                goto err_unmap;
+        }
+        map = emalloc(sizeof(*map));
+        map->base = img.base;
+        map->size = img.size;
+        map->nref = 0;
+        if ((top = evcc_unpack(&img, hdr, file_name, map)) != NULL)
+                return top;
+        free(map);
+
+err_unmap:
+        munmap((void *)img.base, img.size);
+        return NULL;
+}
+
+/**
+ * evcc_load_image - Get a script from an image already in memory
+ * @image:      Image written by evcc_image(), aligned to at least
+ *              8 bytes.  It must stay put for as long as the program
+ *              runs.
+ * @size:       Size of @image
+ * @file_name:  Name to give the executables' @file_name
+ *
+ * Unlike evcc_load(), this doesn't care whether the source file still
+ * exists or has changed; see emit_c.c.
+ *
+ * Return: The top-level executable, or NULL if @image is bad or was
+ * written by a different build.
+ */
+struct executable_t *
+evcc_load_image(const void *image, size_t size, const char *file_name)
+{
+        const struct evcc_header_t *hdr = image;
+        struct evcc_image_t img;
+
+        img.base = image;
+        img.size = size;
+        img.err = false;
+        if (size < sizeof(*hdr)
+            || memcmp(hdr->magic, EVCC_MAGIC, sizeof(hdr->magic))
+            || hdr->version != EVCC_VERSION
+            || hdr->endian != EVCC_ENDIAN
+            || hdr->sizes != evcc_sizes()
+            || hdr->image_size != size
+            || hdr->path_len > size - sizeof(*hdr)
+            || hdr->n_exec == 0
+            || size % EVCC_ALIGN
+            || hdr->checksum != evcc_checksum(image, size)) {
+                return NULL;
+        }
+        return evcc_unpack(&img, hdr, file_name, NULL);
+}
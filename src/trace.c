@@ -0,0 +1,1346 @@
+/*
+ * trace.c - Tracing compiler for hot loops, enabled by the -t option
+ *
+ * The VM counts how many times each backward branch is taken, see
+ * back_edge() in vm.c.  When the loop at a branch's target gets hot,
+ * the next trip around it is recorded: trace_record() steps through
+ * the loop's instructions itself, calling the same do_* handlers the
+ * interpreter would have, and translates each one into a linear IR
+ * using the types the values turned out to have.  If it makes it back
+ * to the top of the loop, the IR is kept, and every later backward
+ * branch to that loop runs the IR instead of the byte code.
+ *
+ * Only loops of integer and float arithmetic can be recorded.  An
+ * instruction that could call a function, look up an attribute, or
+ * leave the frame--or a variable that isn't a number, or an inner
+ * loop--ends the recording, and the loop is left to the interpreter.
+ *
+ * The IR is in SSA form: every instruction that makes a value writes
+ * a new register, and registers hold bare integers and doubles rather
+ * than variables.  Knowing the types lets it skip most of what the
+ * byte code has to do:
+ *
+ * - Each variable the loop uses has its type checked once, on entry
+ *   to the trace.  A store never changes a variable's type (qop_mov()
+ *   converts to the old type), and nothing else can touch a variable
+ *   while the trace runs, so the check holds for every trip.
+ * - Operations on constants are done while recording, and a B_IF on
+ *   a constant condition needs no check at all.
+ * - Temporaries, and variables declared with ``let'' inside the loop,
+ *   live only in registers.  No variable is allocated unless the
+ *   trace leaves in the middle of the loop with some of them on the
+ *   stack, and then trace_exit() makes them.
+ * - A value loaded from or stored to a variable is reused by later
+ *   loads of it during the same trip.
+ *
+ * A B_IF is a guard: if it goes the other way from when the loop was
+ * recorded, the trace leaves at that point.  Every guard has its own
+ * exit, which knows what the stack and the blocks would have looked
+ * like in the interpreter at that point, and where to resume.
+ *
+ * The IR is run by trace_exec(), a loop over a switch statement.  It
+ * is not translated to machine code.
+ */
+#include <instructions.h>
+#include <evilcandy.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* backward branches to a loop before it is recorded */
+#define TRACE_THRESHOLD         50
+/* longest recording, in byte-code instructions */
+#define TRACE_MAX_INSTR         500
+#define TRACE_MAX_REGS          1024
+#define TRACE_MAX_SLOTS         32
+#define TRACE_MAX_EXITS         64
+/* times a loop is recorded, if the types its trace saw keep changing */
+#define TRACE_MAX_RECORD        4
+/* entries before a trace is checked for being worth keeping */
+#define TRACE_TRIAL             64
+
+/* IR opcodes, "a" and "b" are registers unless stated otherwise */
+enum {
+        TR_LOADI = 0,   /* dst = slot[a]->i */
+        TR_LOADF,       /* dst = slot[a]->f */
+        TR_STOREI,      /* slot[a]->i = b */
+        TR_STOREF,      /* slot[a]->f = b */
+        TR_ADD,
+        TR_SUB,
+        TR_MUL,
+        TR_DIV,
+        TR_MOD,
+        TR_SHL,
+        TR_SHR,
+        TR_AND,
+        TR_OR,
+        TR_XOR,
+        TR_NOT,         /* dst = ~a */
+        TR_NEG,
+        TR_FADD,
+        TR_FSUB,
+        TR_FMUL,
+        TR_FDIV,
+        TR_FNEG,
+        TR_I2F,
+        TR_F2I,
+        TR_CMP,         /* dst = a <cc> b, cc is an IARG_EQ... */
+        TR_FCMP,
+        TR_NZ,          /* dst = a != 0 */
+        TR_FNZ,
+        TR_GUARD,       /* leave by exit b unless (a != 0) == cc */
+        TR_LOOP,        /* back to the top */
+};
+
+/* trace_step() return values, other than an exit number */
+enum {
+        TRACE_NEXT = -1,
+        TRACE_LOOP = -2,
+};
+
+/* what an entry on the recorder's stack is */
+enum {
+        TE_SLOT,        /* a variable from outside the loop, @ref is a slot */
+        TE_REG,         /* a temporary, @ref is its register */
+        TE_LOCAL,       /* a PUSH_LOCAL, @ref is the register of its value */
+        TE_LOCALREF,    /* a pointer to the TE_LOCAL at stack position @ref */
+};
+
+union trace_val_t {
+        long long i;
+        double f;
+};
+
+struct trace_ins_t {
+        unsigned char op;
+        unsigned char cc;
+        unsigned short dst;
+        unsigned short a;
+        unsigned short b;
+};
+
+/**
+ * struct trace_ent_t - Something a trace has on the VM stack
+ * @kind:       A TE_* enum
+ * @type:       TYPE_INT or TYPE_FLOAT, or TYPE_EMPTY for a TE_LOCAL
+ *              not yet assigned.  Not used for TE_LOCALREF.
+ * @ref:        See the TE_* enums
+ */
+struct trace_ent_t {
+        unsigned char kind;
+        unsigned char type;
+        unsigned short ref;
+};
+
+/* a PUSH_BLOCK that a trace has done, but not popped yet */
+struct trace_blk_t {
+        unsigned short level;
+        unsigned char type;
+};
+
+/**
+ * struct trace_exit_t - Where a trace leaves if a guard fails
+ * @pc:         Instruction to resume interpreting at
+ * @ent:        What the stack above the trace's entry level should hold
+ * @n_ent:      Number of @ent
+ * @blk:        Blocks to push, @level is where in @ent they start
+ * @n_blk:      Number of @blk
+ */
+struct trace_exit_t {
+        int pc;
+        struct trace_ent_t *ent;
+        int n_ent;
+        struct trace_blk_t *blk;
+        int n_blk;
+};
+
+/**
+ * struct trace_slot_t - A variable a trace reads or writes
+ * @ii:         The PUSH_PTR that found it, to find it again on entry
+ * @type:       TYPE_INT or TYPE_FLOAT, the same for the whole trace
+ * @written:    True if the trace stores to it
+ */
+struct trace_slot_t {
+        instruction_t ii;
+        unsigned char type;
+        bool written;
+};
+
+/* constant register, set on every entry to a trace */
+struct trace_const_t {
+        unsigned short reg;
+        union trace_val_t v;
+};
+
+/**
+ * struct trace_t - A recorded loop
+ * @ir:         The IR, ending in TR_LOOP
+ * @n_ir:       Number of @ir
+ * @k:          Registers that are constants
+ * @n_k:        Number of @k
+ * @slots:      Variables the IR uses
+ * @n_slots:    Number of @slots
+ * @exits:      Exits for the guards
+ * @n_exits:    Number of @exits
+ * @depth:      Stack depth, relative to the frame, at the top of the
+ *              loop
+ * @n_blocks:   Frame's block depth at the top of the loop
+ * @entries:    Times the trace was entered
+ * @iters:      Times the trace went around the loop
+ */
+struct trace_t {
+        struct trace_ins_t *ir;
+        int n_ir;
+        struct trace_const_t *k;
+        int n_k;
+        struct trace_slot_t *slots;
+        int n_slots;
+        struct trace_exit_t *exits;
+        int n_exits;
+        int depth;
+        int n_blocks;
+        unsigned long entries;
+        unsigned long iters;
+};
+
+/**
+ * struct trace_loop_t - A loop that's been branched back to
+ * @pc:         Top of the loop, index into the executable's instr[]
+ * @hot:        Backward branches to @pc since it was last recorded
+ * @n_rec:      Times it has been recorded
+ * @dead:       True if it can't be traced, leave it to the interpreter
+ * @tr:         Its trace, or NULL
+ */
+struct trace_loop_t {
+        int pc;
+        unsigned int hot;
+        int n_rec;
+        bool dead;
+        struct trace_t *tr;
+};
+
+/* struct executable_t's @traces */
+struct trace_set_t {
+        struct trace_loop_t *loops;
+        int n_loops;
+        size_t alloc;
+};
+
+/**
+ * struct trace_rec_t - State while recording
+ * @fr:         Frame being recorded
+ * @ex:         Its executable
+ * @tr:         The trace being built
+ * @start:      Top of the loop
+ * @seen:       True for each instruction recorded so far
+ * @n_regs:     Registers used so far
+ * @rtype:      Type of each register
+ * @rconst:     True for each register that is a constant
+ * @rval:       Value of each register that is a constant
+ * @slots:      Variables used so far
+ * @slotv:      What @slots point to now
+ * @slot_cur:   Register holding each slot's value for the rest of the
+ *              trip, or -1 if it has to be loaded
+ * @stack:      What the VM stack has above @tr->depth
+ * @sp:         Number of @stack
+ * @blk:        Blocks pushed by the loop so far
+ * @n_blk:      Number of @blk
+ * @ir_alloc:   Bytes allocated for @tr->ir, and so on
+ */
+struct trace_rec_t {
+        struct vmframe_t *fr;
+        struct executable_t *ex;
+        struct trace_t *tr;
+        int start;
+        bool *seen;
+        int n_regs;
+        unsigned char rtype[TRACE_MAX_REGS];
+        bool rconst[TRACE_MAX_REGS];
+        union trace_val_t rval[TRACE_MAX_REGS];
+        struct trace_slot_t slots[TRACE_MAX_SLOTS];
+        struct var_t *slotv[TRACE_MAX_SLOTS];
+        int slot_cur[TRACE_MAX_SLOTS];
+        struct trace_ent_t stack[FRAME_STACK_MAX];
+        int sp;
+        struct trace_blk_t blk[FRAME_NEST_MAX];
+        int n_blk;
+        size_t ir_alloc;
+        size_t k_alloc;
+        size_t exit_alloc;
+};
+
+/* Opcodes trace_record() knows what to do with */
+static const bool TRACEABLE[N_INSTR] = {
+        [INSTR_NOP]             = true,
+        [INSTR_PUSH_LOCAL]      = true,
+        [INSTR_PUSH_CONST]      = true,
+        [INSTR_PUSH_PTR]        = true,
+        [INSTR_POP]             = true,
+        [INSTR_UNWIND]          = true,
+        [INSTR_PUSH_BLOCK]      = true,
+        [INSTR_POP_BLOCK]       = true,
+        [INSTR_ASSIGN]          = true,
+        [INSTR_ASSIGN_ADD]      = true,
+        [INSTR_ASSIGN_SUB]      = true,
+        [INSTR_ASSIGN_MUL]      = true,
+        [INSTR_ASSIGN_DIV]      = true,
+        [INSTR_ASSIGN_MOD]      = true,
+        [INSTR_ASSIGN_XOR]      = true,
+        [INSTR_ASSIGN_LS]       = true,
+        [INSTR_ASSIGN_RS]       = true,
+        [INSTR_ASSIGN_OR]       = true,
+        [INSTR_ASSIGN_AND]      = true,
+        [INSTR_PUSH_ZERO]       = true,
+        [INSTR_B_IF]            = true,
+        [INSTR_B]               = true,
+        [INSTR_BITWISE_NOT]     = true,
+        [INSTR_NEGATE]          = true,
+        [INSTR_LOGICAL_NOT]     = true,
+        [INSTR_MUL]             = true,
+        [INSTR_DIV]             = true,
+        [INSTR_MOD]             = true,
+        [INSTR_ADD]             = true,
+        [INSTR_SUB]             = true,
+        [INSTR_LSHIFT]          = true,
+        [INSTR_RSHIFT]          = true,
+        [INSTR_CMP]             = true,
+        [INSTR_BINARY_AND]      = true,
+        [INSTR_BINARY_OR]       = true,
+        [INSTR_BINARY_XOR]      = true,
+        [INSTR_LOGICAL_OR]      = true,
+        [INSTR_LOGICAL_AND]     = true,
+        [INSTR_INCR]            = true,
+        [INSTR_DECR]            = true,
+};
+
+/* true while trace_record() is calling the handlers */
+static bool recording = false;
+
+/* same as qop_cmp() with the result of a compare callback */
+static inline long long
+trace_cc(int cc, int cmp)
+{
+        switch (cc) {
+        case IARG_EQ:
+                return cmp == 0;
+        case IARG_LEQ:
+                return cmp <= 0;
+        case IARG_GEQ:
+                return cmp >= 0;
+        case IARG_NEQ:
+                return cmp != 0;
+        case IARG_LT:
+                return cmp < 0;
+        case IARG_GT:
+                return cmp > 0;
+        }
+        bug();
+        return 0;
+}
+
+/*
+ * Execute one IR instruction.  The arithmetic has to come out the
+ * same as the int_* and float_* callbacks in types/, quirks and all.
+ *
+ * Return: TRACE_NEXT, TRACE_LOOP, or the number of the exit to leave
+ * by if a guard failed
+ */
+static inline int
+trace_step(const struct trace_ins_t *ip, union trace_val_t *r,
+           struct var_t **slots)
+{
+        long long i;
+        double f;
+
+        switch (ip->op) {
+        case TR_LOADI:
+                r[ip->dst].i = slots[ip->a]->i;
+                break;
+        case TR_LOADF:
+                r[ip->dst].f = slots[ip->a]->f;
+                break;
+        case TR_STOREI:
+                slots[ip->a]->i = r[ip->b].i;
+                break;
+        case TR_STOREF:
+                slots[ip->a]->f = r[ip->b].f;
+                break;
+        case TR_ADD:
+                r[ip->dst].i = r[ip->a].i + r[ip->b].i;
+                break;
+        case TR_SUB:
+                r[ip->dst].i = r[ip->a].i - r[ip->b].i;
+                break;
+        case TR_MUL:
+                r[ip->dst].i = r[ip->a].i * r[ip->b].i;
+                break;
+        case TR_DIV:
+                i = r[ip->b].i;
+                r[ip->dst].i = i == 0LL ? 0LL : r[ip->a].i / i;
+                break;
+        case TR_MOD:
+                i = r[ip->b].i;
+                r[ip->dst].i = i == 0LL ? 0LL : r[ip->a].i % i;
+                break;
+        case TR_SHL:
+                i = r[ip->b].i;
+                r[ip->dst].i = (i >= 64 || i <= 0) ? 0LL : r[ip->a].i << i;
+                break;
+        case TR_SHR:
+                i = r[ip->b].i;
+                r[ip->dst].i = (i >= 64 || i <= 0)
+                        ? 0LL : (unsigned long long)r[ip->a].i >> i;
+                break;
+        case TR_AND:
+                r[ip->dst].i = r[ip->a].i & r[ip->b].i;
+                break;
+        case TR_OR:
+                r[ip->dst].i = r[ip->a].i | r[ip->b].i;
+                break;
+        case TR_XOR:
+                r[ip->dst].i = r[ip->a].i ^ r[ip->b].i;
+                break;
+        case TR_NOT:
+                r[ip->dst].i = ~r[ip->a].i;
+                break;
+        case TR_NEG:
+                r[ip->dst].i = -r[ip->a].i;
+                break;
+        case TR_FADD:
+                r[ip->dst].f = r[ip->a].f + r[ip->b].f;
+                break;
+        case TR_FSUB:
+                r[ip->dst].f = r[ip->a].f - r[ip->b].f;
+                break;
+        case TR_FMUL:
+                r[ip->dst].f = r[ip->a].f * r[ip->b].f;
+                break;
+        case TR_FDIV:
+                f = r[ip->b].f;
+                r[ip->dst].f = fpclassify(f) != FP_NORMAL
+                        ? 0. : r[ip->a].f / f;
+                break;
+        case TR_FNEG:
+                r[ip->dst].f = -r[ip->a].f;
+                break;
+        case TR_I2F:
+                r[ip->dst].f = (double)r[ip->a].i;
+                break;
+        case TR_F2I:
+                r[ip->dst].i = (long long)r[ip->a].f;
+                break;
+        case TR_CMP:
+                i = r[ip->a].i;
+                r[ip->dst].i = trace_cc(ip->cc, i == r[ip->b].i
+                                        ? 0 : (i < r[ip->b].i ? -1 : 1));
+                break;
+        case TR_FCMP:
+                f = r[ip->a].f;
+                r[ip->dst].i = trace_cc(ip->cc, f == r[ip->b].f
+                                        ? 0 : (f < r[ip->b].f ? -1 : 1));
+                break;
+        case TR_NZ:
+                r[ip->dst].i = r[ip->a].i != 0LL;
+                break;
+        case TR_FNZ:
+                r[ip->dst].i = fpclassify(r[ip->a].f) != FP_ZERO;
+                break;
+        case TR_GUARD:
+                if ((r[ip->a].i != 0LL) != ip->cc)
+                        return ip->b;
+                break;
+        case TR_LOOP:
+                return TRACE_LOOP;
+        default:
+                bug();
+        }
+        return TRACE_NEXT;
+}
+
+/* Run @tr until a guard fails, return the exit to leave by */
+static int
+trace_exec(struct trace_t *tr, union trace_val_t *r, struct var_t **slots)
+{
+        const struct trace_ins_t *ir = tr->ir;
+        int i, res;
+
+        for (i = 0;; i++) {
+                res = trace_step(&ir[i], r, slots);
+                if (res == TRACE_NEXT)
+                        continue;
+                if (res != TRACE_LOOP)
+                        return res;
+                tr->iters++;
+                i = -1;
+        }
+}
+
+static void
+trace_push_block(struct vmframe_t *fr, int type)
+{
+        struct block_t *bl;
+
+        bug_on(fr->n_blocks >= FRAME_NEST_MAX);
+        bl = &fr->blocks[fr->n_blocks++];
+        bl->stack_level = fr->stackptr;
+        bl->type = type;
+}
+
+/*
+ * Leave a trace by exit @x: put on the stack what the interpreter
+ * would have had there, making variables for anything that was only
+ * in a register, and resume at the exit's instruction.
+ */
+static void
+trace_exit(struct vmframe_t *fr, const struct trace_exit_t *x,
+           union trace_val_t *r, struct var_t **slots)
+{
+        struct var_t **base = fr->stackptr;
+        int i, b = 0;
+
+        for (i = 0; i < x->n_ent; i++) {
+                const struct trace_ent_t *e = &x->ent[i];
+                struct var_t *v;
+
+                for (; b < x->n_blk && x->blk[b].level == i; b++)
+                        trace_push_block(fr, x->blk[b].type);
+
+                switch (e->kind) {
+                case TE_SLOT:
+                        v = slots[e->ref];
+                        VAR_INCR_REF(v);
+                        break;
+                case TE_LOCALREF:
+                        v = base[e->ref];
+                        VAR_INCR_REF(v);
+                        break;
+                default:
+                        v = var_new();
+                        if (e->type == TYPE_INT)
+                                integer_init(v, r[e->ref].i);
+                        else if (e->type == TYPE_FLOAT)
+                                float_init(v, r[e->ref].f);
+                        break;
+                }
+                bug_on(fr->stackptr - fr->stack >= FRAME_STACK_MAX);
+                *fr->stackptr++ = v;
+        }
+        for (; b < x->n_blk; b++)
+                trace_push_block(fr, x->blk[b].type);
+
+        fr->ppii = fr->ex->instr + x->pc;
+}
+
+/*
+ * Run @tr, if the frame's variables still have the types it was
+ * recorded with.
+ *
+ * Return: false if they don't
+ */
+static bool
+trace_enter(struct vmframe_t *fr, struct trace_t *tr,
+            const struct trace_hooks_t *hooks)
+{
+        struct var_t *slots[TRACE_MAX_SLOTS];
+        union trace_val_t r[TRACE_MAX_REGS];
+        int i, j;
+
+        if (fr->stackptr - fr->stack != tr->depth
+            || fr->n_blocks != tr->n_blocks) {
+                return false;
+        }
+
+        for (i = 0; i < tr->n_slots; i++) {
+                struct trace_slot_t *s = &tr->slots[i];
+                struct var_t *v = hooks->varptr(fr, s->ii);
+
+                if (v->magic != s->type || (s->written && isconst(v)))
+                        return false;
+                /* the IR assumes a store to one doesn't change another */
+                for (j = 0; j < i; j++) {
+                        if (slots[j] == v)
+                                return false;
+                }
+                slots[i] = v;
+        }
+
+        for (i = 0; i < tr->n_k; i++)
+                r[tr->k[i].reg] = tr->k[i].v;
+
+        tr->entries++;
+        i = trace_exec(tr, r, slots);
+        trace_exit(fr, &tr->exits[i], r, slots);
+        return true;
+}
+
+static void
+trace_free_one(struct trace_t *tr)
+{
+        int i;
+
+        for (i = 0; i < tr->n_exits; i++) {
+                if (tr->exits[i].ent)
+                        free(tr->exits[i].ent);
+                if (tr->exits[i].blk)
+                        free(tr->exits[i].blk);
+        }
+        if (tr->exits)
+                free(tr->exits);
+        if (tr->ir)
+                free(tr->ir);
+        if (tr->k)
+                free(tr->k);
+        if (tr->slots)
+                free(tr->slots);
+        free(tr);
+}
+
+/*
+ * Emit an IR instruction.  If @type is TYPE_EMPTY it doesn't make a
+ * value.
+ *
+ * Return: The new register, 0 if @type is TYPE_EMPTY, or -1 if the
+ * trace is too big
+ */
+static int
+rec_emit(struct trace_rec_t *r, int op, int type, int cc, int a, int b)
+{
+        struct trace_t *tr = r->tr;
+        struct trace_ins_t *ip;
+        int dst = 0;
+
+        if (type != TYPE_EMPTY) {
+                if (r->n_regs >= TRACE_MAX_REGS)
+                        return -1;
+                dst = r->n_regs++;
+                r->rtype[dst] = type;
+                r->rconst[dst] = false;
+        }
+        if (assert_array_pos(tr->n_ir, (void **)&tr->ir,
+                             &r->ir_alloc, sizeof(*ip)) < 0) {
+                return -1;
+        }
+        ip = &tr->ir[tr->n_ir++];
+        ip->op = op;
+        ip->cc = cc;
+        ip->dst = dst;
+        ip->a = a;
+        ip->b = b;
+        return dst;
+}
+
+/* Return: register holding the constant @v of @type, or -1 */
+static int
+rec_const(struct trace_rec_t *r, int type, union trace_val_t v)
+{
+        struct trace_t *tr = r->tr;
+        int i, reg;
+
+        for (i = 0; i < tr->n_k; i++) {
+                reg = tr->k[i].reg;
+                if (r->rtype[reg] == type
+                    && !memcmp(&r->rval[reg], &v, sizeof(v))) {
+                        return reg;
+                }
+        }
+
+        if (r->n_regs >= TRACE_MAX_REGS
+            || assert_array_pos(tr->n_k, (void **)&tr->k,
+                                &r->k_alloc, sizeof(*tr->k)) < 0) {
+                return -1;
+        }
+        reg = r->n_regs++;
+        r->rtype[reg] = type;
+        r->rconst[reg] = true;
+        r->rval[reg] = v;
+        tr->k[tr->n_k].reg = reg;
+        tr->k[tr->n_k].v = v;
+        tr->n_k++;
+        return reg;
+}
+
+static int
+rec_int(struct trace_rec_t *r, long long i)
+{
+        union trace_val_t v;
+        memset(&v, 0, sizeof(v));
+        v.i = i;
+        return rec_const(r, TYPE_INT, v);
+}
+
+static int
+rec_float(struct trace_rec_t *r, double f)
+{
+        union trace_val_t v;
+        memset(&v, 0, sizeof(v));
+        v.f = f;
+        return rec_const(r, TYPE_FLOAT, v);
+}
+
+/*
+ * Emit an operation on registers @a and @b (for unary operations,
+ * pass @a twice), or if they're both constants, do it now.
+ */
+static int
+rec_op(struct trace_rec_t *r, int op, int type, int cc, int a, int b)
+{
+        if (a < 0 || b < 0)
+                return -1;
+
+        if (r->rconst[a] && r->rconst[b]) {
+                struct trace_ins_t ins = {
+                        .op = op, .cc = cc, .dst = 2, .a = 0, .b = 1
+                };
+                union trace_val_t tmp[3];
+
+                memset(tmp, 0, sizeof(tmp));
+                tmp[0] = r->rval[a];
+                tmp[1] = r->rval[b];
+                trace_step(&ins, tmp, NULL);
+                return rec_const(r, type, tmp[2]);
+        }
+        return rec_emit(r, op, type, cc, a, b);
+}
+
+/* convert @reg to @type, the way the right side of an operator is */
+static int
+rec_conv(struct trace_rec_t *r, int reg, int type)
+{
+        if (reg < 0 || r->rtype[reg] == type)
+                return reg;
+        return rec_op(r, type == TYPE_INT ? TR_F2I : TR_I2F,
+                      type, 0, reg, reg);
+}
+
+/* @reg as 0 or 1, the way qop_cmpz() would see it */
+static int
+rec_truth(struct trace_rec_t *r, int reg)
+{
+        if (reg < 0)
+                return -1;
+        return rec_op(r, r->rtype[reg] == TYPE_INT ? TR_NZ : TR_FNZ,
+                      TYPE_INT, 0, reg, reg);
+}
+
+static int
+rec_push(struct trace_rec_t *r, int kind, int type, int ref)
+{
+        struct trace_ent_t *e;
+
+        if (ref < 0 || r->sp >= FRAME_STACK_MAX)
+                return -1;
+        e = &r->stack[r->sp++];
+        e->kind = kind;
+        e->type = type;
+        e->ref = ref;
+        return 0;
+}
+
+/* push a register, or fail if @reg is -1 */
+static int
+rec_push_reg(struct trace_rec_t *r, int reg)
+{
+        if (reg < 0)
+                return -1;
+        return rec_push(r, TE_REG, r->rtype[reg], reg);
+}
+
+/* Return: what's been popped, or NULL if it's from before the loop */
+static struct trace_ent_t *
+rec_pop(struct trace_rec_t *r)
+{
+        if (r->sp <= 0)
+                return NULL;
+        return &r->stack[--r->sp];
+}
+
+/* Return: register holding the value of @e, or -1 */
+static int
+rec_value(struct trace_rec_t *r, struct trace_ent_t *e)
+{
+        int type;
+
+        if (!e)
+                return -1;
+
+        switch (e->kind) {
+        case TE_REG:
+                return e->ref;
+        case TE_SLOT:
+                if (r->slot_cur[e->ref] < 0) {
+                        type = r->slots[e->ref].type;
+                        r->slot_cur[e->ref] = rec_emit(r,
+                                type == TYPE_INT ? TR_LOADI : TR_LOADF,
+                                type, 0, e->ref, 0);
+                }
+                return r->slot_cur[e->ref];
+        case TE_LOCALREF:
+                e = &r->stack[e->ref];
+                /* fall through */
+        case TE_LOCAL:
+                return e->type == TYPE_EMPTY ? -1 : e->ref;
+        }
+        return -1;
+}
+
+/* store @reg to the variable @e points at */
+static int
+rec_store(struct trace_rec_t *r, struct trace_ent_t *e, int reg)
+{
+        struct trace_slot_t *s;
+
+        if (!e || reg < 0)
+                return -1;
+
+        switch (e->kind) {
+        case TE_SLOT:
+                s = &r->slots[e->ref];
+                reg = rec_conv(r, reg, s->type);
+                if (reg < 0 || rec_emit(r, s->type == TYPE_INT
+                                        ? TR_STOREI : TR_STOREF,
+                                        TYPE_EMPTY, 0, e->ref, reg) < 0) {
+                        return -1;
+                }
+                s->written = true;
+                r->slot_cur[e->ref] = reg;
+                return 0;
+        case TE_LOCALREF:
+                e = &r->stack[e->ref];
+                /* an empty local takes the type of what it's given */
+                if (e->type != TYPE_EMPTY)
+                        reg = rec_conv(r, reg, e->type);
+                if (reg < 0)
+                        return -1;
+                e->type = r->rtype[reg];
+                e->ref = reg;
+                return 0;
+        }
+        return -1;
+}
+
+/* IR for the binary operator @code with a left side of @type */
+static int
+binop_of(int code, int type)
+{
+        bool isint = type == TYPE_INT;
+
+        switch (code) {
+        case INSTR_ADD:
+        case INSTR_ASSIGN_ADD:
+                return isint ? TR_ADD : TR_FADD;
+        case INSTR_SUB:
+        case INSTR_ASSIGN_SUB:
+                return isint ? TR_SUB : TR_FSUB;
+        case INSTR_MUL:
+        case INSTR_ASSIGN_MUL:
+                return isint ? TR_MUL : TR_FMUL;
+        case INSTR_DIV:
+        case INSTR_ASSIGN_DIV:
+                return isint ? TR_DIV : TR_FDIV;
+        case INSTR_MOD:
+        case INSTR_ASSIGN_MOD:
+                return isint ? TR_MOD : -1;
+        case INSTR_LSHIFT:
+        case INSTR_ASSIGN_LS:
+                return isint ? TR_SHL : -1;
+        case INSTR_RSHIFT:
+        case INSTR_ASSIGN_RS:
+                return isint ? TR_SHR : -1;
+        case INSTR_BINARY_AND:
+        case INSTR_ASSIGN_AND:
+                return isint ? TR_AND : -1;
+        case INSTR_BINARY_OR:
+        case INSTR_ASSIGN_OR:
+                return isint ? TR_OR : -1;
+        case INSTR_BINARY_XOR:
+        case INSTR_ASSIGN_XOR:
+                return isint ? TR_XOR : -1;
+        }
+        return -1;
+}
+
+/* the result, like the types/ callbacks, has the type of @a */
+static int
+rec_binop(struct trace_rec_t *r, int code, int a, int b)
+{
+        int type, op;
+
+        if (a < 0 || b < 0)
+                return -1;
+        type = r->rtype[a];
+        op = binop_of(code, type);
+        if (op < 0)
+                return -1;
+        return rec_op(r, op, type, 0, a, rec_conv(r, b, type));
+}
+
+/* Return: the new exit's number, or -1 */
+static int
+rec_exit(struct trace_rec_t *r, int pc)
+{
+        struct trace_t *tr = r->tr;
+        struct trace_exit_t *x;
+
+        if (tr->n_exits >= TRACE_MAX_EXITS
+            || assert_array_pos(tr->n_exits, (void **)&tr->exits,
+                                &r->exit_alloc, sizeof(*x)) < 0) {
+                return -1;
+        }
+
+        x = &tr->exits[tr->n_exits];
+        x->pc = pc;
+        x->n_ent = r->sp;
+        x->ent = NULL;
+        if (r->sp) {
+                x->ent = emalloc(r->sp * sizeof(*x->ent));
+                memcpy(x->ent, r->stack, r->sp * sizeof(*x->ent));
+        }
+        x->n_blk = r->n_blk;
+        x->blk = NULL;
+        if (r->n_blk) {
+                x->blk = emalloc(r->n_blk * sizeof(*x->blk));
+                memcpy(x->blk, r->blk, r->n_blk * sizeof(*x->blk));
+        }
+        return tr->n_exits++;
+}
+
+static int
+rec_push_ptr(struct trace_rec_t *r, instruction_t ii)
+{
+        struct var_t *v = r->fr->stackptr[-1];
+        int i, idx = -1;
+
+        /* a local declared inside the loop */
+        if (ii.arg1 == IARG_PTR_AP)
+                idx = r->fr->ap + ii.arg2;
+        else if (ii.arg1 == IARG_PTR_FP)
+                idx = ii.arg2;
+        if (idx >= r->tr->depth) {
+                int pos = idx - r->tr->depth;
+                if (pos >= r->sp || r->stack[pos].kind != TE_LOCAL
+                    || v->magic != r->stack[pos].type) {
+                        return -1;
+                }
+                return rec_push(r, TE_LOCALREF, TYPE_EMPTY, pos);
+        }
+
+        if (!isnumvar(v))
+                return -1;
+        switch (ii.arg1) {
+        case IARG_PTR_AP:
+        case IARG_PTR_FP:
+        case IARG_PTR_CP:
+        case IARG_PTR_SEEK:
+                break;
+        default:
+                return -1;
+        }
+
+        for (i = 0; i < r->tr->n_slots; i++) {
+                if (r->slots[i].ii.arg1 == ii.arg1
+                    && r->slots[i].ii.arg2 == ii.arg2) {
+                        return rec_push(r, TE_SLOT, v->magic, i);
+                }
+                /* one variable by two names */
+                if (r->slotv[i] == v)
+                        return -1;
+        }
+        if (i >= TRACE_MAX_SLOTS)
+                return -1;
+
+        r->slots[i].ii = ii;
+        r->slots[i].type = v->magic;
+        r->slots[i].written = false;
+        r->slotv[i] = v;
+        r->slot_cur[i] = -1;
+        r->tr->n_slots++;
+        return rec_push(r, TE_SLOT, v->magic, i);
+}
+
+/* B or B_IF, after the handler has set the frame's ppii */
+static int
+rec_branch(struct trace_rec_t *r, instruction_t ii, int pc)
+{
+        int target = pc + 1 + ii.arg2;
+        bool taken = r->fr->ppii - r->ex->instr == target;
+        int cond, x;
+
+        /*
+         * A loop can have more than one backward branch, eg. a 'for'
+         * loop goes back to its increment and then back again to its
+         * condition, but one to somewhere we've already been is an
+         * inner loop.
+         */
+        if (taken && ii.arg2 < 0 && target != r->start && r->seen[target])
+                return -1;
+        if (ii.code == INSTR_B)
+                return 0;
+
+        cond = rec_value(r, rec_pop(r));
+        if (cond < 0)
+                return -1;
+        if (ii.arg2 == 0 || r->rconst[cond])
+                return 0;
+
+        if (r->rtype[cond] == TYPE_FLOAT)
+                cond = rec_truth(r, cond);
+        x = rec_exit(r, taken ? pc + 1 : target);
+        if (cond < 0 || x < 0)
+                return -1;
+        /* B_IF branches if the condition is the same as arg1 */
+        return rec_emit(r, TR_GUARD, TYPE_EMPTY,
+                        taken ? !!ii.arg1 : !ii.arg1, cond, x);
+}
+
+/*
+ * Translate @ii, which was at @pc and which the handler has just
+ * executed.
+ *
+ * Return: 0 if it's been recorded, -1 if the loop can't be traced
+ */
+static int
+rec_instr(struct trace_rec_t *r, instruction_t ii, int pc)
+{
+        struct vmframe_t *fr = r->fr;
+        struct trace_ent_t *e, *sav;
+        struct var_t *v;
+        int a, b;
+
+        switch (ii.code) {
+        case INSTR_NOP:
+                return 0;
+
+        case INSTR_PUSH_PTR:
+                return rec_push_ptr(r, ii);
+
+        case INSTR_PUSH_CONST:
+                v = fr->stackptr[-1];
+                if (v->magic == TYPE_INT)
+                        return rec_push_reg(r, rec_int(r, v->i));
+                if (v->magic == TYPE_FLOAT)
+                        return rec_push_reg(r, rec_float(r, v->f));
+                return -1;
+
+        case INSTR_PUSH_ZERO:
+                return rec_push_reg(r, rec_int(r, 0LL));
+
+        case INSTR_PUSH_LOCAL:
+                return rec_push(r, TE_LOCAL, TYPE_EMPTY, 0);
+
+        case INSTR_POP:
+                return rec_pop(r) ? 0 : -1;
+
+        case INSTR_UNWIND:
+                sav = rec_pop(r);
+                if (!sav || r->sp < ii.arg2)
+                        return -1;
+                r->sp -= ii.arg2;
+                r->stack[r->sp++] = *sav;
+                return 0;
+
+        case INSTR_PUSH_BLOCK:
+                if (r->n_blk >= FRAME_NEST_MAX)
+                        return -1;
+                r->blk[r->n_blk].level = r->sp;
+                r->blk[r->n_blk].type = ii.arg1;
+                r->n_blk++;
+                return 0;
+
+        case INSTR_POP_BLOCK:
+                if (r->n_blk <= 0)
+                        return -1;
+                r->n_blk--;
+                r->sp = r->blk[r->n_blk].level;
+                return 0;
+
+        case INSTR_ASSIGN:
+                if (!!(ii.arg1 & IARG_FLAG_CONST))
+                        return -1;
+                b = rec_value(r, rec_pop(r));
+                return rec_store(r, rec_pop(r), b);
+
+        case INSTR_ASSIGN_ADD:
+        case INSTR_ASSIGN_SUB:
+        case INSTR_ASSIGN_MUL:
+        case INSTR_ASSIGN_DIV:
+        case INSTR_ASSIGN_MOD:
+        case INSTR_ASSIGN_XOR:
+        case INSTR_ASSIGN_LS:
+        case INSTR_ASSIGN_RS:
+        case INSTR_ASSIGN_OR:
+        case INSTR_ASSIGN_AND:
+                b = rec_value(r, rec_pop(r));
+                e = rec_pop(r);
+                a = rec_value(r, e);
+                return rec_store(r, e, rec_binop(r, ii.code, a, b));
+
+        case INSTR_INCR:
+        case INSTR_DECR:
+                e = rec_pop(r);
+                a = rec_value(r, e);
+                if (a < 0)
+                        return -1;
+                if (r->rtype[a] == TYPE_INT) {
+                        b = rec_op(r, ii.code == INSTR_INCR
+                                   ? TR_ADD : TR_SUB,
+                                   TYPE_INT, 0, a, rec_int(r, 1LL));
+                } else {
+                        b = rec_op(r, ii.code == INSTR_INCR
+                                   ? TR_FADD : TR_FSUB,
+                                   TYPE_FLOAT, 0, a, rec_float(r, 1.0));
+                }
+                return rec_store(r, e, b);
+
+        case INSTR_MUL:
+        case INSTR_DIV:
+        case INSTR_MOD:
+        case INSTR_ADD:
+        case INSTR_SUB:
+        case INSTR_LSHIFT:
+        case INSTR_RSHIFT:
+        case INSTR_BINARY_AND:
+        case INSTR_BINARY_OR:
+        case INSTR_BINARY_XOR:
+                b = rec_value(r, rec_pop(r));
+                a = rec_value(r, rec_pop(r));
+                return rec_push_reg(r, rec_binop(r, ii.code, a, b));
+
+        case INSTR_CMP:
+                b = rec_value(r, rec_pop(r));
+                a = rec_value(r, rec_pop(r));
+                if (a < 0 || b < 0)
+                        return -1;
+                return rec_push_reg(r, rec_op(r,
+                                r->rtype[a] == TYPE_INT ? TR_CMP : TR_FCMP,
+                                TYPE_INT, ii.arg1, a,
+                                rec_conv(r, b, r->rtype[a])));
+
+        case INSTR_LOGICAL_OR:
+        case INSTR_LOGICAL_AND:
+                b = rec_truth(r, rec_value(r, rec_pop(r)));
+                a = rec_truth(r, rec_value(r, rec_pop(r)));
+                return rec_push_reg(r, rec_op(r,
+                                ii.code == INSTR_LOGICAL_OR ? TR_OR : TR_AND,
+                                TYPE_INT, 0, a, b));
+
+        case INSTR_LOGICAL_NOT:
+                a = rec_truth(r, rec_value(r, rec_pop(r)));
+                return rec_push_reg(r, rec_op(r, TR_XOR, TYPE_INT, 0,
+                                              a, rec_int(r, 1LL)));
+
+        case INSTR_BITWISE_NOT:
+                a = rec_value(r, rec_pop(r));
+                if (a < 0 || r->rtype[a] != TYPE_INT)
+                        return -1;
+                return rec_push_reg(r, rec_op(r, TR_NOT, TYPE_INT, 0, a, a));
+
+        case INSTR_NEGATE:
+                a = rec_value(r, rec_pop(r));
+                if (a < 0)
+                        return -1;
+                return rec_push_reg(r, rec_op(r,
+                                r->rtype[a] == TYPE_INT ? TR_NEG : TR_FNEG,
+                                r->rtype[a], 0, a, a));
+
+        case INSTR_B:
+        case INSTR_B_IF:
+                return rec_branch(r, ii, pc);
+        }
+        return -1;
+}
+
+/*
+ * Check that what the recorder thinks the VM has done is what it has
+ * actually done.  It always should be, but a trace that's wrong about
+ * it would do far more damage than one that's never used.
+ */
+static bool
+rec_check(struct trace_rec_t *r)
+{
+        struct vmframe_t *fr = r->fr;
+        int i;
+
+        if (fr->stackptr - fr->stack != r->tr->depth + r->sp
+            || fr->n_blocks != r->tr->n_blocks + r->n_blk) {
+                return false;
+        }
+        if (r->sp > 0 && r->stack[r->sp - 1].kind == TE_REG
+            && fr->stackptr[-1]->magic != r->stack[r->sp - 1].type) {
+                return false;
+        }
+        for (i = 0; i < r->tr->n_slots; i++) {
+                if (r->slotv[i]->magic != r->slots[i].type)
+                        return false;
+        }
+        return true;
+}
+
+/*
+ * Record one trip around the loop starting at @fr's ppii, executing
+ * it while we're at it.  Whether this succeeds or fails, the frame is
+ * left in a state where the interpreter can carry on.
+ *
+ * Return: the trace, or NULL if the loop could not be recorded
+ */
+static struct trace_t *
+trace_record(struct vmframe_t *fr, const struct trace_hooks_t *hooks)
+{
+        struct executable_t *ex = fr->ex;
+        struct trace_rec_t *r;
+        struct trace_t *tr;
+        bool ok = false;
+        int n;
+
+        r = ecalloc(sizeof(*r));
+        tr = ecalloc(sizeof(*tr));
+        r->fr = fr;
+        r->ex = ex;
+        r->tr = tr;
+        r->start = fr->ppii - ex->instr;
+        r->seen = ecalloc(ex->n_instr * sizeof(*r->seen));
+        tr->depth = fr->stackptr - fr->stack;
+        tr->n_blocks = fr->n_blocks;
+
+        recording = true;
+        for (n = 0;; n++) {
+                instruction_t ii;
+                int pc = fr->ppii - ex->instr;
+
+                if (n > 0 && pc == r->start) {
+                        ok = r->sp == 0 && r->n_blk == 0
+                             && rec_emit(r, TR_LOOP, TYPE_EMPTY,
+                                         0, 0, 0) >= 0;
+                        break;
+                }
+
+                ii = *fr->ppii;
+                if (n >= TRACE_MAX_INSTR || !TRACEABLE[ii.code])
+                        break;
+
+                r->seen[pc] = true;
+                fr->ppii++;
+                hooks->handlers[ii.code](fr, ii);
+                if (rec_instr(r, ii, pc) < 0 || !rec_check(r))
+                        break;
+        }
+        recording = false;
+
+        if (ok) {
+                if (tr->n_slots) {
+                        tr->slots = emalloc(tr->n_slots * sizeof(*tr->slots));
+                        memcpy(tr->slots, r->slots,
+                               tr->n_slots * sizeof(*tr->slots));
+                }
+        } else {
+                trace_free_one(tr);
+                tr = NULL;
+        }
+        free(r->seen);
+        free(r);
+        return tr;
+}
+
+/* Return: the loop at @pc, or NULL if there's no room for it */
+static struct trace_loop_t *
+trace_loop_get(struct executable_t *ex, int pc)
+{
+        struct trace_set_t *ts = ex->traces;
+        struct trace_loop_t *lp;
+        int i;
+
+        if (!ts)
+                ts = ex->traces = ecalloc(sizeof(*ts));
+
+        for (i = 0; i < ts->n_loops; i++) {
+                if (ts->loops[i].pc == pc)
+                        return &ts->loops[i];
+        }
+
+        if (assert_array_pos(ts->n_loops, (void **)&ts->loops,
+                             &ts->alloc, sizeof(*lp)) < 0) {
+                return NULL;
+        }
+        lp = &ts->loops[ts->n_loops++];
+        memset(lp, 0, sizeof(*lp));
+        lp->pc = pc;
+        return lp;
+}
+
+static void
+trace_drop(struct trace_loop_t *lp, bool dead)
+{
+        trace_free_one(lp->tr);
+        lp->tr = NULL;
+        lp->hot = 0;
+        if (dead || lp->n_rec >= TRACE_MAX_RECORD)
+                lp->dead = true;
+}
+
+/**
+ * trace_loop - Count a backward branch, and run its loop's trace if
+ *              it has one
+ * @fr:         Current frame, whose ppii has just been set to the top
+ *              of the loop
+ * @hooks:      What this needs from vm.c
+ *
+ * If a trace is run, @fr's stack and ppii are left where it exited.
+ */
+void
+trace_loop(struct vmframe_t *fr, const struct trace_hooks_t *hooks)
+{
+        struct executable_t *ex = fr->ex;
+        struct trace_loop_t *lp;
+        struct trace_t *tr;
+
+        if (recording)
+                return;
+
+        lp = trace_loop_get(ex, fr->ppii - ex->instr);
+        if (!lp || lp->dead)
+                return;
+
+        tr = lp->tr;
+        if (tr) {
+                if (!trace_enter(fr, tr, hooks)) {
+                        /* types changed since, record it again */
+                        trace_drop(lp, false);
+                } else if (tr->entries >= TRACE_TRIAL
+                           && tr->iters < 2 * tr->entries) {
+                        /*
+                         * It keeps leaving by a side exit, or the loop
+                         * is too short for entering it to pay.
+                         */
+                        trace_drop(lp, true);
+                }
+                return;
+        }
+
+        if (++lp->hot < TRACE_THRESHOLD)
+                return;
+        lp->hot = 0;
+        lp->n_rec++;
+        lp->tr = trace_record(fr, hooks);
+        /* we're at the top of the loop again, carry on in the trace */
+        if (!lp->tr)
+                lp->dead = true;
+        else if (!trace_enter(fr, lp->tr, hooks))
+                trace_drop(lp, false);
+}
+
+/**
+ * trace_free - Free an executable's traces
+ * @ts: The executable's @traces
+ */
+void
+trace_free(struct trace_set_t *ts)
+{
+        int i;
+
+        for (i = 0; i < ts->n_loops; i++) {
+                if (ts->loops[i].tr)
+                        trace_free_one(ts->loops[i].tr);
+        }
+        if (ts->loops)
+                free(ts->loops);
+        free(ts);
+}
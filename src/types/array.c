@@ -13,6 +13,7 @@
  *              keep figuring it out from @type all the time)
  */
 struct array_handle_t {
+        struct gc_head_t gc;
         int type, lock;
         unsigned int nmemb;
         struct buffer_t children;
@@ -27,20 +28,60 @@ check_type_match(struct array_handle_t *h, struct var_t *child)
         }
 }
 
+/* drop the references array_add_child() took */
+static void
+array_drop_children(struct array_handle_t *ah)
+{
+        struct var_t **ppvar = (struct var_t **)ah->children.s;
+        unsigned int i, n = ah->nmemb;
+
+        ah->nmemb = 0;
+        for (i = 0; i < n; i++)
+                VAR_DECR_REF(ppvar[i]);
+        buffer_free(&ah->children);
+}
+
 static void
 array_handle_reset(void *arr)
 {
         struct array_handle_t *ah = (struct array_handle_t *)arr;
-        buffer_free(&ah->children);
+        gc_untrack(&ah->gc);
+        array_drop_children(ah);
 }
 
+/* gc_ops_t callbacks */
+static void
+array_gc_traverse(void *arr, void (*visit)(struct var_t *, void *),
+                  void *arg)
+{
+        struct array_handle_t *ah = (struct array_handle_t *)arr;
+        struct var_t **ppvar = (struct var_t **)ah->children.s;
+        unsigned int i;
+
+        for (i = 0; i < ah->nmemb; i++)
+                visit(ppvar[i], arg);
+}
+
+static void
+array_gc_clear(void *arr)
+{
+        array_drop_children((struct array_handle_t *)arr);
+}
+
+static const struct gc_ops_t array_gc_ops = {
+        .traverse       = array_gc_traverse,
+        .clear          = array_gc_clear,
+};
+
 static struct array_handle_t *
 array_handle_new(void)
 {
         struct array_handle_t *ret = type_handle_new(sizeof(*ret),
+                                                     MS_LIST,
                                                      array_handle_reset);
         ret->type = TYPE_EMPTY;
         buffer_init(&ret->children);
+        gc_track(&ret->gc, &array_gc_ops);
         return ret;
 }
 
@@ -37,7 +37,7 @@ float_div(struct var_t *a, struct var_t *b)
         if (fpclassify(f) != FP_NORMAL)
                 return float_new(0.);
         else
-                return float_new(a->f /= f);
+                return float_new(a->f / f);
 }
 
 static struct var_t *
@@ -27,6 +27,7 @@
  * @f_argc:     Highest argument number that has a default
  */
 struct function_handle_t {
+        struct gc_head_t gc;
         enum {
                 FUNC_INTERNAL = 1,
                 FUNC_USER,
@@ -66,17 +67,57 @@ static void
 function_handle_reset(void *h)
 {
         struct function_handle_t *fh = h;
+        gc_untrack(&fh->gc);
         remove_args(fh->f_argv, fh->f_argc);
         remove_args(fh->f_clov, fh->f_cloc);
         if (fh->f_magic == FUNC_USER && fh->f_ex)
                 EXECUTABLE_RELEASE(fh->f_ex);
 }
 
+/* gc_ops_t callbacks: default args and closures */
+static void
+function_gc_traverse(void *h, void (*visit)(struct var_t *, void *),
+                     void *arg)
+{
+        struct function_handle_t *fh = h;
+        int i;
+
+        for (i = 0; i < fh->f_argc; i++) {
+                if (fh->f_argv[i])
+                        visit(fh->f_argv[i], arg);
+        }
+        for (i = 0; i < fh->f_cloc; i++)
+                visit(fh->f_clov[i], arg);
+}
+
+static void
+function_gc_clear(void *h)
+{
+        struct function_handle_t *fh = h;
+        struct var_t **argv = fh->f_argv, **clov = fh->f_clov;
+        int argc = fh->f_argc, cloc = fh->f_cloc;
+
+        fh->f_argv = fh->f_clov = NULL;
+        fh->f_argc = fh->f_cloc = 0;
+        fh->f_arg_alloc = fh->f_clo_alloc = 0;
+        remove_args(argv, argc);
+        remove_args(clov, cloc);
+}
+
+static const struct gc_ops_t function_gc_ops = {
+        .traverse       = function_gc_traverse,
+        .clear          = function_gc_clear,
+};
+
 static struct function_handle_t *
 function_handle_new(void)
 {
-        return type_handle_new(sizeof(struct function_handle_t),
-                               function_handle_reset);
+        struct function_handle_t *fh;
+
+        fh = type_handle_new(sizeof(struct function_handle_t),
+                             MS_FUNCTION, function_handle_reset);
+        gc_track(&fh->gc, &function_gc_ops);
+        return fh;
 }
 
 /*
@@ -149,8 +190,26 @@ function_prep_frame(struct var_t *fn,
         VAR_INCR_REF(owner);
         VAR_INCR_REF(fn);
 
-        if (fh->f_magic == FUNC_USER)
+        if (fh->f_magic == FUNC_USER) {
+                if (fh->f_ex->lazy)
+                        assemble_lazy(fh->f_ex);
                 fr->ex = fh->f_ex;
+                /*
+                 * Args left out with no default are empty, like
+                 * 'let x;', so PUSH_PTR FP never reads past them.
+                 */
+                while (fr->ap < fr->ex->n_args)
+                        fr->stack[fr->ap++] = var_new();
+                /*
+                 * Only check once per call.  The assembler proved
+                 * max_stack, so the pushes needn't check for themselves.
+                 */
+                if (fr->ap + fr->ex->max_stack > FRAME_STACK_MAX)
+                        syntax("Frame stack overflow");
+                /* ditto PUSH_PTR CP, see evcc_instr_ok() */
+                if (fh->f_cloc < fr->ex->n_closures)
+                        syntax("Function is missing closures");
+        }
         return fr->func;
 }
 
@@ -32,7 +32,17 @@ static const struct operator_methods_t strptr_primitives = {
         .cmp = strptr_cmp,
 };
 
-static const struct operator_methods_t no_primitives = { 0 };
+/* the constant DEFFUNC makes functions from owns their code */
+static void
+xptr_reset(struct var_t *v)
+{
+        EXECUTABLE_RELEASE(v->xptr);
+        v->xptr = NULL;
+}
+
+static const struct operator_methods_t xptr_primitives = {
+        .reset = xptr_reset,
+};
 
 static const struct type_inittbl_t no_methods[] = {
         TBLEND,
@@ -44,6 +54,6 @@ typedefinit_intl(void)
         var_config_type(TYPE_STRPTR, "[internal-use string]",
                         &strptr_primitives, no_methods);
         var_config_type(TYPE_XPTR, "[internal-use executable]",
-                        &no_primitives, no_methods);
+                        &xptr_primitives, no_methods);
 }
 
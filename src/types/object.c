@@ -5,6 +5,12 @@
 static inline size_t oh_nchildren(struct object_handle_t *oh)
         { return oh->nchildren; }
 
+/* never reused, see comments to struct object_handle_t */
+static unsigned long long object_version_seq = 0;
+
+static inline void oh_new_version(struct object_handle_t *oh)
+        { oh->version = ++object_version_seq; }
+
 /* **********************************************************************
  *                              API functions
  ***********************************************************************/
@@ -13,6 +19,7 @@ static void
 object_handle_reset(void *h)
 {
         struct object_handle_t *oh = h;
+        gc_untrack(&oh->gc);
         if (oh->priv) {
                 if (oh->priv_cleanup)
                         oh->priv_cleanup(oh, oh->priv);
@@ -22,6 +29,42 @@ object_handle_reset(void *h)
         hashtable_destroy(&oh->dict);
 }
 
+/* the dictionary's hold on a name, see object_add_child() */
+static void
+object_key_delete(void *key)
+{
+        literal_decr_ref(key);
+}
+
+/* gc_ops_t callbacks */
+static void
+object_gc_traverse(void *h, void (*visit)(struct var_t *, void *),
+                   void *arg)
+{
+        struct object_handle_t *oh = h;
+        unsigned int idx = 0;
+        void *key, *child;
+
+        while (hashtable_iterate(&oh->dict, &key, &child, &idx) == 0)
+                visit((struct var_t *)child, arg);
+}
+
+static void
+object_gc_clear(void *h)
+{
+        struct object_handle_t *oh = h;
+
+        /* its children may be reached again while this is going on */
+        oh->nchildren = 0;
+        oh_new_version(oh);
+        hashtable_clear_entries(&oh->dict);
+}
+
+static const struct gc_ops_t object_gc_ops = {
+        .traverse       = object_gc_traverse,
+        .clear          = object_gc_clear,
+};
+
 /**
  * object_init - Convert an empty variable into an initialized
  *                      object type.
@@ -35,9 +78,13 @@ object_init(struct var_t *o)
         bug_on(o->magic != TYPE_EMPTY);
         o->magic = TYPE_DICT;
 
-        o->o = type_handle_new(sizeof(*o->o), object_handle_reset);
+        o->o = type_handle_new(sizeof(*o->o), MS_DICT,
+                               object_handle_reset);
         hashtable_init(&o->o->dict, ptr_hash,
                        ptr_key_match, var_bucket_delete);
+        o->o->dict.delete_key = object_key_delete;
+        oh_new_version(o->o);
+        gc_track(&o->o->gc, &object_gc_ops);
         return o;
 }
 
@@ -74,7 +121,10 @@ object_child_l(struct var_t *o, const char *s)
  * object_add_child - Append a child to an object
  * @parent: object to append a child to
  * @child: child to append to @parent
- * @name: Name of the child.
+ * @name: Name of the child, a return value of literal() or one of its
+ *        relatives.  The entry holds a reference to it until it's
+ *        removed, so a name made at run time is freed with the last
+ *        entry using it, see literal.c.
  */
 void
 object_add_child(struct var_t *parent, struct var_t *child, char *name)
@@ -84,8 +134,10 @@ object_add_child(struct var_t *parent, struct var_t *child, char *name)
                 syntax("Dictionary add/remove locked");
         if (hashtable_put(&parent->o->dict, name, child) < 0)
                 syntax("Object already has element named %s", name);
+        literal_incr_ref(name);
         VAR_INCR_REF(child);
         parent->o->nchildren++;
+        oh_new_version(parent->o);
 }
 
 /* if @child is known to be a direct child of @parent */
@@ -94,6 +146,7 @@ object_remove_child_(struct var_t *parent, struct var_t *child)
 {
         VAR_DECR_REF(child);
         parent->o->nchildren--;
+        oh_new_version(parent->o);
 }
 
 /**
@@ -114,8 +167,11 @@ object_remove_child_l(struct var_t *parent, const char *name)
          * XXX REVISIT: If !child, should I throw a doesn't-exist error,
          * or should I silently ignore it like this?
          */
-        if (child)
+        if (child) {
                 object_remove_child_(parent, child);
+                /* could free @name, so last */
+                literal_decr_ref(name);
+        }
 }
 
 
@@ -279,7 +335,10 @@ object_setattr(struct var_t *ret)
                 /* could throw a type-mismatch error */
                 qop_mov(attr, value);
         } else {
-                object_add_child(self, value, literal_put(s));
+                /* @s is the user's, don't keep it forever */
+                s = literal_put_ref(s);
+                object_add_child(self, value, s);
+                literal_decr_ref(s);
         }
 }
 
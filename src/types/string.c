@@ -47,7 +47,7 @@ static struct string_handle_t *
 new_string_handle(void)
 {
         struct string_handle_t *ret = type_handle_new(sizeof(*ret),
-                                                string_handle_reset);
+                                                MS_STRING, string_handle_reset);
         buffer_init(&ret->b);
         string_clear_info(&ret->s_info);
         return ret;
@@ -1121,6 +1121,8 @@ string_init_from_file(struct var_t *ret, FILE *fp, int delim, bool stuff_delim)
         }
         if (stuff_delim && c == delim)
                 buffer_putc(buf, c);
+        /* an empty line still has to be a C string for utf8_scan() */
+        buffer_putc(buf, '\0');
         utf8_scan(buf->s, &ret->s->s_info);
 }
 
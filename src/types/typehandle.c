@@ -1,9 +1,11 @@
 #include "var.h"
 #include <stdlib.h>
+#include <string.h>
 
 /**
  * type_handle_new - allocate a type-specific handle.
  * @size: Size of the handle
+ * @kind: Which of memstats[] to count it in, MS_DICT, MS_LIST, etc.
  * @destructor: Callback to destroy the handle (short of freeing it,
  *      don't do that)
  *
@@ -12,11 +14,21 @@
  * of the GC.
  */
 void *
-type_handle_new(size_t size, void (*destructor)(void *))
+type_handle_new(size_t size, int kind, void (*destructor)(void *))
 {
-        struct type_handle_preheader_t_ *ph = ecalloc(sizeof(*ph) + size);
+        struct type_handle_preheader_t_ *ph;
+
+        size += sizeof(*ph);
+        bug_on(size > MEM_MAX_CLASS);
+        ph = mem_alloc(size);
+        memset(ph, 0, size);
         ph->nref = 1;
         ph->destructor = destructor;
+        ph->size = size;
+        ph->kind = kind;
+        memstat_alloc(kind, size);
+        if (q_.opt.prof_alloc)
+                allocprof_record(size);
         return (void *)(ph + 1);
 }
 
@@ -29,6 +41,7 @@ type_handle_destroy__(struct type_handle_preheader_t_ *ph)
 {
         if (ph->destructor)
                 ph->destructor((void *)(ph + 1));
-        free(ph);
+        memstat_free(ph->kind, ph->size);
+        mem_free(ph, ph->size);
 }
 
@@ -33,6 +33,8 @@ struct type_inittbl_t {
 struct type_handle_preheader_t_ {
         void (*destructor)(void *);
         int nref;
+        unsigned short size;
+        unsigned short kind;
 };
 
 /* array.c */
@@ -65,7 +67,8 @@ extern void var_config_type(int magic, const char *name,
                             const struct type_inittbl_t *tbl);
 
 /* typehandle.c */
-extern void *type_handle_new(size_t size, void (*destructor)(void *));
+extern void *type_handle_new(size_t size, int kind,
+                             void (*destructor)(void *));
 
 /*
  * Call this for MOV operations, but not after type_handle_new,
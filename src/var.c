@@ -13,37 +13,23 @@
  *      Use stdlib's malloc() and free().
  *
  * SIMPLE_ALLOC = 0
- *      Whenever I run out of stock, allocate a block of them (don't keep
- *      track of the base pointers, I'll just keep them forever), and put
- *      them in a singly-linked list of available variable structs.
- *
- *      Corner case: If a dictionary allocates a gazillion of these and
- *      then frees them all when it goes out of scope, and then no one
- *      else claims so many...
- *              good:   we'd never have to malloc again
- *              bad:    we'd probably be wasting RAM and swapping a lot.
- *
- * Don't use the memblk.c lib for this.  When the number of variables
- * required got super high, the library got cripplingly slow.
+ *      Use mem_alloc() and mem_free(), the same size-class allocator
+ *      as type handles, hash table buckets, and buffers, see
+ *      mempool.c.  Both are constant time no matter how many
+ *      variables there are.
  */
 #define SIMPLE_ALLOC 0
 
+#define REGISTER_ALLOC() memstat_alloc(MS_VAR, sizeof(struct var_t))
+#define REGISTER_FREE()  memstat_free(MS_VAR, sizeof(struct var_t))
+
 #ifndef NDEBUG
-static size_t var_nalloc = 0;
-# define REGISTER_ALLOC() do { \
-        var_nalloc += sizeof(struct var_t); \
-} while (0)
-# define REGISTER_FREE() do { \
-        var_nalloc -= sizeof(struct var_t); \
-} while (0)
 static void
 var_alloc_tell(void)
 {
-        fprintf(stderr, "var_alloc_size = %lu\n", (long)var_nalloc);
+        fprintf(stderr, "var_alloc_size = %lu\n",
+                (long)memstats[MS_VAR].bytes);
 }
-#else /* NDEBUG */
-# define REGISTER_ALLOC() do { (void)0; } while (0)
-# define REGISTER_FREE() do { (void)0; } while (0)
 #endif /* NDEBUG */
 
 #if SIMPLE_ALLOC
@@ -62,50 +48,21 @@ var_free(struct var_t *v)
         free(v);
 }
 #else
-static struct var_mem_t *var_freelist = NULL;
-struct var_mem_t {
-        struct var_mem_t *list;
-        struct var_t var;
-};
-
-#define list2memvar(li) container_of(li, struct var_mem_t, list)
-#define var2memvar(v) container_of(v, struct var_mem_t, var)
-
-static void
-var_more_(void)
-{
-        enum { NPERBLK = 64 };
-        int i;
-        struct var_mem_t *blk = emalloc(sizeof(*blk) * NPERBLK);
-        for (i = 0; i < NPERBLK; i++) {
-                blk[i].list = var_freelist;
-                var_freelist = &blk[i];
-        }
-}
-
 static struct var_t *
 var_alloc(void)
 {
-        struct var_mem_t *vm;
+        struct var_t *v = mem_alloc(sizeof(*v));
         REGISTER_ALLOC();
-        if (!var_freelist)
-                var_more_();
-
-        vm = list2memvar(var_freelist);
-        var_freelist = vm->list;
-        vm->var.refcount = 1;
-        return &vm->var;
+        v->refcount = 1;
+        return v;
 }
 
 static void
 var_free(struct var_t *v)
 {
-        struct var_mem_t *vm;
         REGISTER_FREE();
         bug_on(v->refcount != 0);
-        vm = var2memvar(v);
-        vm->list = var_freelist;
-        var_freelist = vm;
+        mem_free(v, sizeof(*v));
 }
 
 #endif /* !SIMPLE_ALLOC */
@@ -117,6 +74,8 @@ struct var_t *
 var_new(void)
 {
         struct var_t *v = var_alloc();
+        if (q_.opt.prof_alloc)
+                allocprof_record(sizeof(*v));
         /* var_alloc took care of refcount already */
         v->magic = TYPE_EMPTY;
         v->flags = 0;
@@ -143,7 +102,7 @@ var_delete__(struct var_t *v)
 void
 var_reset(struct var_t *v)
 {
-        if ((unsigned)v->magic < NTYPES_USER) {
+        if ((unsigned)v->magic < NTYPES) {
                 void (*rst)(struct var_t *) = TYPEDEFS[v->magic].opm->reset;
                 if (rst)
                         rst(v);
@@ -178,7 +137,8 @@ config_builtin_methods(const struct type_inittbl_t *tbl,
  * @opm:        Operator methods, ie. what to do when encountering things
  *              like '+', '-', '%'...
  * @tbl:        Table of additional built-in methods that can be called
- *              by name from a user script.
+ *              by name from a user script.  The methods are not built
+ *              from it until a script first looks one up.
  *
  * This is called once for each built-in type, see the typedefinit_*()
  * functions in types/...c
@@ -194,8 +154,22 @@ var_config_type(int magic, const char *name,
         bug_on(TYPEDEFS[magic].opm || TYPEDEFS[magic].name);
         TYPEDEFS[magic].opm = opm;
         TYPEDEFS[magic].name = name;
-        if (tbl)
-                config_builtin_methods(tbl, &TYPEDEFS[magic].methods);
+        TYPEDEFS[magic].methods_tbl = tbl;
+}
+
+/* fill in @v's type's built-in methods if this is the first time */
+static void
+builtin_methods_assert(struct var_t *v)
+{
+        struct type_t *t;
+
+        if ((unsigned)v->magic >= NTYPES_USER)
+                return;
+        t = &TYPEDEFS[v->magic];
+        if (t->methods_tbl) {
+                config_builtin_methods(t->methods_tbl, &t->methods);
+                t->methods_tbl = NULL;
+        }
 }
 
 static struct var_t *
@@ -205,6 +179,7 @@ builtin_method_l(struct var_t *v, const char *method_name)
         if ((unsigned)magic >= NTYPES_USER || !method_name)
                 return NULL;
 
+        builtin_methods_assert(v);
         return hashtable_get(&TYPEDEFS[magic].methods, method_name);
 }
 
@@ -284,6 +259,11 @@ attr_by_string_l(struct var_t *v, const char *s)
 static struct var_t *
 attr_by_string(struct var_t *v, const char *s)
 {
+        /*
+         * The method names aren't literal()s until the table is
+         * filled, so do that first or literal() could miss them.
+         */
+        builtin_methods_assert(v);
         return attr_by_string_l(v, literal(s));
 }
 
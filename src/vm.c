@@ -17,9 +17,14 @@ static struct vmframe_t *current_frame;
 
 /* XXX arbitrary */
 static struct hashtable_t *symbol_table;
+/* Changes whenever symbol_table gets a new entry */
+static unsigned long long symbol_table_version;
 
 #define list2vmf(li) container_of(li, struct vmframe_t, list)
 
+static void jit_tick(struct executable_t *ex);
+static void back_edge(struct vmframe_t *fr);
+
 #define PUSH_(fr, v) \
         do { *((fr)->stackptr)++ = (v); } while (0)
 #define POP_(fr) (*--((fr)->stackptr))
@@ -33,7 +38,10 @@ static inline struct var_t *pop(struct vmframe_t *fr)
         { return POP_(fr); }
 
 static inline struct var_t *RODATA(struct vmframe_t *fr, instruction_t ii)
-        { return fr->ex->rodata[ii.arg2]; }
+{
+        struct var_t *v = fr->ex->rodata[ii.arg2];
+        return v ? v : evcc_rodata(fr->ex, ii.arg2);
+}
 static inline char *RODATA_STR(struct vmframe_t *fr, instruction_t ii)
         { return RODATA(fr, ii)->strptr; }
 
@@ -56,8 +64,11 @@ pop(struct vmframe_t *fr)
 static inline struct var_t *
 RODATA(struct vmframe_t *fr, instruction_t ii)
 {
+        struct var_t *v;
         bug_on(ii.arg2 >= fr->ex->n_rodata);
-        return fr->ex->rodata[ii.arg2];
+        v = fr->ex->rodata[ii.arg2];
+        /* not built yet, if @ex came from a byte-code image */
+        return v ? v : evcc_rodata(fr->ex, ii.arg2);
 }
 
 static inline char *
@@ -116,6 +127,75 @@ symbol_seek(const char *s)
         return ret;
 }
 
+/*
+ * Lookup caches, see struct lookup_cache_t.  Entries are only ever
+ * compared, so a stale entry costs nothing but the lookup it failed
+ * to save.  Only names get cached, since a GETATTR whose key came off
+ * the stack could be anything.
+ */
+static struct lookup_cache_t *
+lookup_cache(struct executable_t *ex, struct lookup_cache_t **arr,
+             instruction_t ii)
+{
+        bug_on(ii.arg2 >= ex->n_rodata);
+        if (!*arr)
+                *arr = ecalloc(ex->n_rodata * sizeof(**arr));
+        return &(*arr)[ii.arg2];
+}
+
+static struct var_t *
+symbol_seek_cached(struct vmframe_t *fr, instruction_t ii)
+{
+        struct lookup_cache_t *c;
+        struct object_handle_t *oh = NULL;
+        struct var_t *this = get_this();
+        unsigned long long ver = 0;
+        int magic = TYPE_EMPTY;
+
+        c = lookup_cache(fr->ex, &fr->ex->seek_cache, ii);
+        if (this) {
+                magic = this->magic;
+                if (magic == TYPE_DICT) {
+                        oh = this->o;
+                        ver = oh->version;
+                }
+        }
+
+        if (!c->v || c->oh != oh || c->ver != ver || c->magic != magic
+            || c->gver[0] != symbol_table_version
+            || c->gver[1] != q_.gbl->o->version) {
+                c->v = symbol_seek(RODATA_STR(fr, ii));
+                c->oh = oh;
+                c->ver = ver;
+                c->magic = magic;
+                c->gver[0] = symbol_table_version;
+                c->gver[1] = q_.gbl->o->version;
+        }
+        return c->v;
+}
+
+static struct var_t *
+attr_get_cached(struct vmframe_t *fr, instruction_t ii, struct var_t *obj)
+{
+        struct lookup_cache_t *c;
+        struct object_handle_t *oh = NULL;
+        unsigned long long ver = 0;
+
+        c = lookup_cache(fr->ex, &fr->ex->attr_cache, ii);
+        if (obj->magic == TYPE_DICT) {
+                oh = obj->o;
+                ver = oh->version;
+        }
+
+        if (!c->v || c->oh != oh || c->ver != ver || c->magic != obj->magic) {
+                c->v = evar_get_attr(obj, RODATA(fr, ii));
+                c->oh = oh;
+                c->ver = ver;
+                c->magic = obj->magic;
+        }
+        return c->v;
+}
+
 static struct list_t vframe_free_list = LIST_INIT(&vframe_free_list);
 
 static struct vmframe_t *
@@ -129,15 +209,22 @@ vmframe_alloc(void)
         } else {
                 ret = container_of(li, struct vmframe_t, alloc_list);
                 list_remove(li);
+                memstats[MS_FRAME].n_cached--;
 #ifndef NDEBUG
                 bug_on(!ret->freed);
 #endif
-                memset(ret, 0, sizeof(*ret));
+                /*
+                 * Slots above stackptr and n_blocks are never read
+                 * before they are written (the assembler proved as
+                 * much), so only clear the header.
+                 */
+                memset(ret, 0, offsetof(struct vmframe_t, stack));
                 list_init(&ret->alloc_list);
         }
 #ifndef NDEBUG
         ret->freed = false;
 #endif
+        memstat_alloc(MS_FRAME, sizeof(*ret));
         return ret;
 }
 
@@ -156,10 +243,9 @@ vmframe_free(struct vmframe_t *fr)
 #endif
 
         /*
-         * XXX REVISIT: if (fr->stackptr != &fr->stack[fr->ap]),
-         * there is a stack inbalance.  But how to tell if this
-         * is due to an abrubt 'return' (which would cause this),
-         * or a bug (which also cause this)?
+         * If (fr->stackptr != &fr->stack[fr->ap]), it's because of
+         * locals or an abrupt 'return'.  It can't be a stack imbalance,
+         * since verify_stack() in assembler.c rejects those.
          */
 
         /*
@@ -174,6 +260,8 @@ vmframe_free(struct vmframe_t *fr)
         if (fr->func)
                 VAR_DECR_REF(fr->func);
         list_add_tail(&fr->alloc_list, &vframe_free_list);
+        memstat_free(MS_FRAME, sizeof(*fr));
+        memstats[MS_FRAME].n_cached++;
 }
 
 static inline __attribute__((always_inline)) struct var_t *
@@ -186,10 +274,8 @@ VARPTR(struct vmframe_t *fr, instruction_t ii)
                 return fr->stack[ii.arg2];
         case IARG_PTR_CP:
                 return fr->clo[ii.arg2];
-        case IARG_PTR_SEEK: {
-                char *name = RODATA_STR(fr, ii);
-                return symbol_seek(name);
-        }
+        case IARG_PTR_SEEK:
+                return symbol_seek_cached(fr, ii);
         case IARG_PTR_GBL:
                 return q_.gbl;
         case IARG_PTR_THIS:
@@ -200,11 +286,15 @@ VARPTR(struct vmframe_t *fr, instruction_t ii)
         return NULL;
 }
 
+/*
+ * The assembler has already proven that blocks are balanced and never
+ * nested more than FRAME_NEST_MAX deep, so these only check in debug
+ * mode.
+ */
 static struct block_t *
 vmframe_pop_block(struct vmframe_t *fr)
 {
-        if (fr->n_blocks <= 0)
-                syntax("Frame stack underflow");
+        bug_on(fr->n_blocks <= 0);
 
         fr->n_blocks--;
         return &fr->blocks[fr->n_blocks];
@@ -214,8 +304,7 @@ static void
 vmframe_push_block(struct vmframe_t *fr, unsigned char reason)
 {
         struct block_t *bl;
-        if (fr->n_blocks >= FRAME_NEST_MAX)
-                syntax("Frame stack overflow");
+        bug_on(fr->n_blocks >= FRAME_NEST_MAX);
         bl = &fr->blocks[fr->n_blocks];
         bl->stack_level = fr->stackptr;
         bl->type = reason;
@@ -245,6 +334,7 @@ vmframe_unwind_block(struct vmframe_t *fr, struct block_t *bl)
         struct var_t *v = pop(fr);      \
         struct var_t *ret = op(v);      \
         push(fr, ret);                  \
+        VAR_DECR_REF(v);                \
 } while (0)
 #define assign_common(fr, op) do {      \
         struct var_t *from, *to, *res;  \
@@ -257,6 +347,64 @@ vmframe_unwind_block(struct vmframe_t *fr, struct block_t *bl)
         VAR_DECR_REF(from);             \
 } while (0)
 
+/*
+ * Temporaries, the results of an operation which are only going to be
+ * used once more, are the most common variables by far.  Integer and
+ * float arithmetic can often reuse one for its own result instead of
+ * making a new one and deleting the old one.
+ *
+ * temp_lval() returns the left operand of a binary operation if that's
+ * possible: it's a temporary--nothing but the stack has a reference to
+ * it, so it was about to be deleted anyway--and it's the same type of
+ * number as the right operand.  Otherwise it returns NULL, and the
+ * operation has to be done the usual way.
+ *
+ * assign_lval() is the same for a += b and its kin, where the result
+ * goes into a anyway, unless it's a const.
+ */
+static inline struct var_t *
+temp_lval(struct vmframe_t *fr)
+{
+        struct var_t *lval = fr->stackptr[-2];
+        struct var_t *rval = fr->stackptr[-1];
+
+        if (lval->refcount != 1 || lval->flags != 0
+            || lval->magic != rval->magic) {
+                return NULL;
+        }
+        if (lval->magic != TYPE_INT && lval->magic != TYPE_FLOAT)
+                return NULL;
+        return lval;
+}
+
+static inline struct var_t *
+assign_lval(struct vmframe_t *fr)
+{
+        struct var_t *to = fr->stackptr[-2];
+        struct var_t *from = fr->stackptr[-1];
+
+        if (isconst(to) || to->magic != from->magic)
+                return NULL;
+        if (to->magic != TYPE_INT && to->magic != TYPE_FLOAT)
+                return NULL;
+        return to;
+}
+
+/* done with the operands of an in-place operation, leave @lval */
+static inline void
+pop_rval(struct vmframe_t *fr)
+{
+        VAR_DECR_REF(pop(fr));
+}
+
+/* same, for an in-place assignment, leave nothing */
+static inline void
+pop_assign(struct vmframe_t *fr)
+{
+        VAR_DECR_REF(pop(fr));
+        VAR_DECR_REF(pop(fr));
+}
+
 static inline struct var_t *
 logical_or(struct var_t *a, struct var_t *b)
 {
@@ -307,7 +455,14 @@ do_push_local(struct vmframe_t *fr, instruction_t ii)
 static void
 do_push_const(struct vmframe_t *fr, instruction_t ii)
 {
-        struct var_t *v = qop_mov(var_new(), RODATA(fr, ii));
+        struct var_t *v;
+
+        if (ii.arg1 == IARG_CONST_SHARE) {
+                v = RODATA(fr, ii);
+                VAR_INCR_REF(v);
+        } else {
+                v = qop_mov(var_new(), RODATA(fr, ii));
+        }
         push(fr, v);
 }
 
@@ -382,18 +537,45 @@ do_assign(struct vmframe_t *fr, instruction_t ii)
 static void
 do_assign_add(struct vmframe_t *fr, instruction_t ii)
 {
+        struct var_t *to = assign_lval(fr);
+        if (to) {
+                if (to->magic == TYPE_INT)
+                        to->i += fr->stackptr[-1]->i;
+                else
+                        to->f += fr->stackptr[-1]->f;
+                pop_assign(fr);
+                return;
+        }
         assign_common(fr, qop_add);
 }
 
 static void
 do_assign_sub(struct vmframe_t *fr, instruction_t ii)
 {
+        struct var_t *to = assign_lval(fr);
+        if (to) {
+                if (to->magic == TYPE_INT)
+                        to->i -= fr->stackptr[-1]->i;
+                else
+                        to->f -= fr->stackptr[-1]->f;
+                pop_assign(fr);
+                return;
+        }
         assign_common(fr, qop_sub);
 }
 
 static void
 do_assign_mul(struct vmframe_t *fr, instruction_t ii)
 {
+        struct var_t *to = assign_lval(fr);
+        if (to) {
+                if (to->magic == TYPE_INT)
+                        to->i *= fr->stackptr[-1]->i;
+                else
+                        to->f *= fr->stackptr[-1]->f;
+                pop_assign(fr);
+                return;
+        }
         assign_common(fr, qop_mul);
 }
 
@@ -444,6 +626,7 @@ do_symtab(struct vmframe_t *fr, instruction_t ii)
 {
         char *s = RODATA_STR(fr, ii);
         hashtable_put(symbol_table, s, var_new());
+        symbol_table_version++;
 }
 
 static void
@@ -527,14 +710,18 @@ do_call_func(struct vmframe_t *fr, instruction_t ii)
                  */
                 bug_on(!fr_new->ex);
                 fr_new->ppii = fr_new->ex->instr;
+                jit_tick(fr_new->ex);
         }
 }
 
 static void
 do_deffunc(struct vmframe_t *fr, instruction_t ii)
 {
-        struct var_t *func = var_new();
-        struct var_t *loc = RODATA(fr, ii);
+        struct var_t *func, *loc;
+
+        gc_maybe_collect();
+        func = var_new();
+        loc = RODATA(fr, ii);
         bug_on(loc->magic != TYPE_XPTR);
         function_init(func, loc->xptr);
         push(fr, func);
@@ -568,7 +755,10 @@ do_add_default(struct vmframe_t *fr, instruction_t ii)
 static void
 do_deflist(struct vmframe_t *fr, instruction_t ii)
 {
-        struct var_t *arr = var_new();
+        struct var_t *arr;
+
+        gc_maybe_collect();
+        arr = var_new();
         array_from_empty(arr);
         push(fr, arr);
 }
@@ -586,7 +776,10 @@ do_list_append(struct vmframe_t *fr, instruction_t ii)
 static void
 do_defdict(struct vmframe_t *fr, instruction_t ii)
 {
-        struct var_t *obj = var_new();
+        struct var_t *obj;
+
+        gc_maybe_collect();
+        obj = var_new();
         object_init(obj);
         push(fr, obj);
 }
@@ -623,7 +816,10 @@ do_getattr(struct vmframe_t *fr, instruction_t ii)
 
         obj = pop(fr);
 
-        attr = evar_get_attr(obj, deref);
+        if (!del && deref->magic == TYPE_STRPTR)
+                attr = attr_get_cached(fr, ii, obj);
+        else
+                attr = evar_get_attr(obj, deref);
         /*
          * FIXME: This is hacky, but string_nth_child creates
          * a new var, the others return an existing var, and I need to
@@ -677,8 +873,11 @@ do_b_if(struct vmframe_t *fr, instruction_t ii)
 {
         struct var_t *v = pop(fr);
         bool cond = !qop_cmpz(v);
-        if ((bool)ii.arg1 == cond)
+        if ((bool)ii.arg1 == cond) {
                 fr->ppii += ii.arg2;
+                if (ii.arg2 < 0)
+                        back_edge(fr);
+        }
         VAR_DECR_REF(v);
 }
 
@@ -686,6 +885,91 @@ static void
 do_b(struct vmframe_t *fr, instruction_t ii)
 {
         fr->ppii += ii.arg2;
+        if (ii.arg2 < 0)
+                back_edge(fr);
+}
+
+/*
+ * Helper to do_jump_table: get @v as an integer case key.  A float
+ * matches the integer it equals, the same as with '=='.
+ *
+ * Return: true if @v is an integer or a whole-number float
+ */
+static bool
+jump_table_int_key(struct var_t *v, long long *i)
+{
+        if (v->magic == TYPE_INT) {
+                *i = v->i;
+                return true;
+        }
+        /* 2^63 is exact as a double, and NaN fails both tests */
+        if (v->magic == TYPE_FLOAT
+            && v->f >= -9223372036854775808.0
+            && v->f < 9223372036854775808.0
+            && v->f == (double)(long long)v->f) {
+                *i = (long long)v->f;
+                return true;
+        }
+        return false;
+}
+
+/*
+ * switch statement: pop the value and branch to its case, or to the
+ * default.  Strings are matched by their literal() pointer, the same
+ * way the assembler stored the case keys.
+ */
+static void
+do_jump_table(struct vmframe_t *fr, instruction_t ii)
+{
+        struct jump_table_t *jt;
+        struct var_t *v = pop(fr);
+        long long ival;
+        int off;
+
+        bug_on(ii.arg2 >= fr->ex->n_jtabs);
+        jt = &fr->ex->jtabs[ii.arg2];
+        off = jt->dflt;
+
+        if (ii.arg1 == IARG_JT_DENSE) {
+                if (jump_table_int_key(v, &ival)) {
+                        unsigned long long idx = (unsigned long long)ival
+                                                 - (unsigned long long)jt->min;
+                        if (idx < jt->n)
+                                off = jt->offs[idx];
+                }
+        } else {
+                struct var_t key;
+                void *p = NULL;
+
+                switch (v->magic) {
+                case TYPE_INT:
+                case TYPE_FLOAT:
+                        if (!jump_table_int_key(v, &ival))
+                                break;
+                        key.magic = TYPE_INT;
+                        key.i = ival;
+                        p = hashtable_get(jt->htbl, &key);
+                        break;
+                case TYPE_STRING:
+                case TYPE_STRPTR:
+                        key.magic = TYPE_STRPTR;
+                        if (v->magic == TYPE_STRPTR) {
+                                key.strptr = v->strptr;
+                        } else {
+                                char *s = string_get_cstring(v);
+                                key.strptr = literal(s ? s : "");
+                        }
+                        if (key.strptr)
+                                p = hashtable_get(jt->htbl, &key);
+                        break;
+                default:
+                        break;
+                }
+                if (p)
+                        off = jt->offs[(uintptr_t)p - 1];
+        }
+        fr->ppii += off;
+        VAR_DECR_REF(v);
 }
 
 static void
@@ -709,6 +993,15 @@ do_logical_not(struct vmframe_t *fr, instruction_t ii)
 static void
 do_mul(struct vmframe_t *fr, instruction_t ii)
 {
+        struct var_t *t = temp_lval(fr);
+        if (t) {
+                if (t->magic == TYPE_INT)
+                        t->i *= fr->stackptr[-1]->i;
+                else
+                        t->f *= fr->stackptr[-1]->f;
+                pop_rval(fr);
+                return;
+        }
         binary_op_common(fr, qop_mul);
 }
 
@@ -727,12 +1020,30 @@ do_mod(struct vmframe_t *fr, instruction_t ii)
 static void
 do_add(struct vmframe_t *fr, instruction_t ii)
 {
+        struct var_t *t = temp_lval(fr);
+        if (t) {
+                if (t->magic == TYPE_INT)
+                        t->i += fr->stackptr[-1]->i;
+                else
+                        t->f += fr->stackptr[-1]->f;
+                pop_rval(fr);
+                return;
+        }
         binary_op_common(fr, qop_add);
 }
 
 static void
 do_sub(struct vmframe_t *fr, instruction_t ii)
 {
+        struct var_t *t = temp_lval(fr);
+        if (t) {
+                if (t->magic == TYPE_INT)
+                        t->i -= fr->stackptr[-1]->i;
+                else
+                        t->f -= fr->stackptr[-1]->f;
+                pop_rval(fr);
+                return;
+        }
         binary_op_common(fr, qop_sub);
 }
 
@@ -826,10 +1137,158 @@ static const callfunc_t JUMP_TABLE[N_INSTR] = {
 #include "vm_gen.c.h"
 };
 
+/* B_IF for jit.c, return nonzero if it branches */
+static int
+jit_branch(struct vmframe_t *fr, instruction_t ii)
+{
+        struct var_t *v = pop(fr);
+        bool cond = !qop_cmpz(v);
+        VAR_DECR_REF(v);
+        return (bool)ii.arg1 == cond;
+}
+
+/*
+ * CMP followed by B_IF for jit.c.  Comparing two integers is common
+ * enough in loop conditions that it's worth not making a variable for
+ * the result only to throw it away.
+ */
+static int
+jit_cmp_branch(struct vmframe_t *fr, instruction_t cmp, instruction_t b)
+{
+        struct var_t *rval, *lval;
+        bool res;
+
+        bug_on(fr->stackptr - fr->stack < 2);
+        rval = fr->stackptr[-1];
+        lval = fr->stackptr[-2];
+        if (lval->magic != TYPE_INT || rval->magic != TYPE_INT) {
+                do_cmp(fr, cmp);
+                return jit_branch(fr, b);
+        }
+
+        switch (cmp.arg1) {
+        case IARG_EQ:
+                res = lval->i == rval->i;
+                break;
+        case IARG_LEQ:
+                res = lval->i <= rval->i;
+                break;
+        case IARG_GEQ:
+                res = lval->i >= rval->i;
+                break;
+        case IARG_NEQ:
+                res = lval->i != rval->i;
+                break;
+        case IARG_LT:
+                res = lval->i < rval->i;
+                break;
+        case IARG_GT:
+                res = lval->i > rval->i;
+                break;
+        default:
+                bug();
+                res = false;
+        }
+        fr->stackptr -= 2;
+        VAR_DECR_REF(rval);
+        VAR_DECR_REF(lval);
+        return (bool)b.arg1 == res;
+}
+
+static const struct jit_hooks_t jit_hooks = {
+        .handlers       = JUMP_TABLE,
+        .branch         = jit_branch,
+        .cmp_branch     = jit_cmp_branch,
+        .frame          = &current_frame,
+};
+
+/**
+ * vm_jit_hooks - Get the hooks jit.c uses
+ *
+ * C code written by emit_c.c can't know where the handlers are until
+ * it's linked, so it asks for them here.
+ */
+const struct jit_hooks_t *
+vm_jit_hooks(void)
+{
+        return &jit_hooks;
+}
+
+/* Calls plus backward branches before an executable is translated */
+#define JIT_THRESHOLD 100
+
+/* count a call of, or a backward branch in, @ex, see jit.c */
+static void
+jit_tick(struct executable_t *ex)
+{
+        if (q_.opt.jit && !ex->jit && ++ex->hot == JIT_THRESHOLD)
+                jit_compile(ex, &jit_hooks);
+}
+
+static struct var_t *
+trace_varptr(struct vmframe_t *fr, instruction_t ii)
+{
+        return VARPTR(fr, ii);
+}
+
+static const struct trace_hooks_t trace_hooks = {
+        .handlers       = JUMP_TABLE,
+        .varptr         = trace_varptr,
+};
+
+/*
+ * A backward branch has just been taken to @fr's ppii, the top of a
+ * loop.  Code translated by jit.c takes these branches itself, so this
+ * is only ever reached when interpreting.
+ */
+static void
+back_edge(struct vmframe_t *fr)
+{
+        jit_tick(fr->ex);
+        if (q_.opt.trace && !fr->ex->jit)
+                trace_loop(fr, &trace_hooks);
+}
+
+/*
+ * Line number of @ex's instruction at @offs.  @ex->locations[] is in
+ * order, since the assembler adds them as it goes, and each one's
+ * .offs is one more than its first instruction (see mark_location()),
+ * so the line is that of the last one with .offs <= @offs + 1.
+ */
+static unsigned int
+ex_offs2line(struct executable_t *ex, unsigned int offs)
+{
+        int lo = 0, hi = ex->n_locations;
+
+        if (hi == 0)
+                return 0;
+        /* first one past @offs */
+        while (lo < hi) {
+                int mid = (lo + hi) / 2;
+                if (offs + 1 < ex->locations[mid].offs)
+                        hi = mid;
+                else
+                        lo = mid + 1;
+        }
+        /* ...so the one before it, unless @offs is before them all */
+        if (lo > 0)
+                lo--;
+        return ex->locations[lo].line;
+}
+
+/* offset of the instruction @fr is running, or 0 if it hasn't started */
+static unsigned int
+frame_offs(struct vmframe_t *fr)
+{
+        if (!fr->ppii || fr->ppii <= fr->ex->instr)
+                return 0;
+        return fr->ppii - 1 - fr->ex->instr;
+}
+
 static unsigned int
 vm_get_location(const char **file_name, void *unused)
 {
-        unsigned int i, offs;
+        unsigned int offs;
         struct executable_t *ex;
 
         if (!current_frame) {
@@ -854,23 +1313,33 @@ vm_get_location(const char **file_name, void *unused)
         }
         bug_on((int)offs < 0);
 
-        for (i = 0; i < ex->n_locations; i++) {
-                if (offs < ex->locations[i].offs)
-                        break;
-        }
-        if (i == ex->n_locations)
-                i--;
-        bug_on(i >= ex->n_locations);
-
         if (file_name)
                 *file_name = ex->file_name;
-        return ex->locations[i].line;
+        return ex_offs2line(ex, offs);
 }
 
+/*
+ * If the current frame's code has been through the JIT, or compiled
+ * from the output of --emit-c, run that instead, until it returns here
+ * because the current frame changed.
+ */
 #define EXECUTE_LOOP(CHECK_NULL) do {                                   \
         getloc_push(vm_get_location, NULL);                             \
         instruction_t ii;                                               \
-        while ((ii = *(current_frame->ppii)++).code != INSTR_END) {     \
+        for (;;) {                                                      \
+                struct executable_t *ex_ = current_frame->ex;           \
+                if (ex_->native || ex_->jit) {                          \
+                        int res_ = ex_->native                          \
+                                   ? ex_->native(current_frame)         \
+                                   : jit_run(current_frame);            \
+                        if (res_ == JIT_END)                            \
+                                break;                                  \
+                        if (CHECK_NULL && !current_frame)               \
+                                break;                                  \
+                        continue;                                       \
+                }                                                       \
+                if ((ii = *(current_frame->ppii)++).code == INSTR_END)  \
+                        break;                                          \
                 bug_on((unsigned int)ii.code >= N_INSTR);               \
                 JUMP_TABLE[ii.code](current_frame, ii);                 \
                 /*                                                      \
@@ -1016,6 +1485,44 @@ vm_reenter(struct var_t *func, struct var_t *owner,
         bug_on(!current_frame);
 }
 
+/**
+ * vm_get_stack - Get the script locations of everything being run
+ * @loc:        Array to fill in, innermost call first
+ * @max:        Length of @loc
+ *
+ * Internal functions have no location of their own, so they're left
+ * out, the same way vm_get_location() reports where they were called
+ * from.  Calls back into the script from a built-in function, like a
+ * foreach callback, continue on to the frames that called the
+ * built-in.
+ *
+ * Return: Number of entries filled in, which is @max if the stack was
+ * any deeper.
+ */
+int
+vm_get_stack(struct vm_location_t *loc, int max)
+{
+        struct vmframe_t *fr = current_frame;
+        int reent = vmframe_recursion_stack_idx;
+        int n = 0;
+
+        while (n < max) {
+                if (!fr) {
+                        if (reent <= 0)
+                                break;
+                        fr = vmframe_recursion_stack[--reent];
+                        continue;
+                }
+                if (fr->ex) {
+                        loc[n].file_name = fr->ex->file_name;
+                        loc[n].line = ex_offs2line(fr->ex, frame_offs(fr));
+                        n++;
+                }
+                fr = fr->prev;
+        }
+        return n;
+}
+
 void
 moduleinit_vm(void)
 {
@@ -0,0 +1,61 @@
+/*
+ * Auto-generated code, do not edit
+ * used by vm.c
+ * (see tools/gen.c, tools/instructions)
+ */
+        do_nop,
+        do_load,
+        do_push_local,
+        do_push_const,
+        do_push_ptr,
+        do_pop,
+        do_unwind,
+        do_push_block,
+        do_pop_block,
+        do_break,
+        do_assign,
+        do_assign_add,
+        do_assign_sub,
+        do_assign_mul,
+        do_assign_div,
+        do_assign_mod,
+        do_assign_xor,
+        do_assign_ls,
+        do_assign_rs,
+        do_assign_or,
+        do_assign_and,
+        do_symtab,
+        do_push_zero,
+        do_return_value,
+        do_call_func,
+        do_deffunc,
+        do_add_closure,
+        do_add_default,
+        do_deflist,
+        do_list_append,
+        do_defdict,
+        do_addattr,
+        do_getattr,
+        do_setattr,
+        do_b_if,
+        do_b,
+        do_jump_table,
+        do_bitwise_not,
+        do_negate,
+        do_logical_not,
+        do_mul,
+        do_div,
+        do_mod,
+        do_add,
+        do_sub,
+        do_lshift,
+        do_rshift,
+        do_cmp,
+        do_binary_and,
+        do_binary_or,
+        do_binary_xor,
+        do_logical_or,
+        do_logical_and,
+        do_incr,
+        do_decr,
+        do_end,
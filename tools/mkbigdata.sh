@@ -0,0 +1,39 @@
+#!/bin/sh
+#
+# mkbigdata.sh - Generate a large EvilCandy data-table script, for
+#                timing the assembler on big generated inputs.
+#
+# Usage:        tools/mkbigdata.sh [NLINES] > big.egq
+#               time ./evilcandy big.egq
+#
+# NLINES defaults to 100000.  The output is three list literals (ints,
+# floats, strings), one element per line, which is what machine-made
+# data tables tend to look like.  Values repeat every 10000 entries to
+# stay under the 32767 constants that one executable may hold.
+#
+# Assembly time should scale linearly with NLINES; try 10000, 50000
+# and 100000 and compare.  Much past 100000, an executable's per-line
+# location table outgrows what assert_array_pos() will allocate.
+
+n=${1:-100000}
+
+awk -v n="$n" 'BEGIN {
+        third = int(n / 3);
+        print "// generated by tools/mkbigdata.sh, do not edit";
+        print "let ints = [";
+        for (i = 0; i < third; i++)
+                printf "        %d,\n", i % 10000;
+        print "        -1";
+        print "];";
+        print "let floats = [";
+        for (i = 0; i < third; i++)
+                printf "        %d.5,\n", i % 10000;
+        print "        -1.0";
+        print "];";
+        print "let strs = [";
+        for (i = 0; i < n - 2 * third; i++)
+                printf "        \"key%d\",\n", i % 10000;
+        print "        \"\"";
+        print "];";
+        print "print(\"{} {} {}\".format(ints.len(), floats.len(), strs.len()));";
+}'